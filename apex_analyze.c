@@ -0,0 +1,479 @@
+/*
+ * apex_analyze.c
+ * Contains the static CPI estimator behind the analyze command. It never
+ * simulates the pipeline: each instruction's decode issue cycle follows from
+ * the in-order timing rules of this pipeline,
+ *   - one issue per cycle, later while a multi-cycle execute is busy,
+ *   - a source is readable the cycle its latest producer writes back
+ *     (issue + latency + 2, writeback runs before decode in a cycle),
+ *   - a taken branch redirects fetch, the next issue is 3 cycles after it,
+ * walked over the control flow. Backward BNZ loops whose counter is set by
+ * a MOVC before the loop and stepped by ADDL/SUBL inside it get their trip
+ * count; every other branch is data dependent and both outcomes are explored,
+ * giving a lower and upper bound on the total cycles. LOOP/ENDLOOP hardware
+ * loops run their immediate count, fetch folds their ENDLOOPs at no cost.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Cycles from an issue to the first issue after a taken branch, resolved in
+ * execute or with --early-branch in decode */
+#define TAKEN_BRANCH_GAP 3
+#define EARLY_BRANCH_GAP 2
+
+typedef struct Analyze_Stats
+{
+    long executed;
+    long raw_stall;
+    long busy_stall;
+    long branch_penalty;
+    int producer;               /* Index of the last producer stalled on, -1 */
+} Analyze_Stats;
+
+/* Issue timing state of one walk */
+typedef struct Walk
+{
+    int index;                  /* Next instruction */
+    long next_issue;            /* Earliest issue of the next instruction */
+    long ready[SCOREBOARD_SIZE]; /* Cycle each register can be read */
+    int writer[SCOREBOARD_SIZE]; /* Index of the latest producer */
+    long instructions;
+    long cycles;                /* Clock when HALT retires, 0 if not reached */
+    int *trips_left;            /* Per instruction, taken count of a counted loop */
+    APEX_Hw_Loop loops[HW_LOOP_MAX_DEPTH]; /* Open hardware loops, addr is an index */
+    int loop_depth;
+} Walk;
+
+typedef struct Analysis
+{
+    const APEX_CPU *cpu;
+    int *trips;                 /* Per backward branch, times taken per entry, -1 */
+    Analyze_Stats *stats;       /* Filled by the first (fall-through) walk */
+    int record;
+    long min_cycles;
+    long max_cycles;
+    long min_insns;
+    long max_insns;
+    long issued;                /* Instructions issued by every walk */
+    int leaves;
+    int truncated;              /* Hit ANALYZE_MAX_LEAVES or ANALYZE_MAX_INSNS */
+    int unresolved;             /* Data dependent branch instances explored */
+} Analysis;
+
+/*
+Returns the times a backward BNZ at index b is taken each time its loop is
+entered, or -1 if the counter pattern is not recognised
+*/
+static int
+count_trips(const APEX_CPU *cpu, int b)
+{
+    const APEX_Instruction *code = cpu->code_memory, *step = NULL;
+    int head = b + code[b].imm / 4, i, k, value, delta, trips;
+
+    if (code[b].imm > 0 || head < 0 || code[b].opcode != OPCODE_BNZ)
+    {
+        return -1;
+    }
+
+    /* The branch tests the last flag setter of the body */
+    for (i = b - 1; i >= head; --i)
+    {
+        if (opcode_info[code[i].opcode].sets_zero_flag)
+        {
+            step = &code[i];
+            break;
+        }
+    }
+    if (!step || (step->opcode != OPCODE_ADDL && step->opcode != OPCODE_SUBL)
+        || step->rd != step->rs1)
+    {
+        return -1;
+    }
+    k = step->rd;
+    delta = step->opcode == OPCODE_ADDL ? step->imm : -step->imm;
+
+    /* The counter is only stepped once in the body */
+    for (i = head; i < b; ++i)
+    {
+        if (&code[i] != step && (code[i].dest_mask & (1u << k)))
+        {
+            return -1;
+        }
+    }
+
+    /* And set by the last straight-line write before the loop */
+    for (i = head - 1; i >= 0; --i)
+    {
+        if (opcode_info[code[i].opcode].branch != BRANCH_NONE)
+        {
+            return -1;
+        }
+        if (code[i].dest_mask & (1u << k))
+        {
+            break;
+        }
+    }
+    if (i < 0 || code[i].opcode != OPCODE_MOVC)
+    {
+        return -1;
+    }
+    value = code[i].imm;
+
+    /* value + n * delta reaches 0 after n passes, the branch is taken n - 1 times */
+    if (delta == 0 || value == 0 || (value > 0) == (delta > 0) || value % delta != 0)
+    {
+        return -1;
+    }
+    trips = -value / delta;
+    return trips - 1;
+}
+
+/*
+Issues the instruction at w->index and returns its opcode
+*/
+static int
+issue(Analysis *a, Walk *w)
+{
+    const APEX_Instruction *ins = &a->cpu->code_memory[w->index];
+    int latency = a->cpu->machine.latency[ins->opcode];
+    Analyze_Stats *st = &a->stats[w->index];
+    long t = w->next_issue, raw = w->next_issue;
+    unsigned int bits;
+    int r, producer = -1;
+
+    for (bits = ins->src_mask; bits; bits &= bits - 1)
+    {
+        r = __builtin_ctz(bits);
+        if (w->ready[r] > raw)
+        {
+            raw = w->ready[r];
+            producer = w->writer[r];
+        }
+    }
+    if (raw > t)
+    {
+        if (a->record)
+        {
+            st->raw_stall += raw - t;
+            st->producer = producer;
+        }
+        t = raw;
+    }
+
+    if (ins->dest_mask)
+    {
+        w->ready[ins->rd] = t + APEX_result_delay(a->cpu, ins->opcode);
+        w->writer[ins->rd] = w->index;
+    }
+
+    /* The next instruction waits for execute to free up */
+    w->next_issue = t + latency;
+    if (a->record)
+    {
+        st->executed++;
+        st->busy_stall += latency - 1;
+    }
+    w->instructions++;
+
+    if (ins->opcode == OPCODE_HALT)
+    {
+        w->cycles = t + latency + 2;
+    }
+    return ins->opcode;
+}
+
+static void
+take_branch(Analysis *a, Walk *w, long issued)
+{
+    const APEX_Instruction *ins = &a->cpu->code_memory[w->index];
+    long gap = a->cpu->early_branch ? EARLY_BRANCH_GAP : TAKEN_BRANCH_GAP;
+
+    if (issued + gap > w->next_issue)
+    {
+        if (a->record)
+        {
+            a->stats[w->index].branch_penalty += issued + gap - w->next_issue;
+        }
+        w->next_issue = issued + gap;
+    }
+    w->index += ins->imm / 4;
+}
+
+/*
+Folds the ENDLOOP at w->index as fetch does, returns FALSE if no LOOP is open
+*/
+static int
+end_loop(Walk *w)
+{
+    APEX_Hw_Loop *top;
+
+    if (w->loop_depth == 0)
+    {
+        return FALSE;
+    }
+    top = &w->loops[w->loop_depth - 1];
+    if (top->count > 1)
+    {
+        top->count--;
+        w->index = top->addr;
+    }
+    else
+    {
+        w->loop_depth--;
+        w->index++;
+    }
+    return TRUE;
+}
+
+static void
+finish(Analysis *a, const Walk *w)
+{
+    if (!w->cycles)
+    {
+        a->truncated = TRUE;
+        return;
+    }
+    if (!a->leaves)
+    {
+        a->min_cycles = a->max_cycles = w->cycles;
+        a->min_insns = a->max_insns = w->instructions;
+    }
+    a->min_cycles = w->cycles < a->min_cycles ? w->cycles : a->min_cycles;
+    a->max_cycles = w->cycles > a->max_cycles ? w->cycles : a->max_cycles;
+    a->min_insns = w->instructions < a->min_insns ? w->instructions : a->min_insns;
+    a->max_insns = w->instructions > a->max_insns ? w->instructions : a->max_insns;
+    a->leaves++;
+    a->record = FALSE;
+}
+
+static int
+copy_walk(const Analysis *a, const Walk *from, Walk *to)
+{
+    *to = *from;
+    to->trips_left = malloc(a->cpu->code_memory_size * sizeof(int));
+    if (!to->trips_left)
+    {
+        return -1;
+    }
+    memcpy(to->trips_left, from->trips_left, a->cpu->code_memory_size * sizeof(int));
+    return 0;
+}
+
+/*
+Follows the control flow from w, a data dependent branch forks the walk
+(fall-through first) until ANALYZE_MAX_LEAVES walks have ended
+*/
+static void
+walk(Analysis *a, Walk *w)
+{
+    const APEX_CPU *cpu = a->cpu;
+    Walk taken;
+    long issued;
+    int opcode;
+
+    while (w->index >= 0 && w->index < cpu->code_memory_size)
+    {
+        /* An ENDLOOP with no open LOOP stops the simulator too */
+        if (cpu->code_memory[w->index].opcode == OPCODE_ENDLOOP)
+        {
+            if (!end_loop(w))
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (a->issued++ >= ANALYZE_MAX_INSNS)
+        {
+            break;
+        }
+
+        opcode = issue(a, w);
+        issued = w->next_issue - cpu->machine.latency[opcode];
+
+        if (opcode == OPCODE_HALT)
+        {
+            finish(a, w);
+            return;
+        }
+
+        if (opcode == OPCODE_LOOP)
+        {
+            if (w->loop_depth == cpu->machine.loop_depth)
+            {
+                break;
+            }
+            w->loops[w->loop_depth].addr = w->index + 1;
+            w->loops[w->loop_depth].count = cpu->code_memory[w->index].imm;
+            w->loop_depth++;
+        }
+
+        if (opcode_info[opcode].branch == BRANCH_NONE)
+        {
+            w->index++;
+            continue;
+        }
+
+        if (a->trips[w->index] >= 0)
+        {
+            /* Counted loop, taken until its count runs out, then reset */
+            if (w->trips_left[w->index] > 0)
+            {
+                w->trips_left[w->index]--;
+                take_branch(a, w, issued);
+            }
+            else
+            {
+                w->trips_left[w->index] = a->trips[w->index];
+                w->index++;
+            }
+            continue;
+        }
+
+        /* Data dependent, explore both outcomes */
+        a->unresolved++;
+        if (a->leaves + 1 >= ANALYZE_MAX_LEAVES || copy_walk(a, w, &taken) < 0)
+        {
+            a->truncated = TRUE;
+            w->index++;
+            continue;
+        }
+        w->index++;
+        walk(a, w);
+        take_branch(a, &taken, issued);
+        walk(a, &taken);
+        free(taken.trips_left);
+        return;
+    }
+
+    finish(a, w);
+}
+
+static void
+print_source(const APEX_Instruction *ins)
+{
+    const int *fields = opcode_info[ins->opcode].fields;
+    int i, v;
+
+    printf("%s", ins->opcode_str);
+    for (i = 0; i < MAX_OPERANDS && fields[i] != FIELD_NONE; ++i)
+    {
+        switch (fields[i])
+        {
+            case FIELD_RD: v = ins->rd; break;
+            case FIELD_RS1: v = ins->rs1; break;
+            case FIELD_RS2: v = ins->rs2; break;
+            case FIELD_RS3: v = ins->rs3; break;
+            case FIELD_VD: v = ins->rd - REG_FILE_SIZE; break;
+            case FIELD_VS1: v = ins->rs1 - REG_FILE_SIZE; break;
+            case FIELD_VS2: v = ins->rs2 - REG_FILE_SIZE; break;
+            default: v = ins->imm; break;
+        }
+        printf(",%c%d", APEX_field_prefix(fields[i]), v);
+    }
+}
+
+/*
+Predicts stalls per instruction and the total cycles of the loaded program
+without running it
+*/
+void
+APEX_analyze(const APEX_CPU *cpu)
+{
+    const Analyze_Stats *st;
+    Analysis a;
+    Walk w;
+    long raw = 0, busy = 0, branch = 0;
+    int i;
+
+    memset(&a, 0, sizeof(a));
+    memset(&w, 0, sizeof(w));
+    a.cpu = cpu;
+    a.record = TRUE;
+    a.trips = malloc(cpu->code_memory_size * sizeof(int));
+    a.stats = calloc(cpu->code_memory_size, sizeof(Analyze_Stats));
+    w.trips_left = malloc(cpu->code_memory_size * sizeof(int));
+    if (!a.trips || !a.stats || !w.trips_left)
+    {
+        fprintf(stderr, "APEX_Error: Unable to allocate analysis\n");
+        goto out;
+    }
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        a.stats[i].producer = -1;
+        a.trips[i] = opcode_info[cpu->code_memory[i].opcode].branch != BRANCH_NONE
+                     ? count_trips(cpu, i) : -1;
+        w.trips_left[i] = a.trips[i];
+    }
+
+    /* The first instruction is fetched in cycle 1 and issues in cycle 2 */
+    w.next_issue = 2;
+    walk(&a, &w);
+
+    printf("APEX_ANALYZE: %s, %d instructions, stalls of the fall-through path\n",
+           cpu->filename, cpu->code_memory_size);
+    printf("%5s %5s %9s %9s %10s %9s  %s\n", "line", "pc", "executed", "raw_stall",
+           "busy_stall", "branch", "instruction");
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        st = &a.stats[i];
+        printf("%5d %5d %9ld %9ld %10ld %9ld  ", cpu->code_memory[i].line, 4000 + 4 * i,
+               st->executed, st->raw_stall, st->busy_stall, st->branch_penalty);
+        print_source(&cpu->code_memory[i]);
+        if (st->producer >= 0)
+        {
+            printf("  (waits on line %d)", cpu->code_memory[st->producer].line);
+        }
+        if (a.trips[i] >= 0)
+        {
+            printf("  (loop taken %d times per entry)", a.trips[i]);
+        }
+        printf("\n");
+        raw += st->raw_stall;
+        busy += st->busy_stall;
+        branch += st->branch_penalty;
+    }
+
+    printf("\nAPEX_ANALYZE: stall cycles raw = %ld busy = %ld taken branch = %ld\n", raw,
+           busy, branch);
+    if (!a.leaves)
+    {
+        printf("APEX_ANALYZE: HALT not reached within %d instructions\n", ANALYZE_MAX_INSNS);
+    }
+    else if (!a.unresolved)
+    {
+        printf("APEX_ANALYZE: predicted cycles = %ld instructions = %ld CPI = %.3f\n",
+               a.min_cycles, a.min_insns, (double)a.min_cycles / a.min_insns);
+    }
+    else
+    {
+        printf("APEX_ANALYZE: %d data dependent branch instances, predicted cycles = %ld to %ld "
+               "(instructions = %ld to %ld)%s\n", a.unresolved, a.min_cycles,
+               a.max_cycles, a.min_insns, a.max_insns,
+               a.truncated ? ", not every path explored" : "");
+    }
+    if (cpu->machine.fusion)
+    {
+        printf("APEX_ANALYZE: macro-op fusion is not modelled\n");
+    }
+    if (cpu->machine.queue || cpu->machine.loop_buffer)
+    {
+        printf("APEX_ANALYZE: the instruction queue and loop buffer are not modelled\n");
+    }
+    if (cpu->machine.mem_latency > 1 || cpu->machine.store_buffer || cpu->machine.load_queue
+        || cpu->machine.prefetch != PREFETCH_NONE || cpu->machine.banks)
+    {
+        printf("APEX_ANALYZE: memory latency only delays load results, MEM stalls, "
+               "bank conflicts and prefetching are not modelled\n");
+    }
+
+out:
+    free(a.trips);
+    free(a.stats);
+    free(w.trips_left);
+}
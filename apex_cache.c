@@ -0,0 +1,329 @@
+/*
+ * apex_cache.c
+ * Contains the on-disk result cache. A run of simulate or show_mem is keyed
+ * by a hash of the simulator build, the command and its cycle count, the
+ * decoded code memory and the initial registers and data memory. The entry
+ * is a Cache_Result holding the values the run left (registers, data memory,
+ * dirty bits, clock, retired count and statistics) and the pipeline state the
+ * stepping after simulate carries on from, never host pointers, so a hit
+ * prints exactly what the run would have printed without simulating it.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Every rebuild of the simulator starts a fresh cache */
+#define CACHE_BUILD_ID __DATE__ " " __TIME__
+
+typedef struct Cache_Header
+{
+    char magic[4];              /* CACHE_MAGIC */
+    unsigned int version;       /* CACHE_VERSION */
+    unsigned long long key;
+    unsigned int result_size;   /* sizeof(Cache_Result) of the writer */
+    int outcome;                /* RUN_* that ended the run */
+} Cache_Header;
+
+/* State a run ended in, see save_result and load_result */
+typedef struct Cache_Result
+{
+    /* Results */
+    int pc;
+    int clock;
+    int insn_completed;
+    int regs[REG_FILE_SIZE];
+    int vregs[VREG_FILE_SIZE][VECTOR_MAX_LENGTH];
+    int zero_flag;
+    int data_memory[DATA_MEMORY_SIZE];
+    unsigned int mem_dirty_pages[BITMAP_WORDS(DATA_MEMORY_PAGES)];
+    unsigned int mem_dirty[BITMAP_WORDS(DATA_MEMORY_SIZE)];
+    unsigned int reg_dirty;
+    int watch_hit;
+
+    /* Statistics */
+    long early_taken;
+    long early_saved;
+    long fusible;
+    long fused;
+    long fe_bubbles;
+    long loop_hits;
+    long loop_exits;
+    long hw_loops_entered;
+    long hw_loop_passes;
+    long hw_loop_jumps;
+    long mem_stalls;
+    long sb_full;
+    long lq_full;
+    long loads;
+    long loads_forwarded;
+    long pf_issued;
+    long pf_useful;
+    long pf_hits;
+    long pf_late;
+    long pf_misses;
+    long bank_accesses[MEMORY_MAX_BANKS];
+    long bank_busy[MEMORY_MAX_BANKS];
+    long bank_conflicts[MEMORY_MAX_BANKS];
+    long next_uid;
+
+    /* Pipeline */
+    int pending[SCOREBOARD_SIZE];
+    unsigned int pending_mask;
+    int stall;
+    int early_redirect;
+    CPU_Stage queue[FRONTEND_MAX_QUEUE];
+    int queue_head;
+    int queue_count;
+    int loop_start;
+    int loop_end;
+    unsigned int loop_filled;
+    int loop_valid;
+    APEX_Hw_Loop hw_loops[HW_LOOP_MAX_DEPTH];
+    int hw_loop_depth;
+    APEX_Hw_Loop fetch_loops[HW_LOOP_MAX_DEPTH];
+    int fetch_loop_depth;
+    APEX_Mem_Op store_buffer[STORE_BUFFER_MAX];
+    int sb_head;
+    int sb_count;
+    int sb_issued;
+    APEX_Mem_Op load_queue[LOAD_QUEUE_MAX];
+    int lq_head;
+    int lq_count;
+    APEX_Prefetch_Line prefetch_buffer[PREFETCH_MAX_LINES];
+    int pf_next;
+    APEX_Stride_Entry stride_table[PREFETCH_TABLE_SIZE];
+    int bank_free_at[MEMORY_MAX_BANKS][BANK_MAX_PORTS];
+    int fetch_held;
+    CPU_Stage latch[2][NUM_STAGES];
+    int cur;
+} Cache_Result;
+
+static unsigned long long
+hash_bytes(unsigned long long h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; ++i)
+    {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static unsigned long long
+hash_int(unsigned long long h, int value)
+{
+    return hash_bytes(h, &value, sizeof(value));
+}
+
+/*
+Returns TRUE if runs of this CPU may use the cache. Anything that prints or
+writes during the run (watchpoints, profile, trace, live state) opts out
+*/
+static int
+cacheable(const APEX_CPU *cpu)
+{
+    int i;
+
+    if (!cpu->cache_dir || cpu->profile || cpu->konata || cpu->shm || cpu->history
+        || cpu->reg_watch)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < BITMAP_WORDS(DATA_MEMORY_SIZE); ++i)
+    {
+        if (cpu->mem_watch[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Fields of Cache_Result named like their APEX_CPU counterparts, data_memory
+ * apart because the CPU only points at it */
+#define RESULT_FIELDS(X)                                                     \
+    X(pc) X(clock) X(insn_completed) X(regs) X(vregs) X(zero_flag)           \
+    X(mem_dirty_pages) X(mem_dirty) X(reg_dirty) X(watch_hit)                \
+    X(early_taken) X(early_saved) X(fusible) X(fused) X(fe_bubbles)          \
+    X(loop_hits) X(loop_exits) X(hw_loops_entered) X(hw_loop_passes)         \
+    X(hw_loop_jumps) X(mem_stalls) X(sb_full) X(lq_full) X(loads)            \
+    X(loads_forwarded) X(pf_issued) X(pf_useful) X(pf_hits) X(pf_late)       \
+    X(pf_misses) X(bank_accesses) X(bank_busy) X(bank_conflicts) X(next_uid) \
+    X(pending) X(pending_mask) X(stall) X(early_redirect) X(queue)           \
+    X(queue_head) X(queue_count) X(loop_start) X(loop_end) X(loop_filled)    \
+    X(loop_valid) X(hw_loops) X(hw_loop_depth) X(fetch_loops)                \
+    X(fetch_loop_depth) X(store_buffer) X(sb_head) X(sb_count) X(sb_issued)  \
+    X(load_queue) X(lq_head) X(lq_count) X(prefetch_buffer) X(pf_next)       \
+    X(stride_table) X(bank_free_at) X(fetch_held) X(latch) X(cur)
+
+/*
+Copies the state a run ended in from the CPU into r
+*/
+static void
+save_result(Cache_Result *r, const APEX_CPU *cpu)
+{
+#define SAVE(field) memcpy(&r->field, &cpu->field, sizeof(r->field));
+    RESULT_FIELDS(SAVE)
+#undef SAVE
+    memcpy(r->data_memory, cpu->data_memory, sizeof(r->data_memory));
+}
+
+/*
+Moves the CPU to the state saved in r
+*/
+static void
+load_result(APEX_CPU *cpu, const Cache_Result *r)
+{
+#define LOAD(field) memcpy(&cpu->field, &r->field, sizeof(r->field));
+    RESULT_FIELDS(LOAD)
+#undef LOAD
+    memcpy(cpu->data_memory, r->data_memory, sizeof(r->data_memory));
+}
+
+static void
+cache_path(const APEX_CPU *cpu, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.apxc", cpu->cache_dir, cpu->cache_key);
+}
+
+/*
+Keys a run that is about to start and looks it up. On a hit the CPU is moved
+to the cached final state, *outcome is set and TRUE returned
+*/
+int
+APEX_cache_lookup(APEX_CPU *cpu, const char *command, int step, int *outcome)
+{
+    const APEX_Instruction *ins;
+    unsigned long long h = 14695981039346656037ull;
+    Cache_Result *result;
+    Cache_Header hdr;
+    char path[4096];
+    FILE *fp;
+    int i, hit = FALSE;
+
+    cpu->cache_key = 0;
+    if (!cacheable(cpu))
+    {
+        return FALSE;
+    }
+
+    h = hash_bytes(h, CACHE_BUILD_ID, sizeof(CACHE_BUILD_ID));
+    h = hash_bytes(h, command, strlen(command) + 1);
+    h = hash_int(h, step);
+    for (i = 0; i < NUM_OPCODES; ++i)
+    {
+        /* The name is a pointer, hash its text and the plain fields after it */
+        h = hash_bytes(h, opcode_info[i].name, strlen(opcode_info[i].name));
+        h = hash_bytes(h, &opcode_info[i].fields,
+                       sizeof(APEX_Opcode_Info) - offsetof(APEX_Opcode_Info, fields));
+    }
+    h = hash_int(h, cpu->code_memory_size);
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        ins = &cpu->code_memory[i];
+        h = hash_int(h, ins->opcode);
+        h = hash_int(h, ins->rd);
+        h = hash_int(h, ins->rs1);
+        h = hash_int(h, ins->rs2);
+        h = hash_int(h, ins->rs3);
+        h = hash_int(h, ins->imm);
+    }
+    h = hash_int(h, cpu->pc);
+    h = hash_int(h, cpu->clock);
+    h = hash_bytes(h, cpu->regs, sizeof(cpu->regs));
+    h = hash_bytes(h, cpu->data_memory, DATA_MEMORY_SIZE * sizeof(int));
+    h = hash_bytes(h, cpu->mem_watch_halt, sizeof(cpu->mem_watch_halt));
+    h = hash_int(h, cpu->reg_watch_halt);
+    h = hash_int(h, cpu->early_branch);
+    h = hash_bytes(h, &cpu->machine, sizeof(cpu->machine));
+    cpu->cache_key = h ? h : 1;
+
+    cache_path(cpu, path, sizeof(path));
+    fp = fopen(path, "rb");
+    if (!fp)
+    {
+        return FALSE;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) == 1
+        && memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) == 0
+        && hdr.version == CACHE_VERSION && hdr.key == cpu->cache_key
+        && hdr.result_size == sizeof(Cache_Result))
+    {
+        result = malloc(sizeof(Cache_Result));
+        if (result && fread(result, sizeof(Cache_Result), 1, fp) == 1)
+        {
+            load_result(cpu, result);
+            *outcome = hdr.outcome;
+            hit = TRUE;
+        }
+        free(result);
+    }
+
+    fclose(fp);
+    if (hit && ENABLE_DEBUG_MESSAGES)
+    {
+        fprintf(stderr, "APEX_CPU: Result cache hit %s\n", path);
+    }
+    return hit;
+}
+
+/*
+Saves the state a keyed run ended in, written to a temporary file and renamed
+so concurrent runs never see a partial entry
+*/
+void
+APEX_cache_store(const APEX_CPU *cpu, int outcome)
+{
+    Cache_Result *result;
+    Cache_Header hdr;
+    char path[4096], tmp[4200];
+    FILE *fp;
+    int ok;
+
+    if (!cpu->cache_key)
+    {
+        return;
+    }
+
+    result = malloc(sizeof(Cache_Result));
+    if (!result)
+    {
+        return;
+    }
+    save_result(result, cpu);
+
+    cache_path(cpu, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "APEX_Error: Unable to write result cache %s\n", tmp);
+        free(result);
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CACHE_VERSION;
+    hdr.key = cpu->cache_key;
+    hdr.result_size = sizeof(Cache_Result);
+    hdr.outcome = outcome;
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(result, sizeof(Cache_Result), 1, fp) == 1;
+    ok &= fclose(fp) == 0;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to write result cache %s\n", path);
+        unlink(tmp);
+    }
+    free(result);
+}
@@ -2,6 +2,7 @@
  * apex_cpu.c
  * Contains APEX cpu pipeline implementation
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,139 +13,85 @@
 /* 
 Converts the PC(4000 series) into array index for code memory
  */
-static int
+int
 get_code_memory_index_from_pc(const int pc)
 {
     return (pc - 4000) / 4;
 }
 
-static void
-print_instruction(const CPU_Stage *stage)
+/*
+Returns the register number or immediate a FIELD_* refers to, vector
+registers numbered from 0
+*/
+static int
+get_stage_field(const CPU_Stage *stage, int field)
 {
-    switch (stage->opcode)
+    switch (field)
     {
-        case OPCODE_ADD:
-        {
-             printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-             break;
-        }
-        case OPCODE_ADDL:
-        {
-             printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->imm);
-             break;
-        }
-        case OPCODE_SUB:
-        {
-             printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-             break;
-        }
-        case OPCODE_SUBL:
-        {
-             printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->imm);
-             break;
-        }
-        case OPCODE_MUL:
-        {
-             printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-             break;
-        }
-        case OPCODE_DIV:
-        {
-             printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-             break;
-        }
-        case OPCODE_AND:
-        {
-             printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-             break;
-        }
-        case OPCODE_OR:
-        {
-             printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-             break;
-        }
-        case OPCODE_XOR:
-        {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-            break;
-        }
-
-        case OPCODE_MOVC:
-        {
-            printf("%s,R%d,#%d ", stage->opcode_str, stage->rd, stage->imm);
-            break;
-        }
-
-        case OPCODE_LOAD:
-        {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->imm);
-            break;
-        }
-
-        case OPCODE_LDR:
-        {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
-            break;
-        }
-
-        case OPCODE_STORE:
-        {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rs1, stage->rs2,
-                   stage->imm);
-            break;
-        }
-
-        case OPCODE_STR:
-        {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rs3, stage->rs1,
-                   stage->rs2);
-            break;
-        }
-
-        case OPCODE_BZ:
-        {
-            printf("%s,#%d ", stage->opcode_str, stage->imm);
-            break;
-        }
-
-        case OPCODE_CMP:
-        {
-            printf("%s,R%d,R%d ", stage->opcode_str, stage->rs1, stage->rs2);
-            break;
-        }
+        case FIELD_RD:
+            return stage->rd;
+        case FIELD_RS1:
+            return stage->rs1;
+        case FIELD_RS2:
+            return stage->rs2;
+        case FIELD_RS3:
+            return stage->rs3;
+        case FIELD_IMM:
+            return stage->imm;
+        case FIELD_VD:
+            return stage->rd - REG_FILE_SIZE;
+        case FIELD_VS1:
+            return stage->rs1 - REG_FILE_SIZE;
+        case FIELD_VS2:
+            return stage->rs2 - REG_FILE_SIZE;
+    }
+    return 0;
+}
 
-        case OPCODE_NOP:
-        {
-            printf("%s ", stage->opcode_str);
-            break;
-        }
+/*
+Returns the value a SRC_* selects from a stage latch
+*/
+static int
+get_stage_operand(const CPU_Stage *stage, int src)
+{
+    switch (src)
+    {
+        case SRC_RS1:
+            return stage->rs1_value;
+        case SRC_RS2:
+            return stage->rs2_value;
+        case SRC_RS3:
+            return stage->rs3_value;
+        case SRC_IMM:
+            return stage->imm;
+    }
+    return 0;
+}
 
-        case OPCODE_BNZ:
-        {
-            printf("%s,#%d ", stage->opcode_str, stage->imm);
-            break;
-        }
+/*
+Prints an instruction in assembly syntax, without a trailing space
+*/
+void
+APEX_fprint_instruction(FILE *fp, const CPU_Stage *stage)
+{
+    const int *fields = opcode_info[stage->opcode].fields;
+    int i;
 
-        case OPCODE_HALT:
-        {
-            printf("%s", stage->opcode_str);
-            break;
-        }
+    fprintf(fp, "%s", opcode_info[stage->opcode].name);
 
+    for (i = 0; i < MAX_OPERANDS && fields[i] != FIELD_NONE; ++i)
+    {
+        fprintf(fp, ",%c%d", APEX_field_prefix(fields[i]), get_stage_field(stage, fields[i]));
     }
 }
 
+static void
+print_instruction(const CPU_Stage *stage)
+{
+    APEX_fprint_instruction(stdout, stage);
+    printf(" ");
+}
+
 /* 
 Debug function which prints the CPU stage content 
 */
@@ -153,6 +100,10 @@ print_stage_content(const char *name, const CPU_Stage *stage)
 {
     printf("%-40s pc(%d) ", name, stage->pc);
     print_instruction(stage);
+    if (stage->fused)
+    {
+        printf("+ %s,#%d ", opcode_info[stage->fused].name, stage->fused_imm);
+    }
     printf("\n");
 }
 
@@ -184,10 +135,6 @@ print_reg_file(const APEX_CPU *cpu)
 */
 
 
-// flag value for 16 registers to check data dependancies
-int flags[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-// helper variable to stop fetching new instruction at fetch stage 
-int stall = 0;
 //if command line argument == simulate then flag will be 1.
 int command_simulate = 0;
 
@@ -195,997 +142,2283 @@ int command_simulate = 0;
 // Print register file
 static void print_reg_flag(const APEX_CPU *cpu)
 {
-   int i;
+   int i, j;
 
    printf("=============== STATE OF ARCHITECTURAL REGISTER FILE ============== \n");
    printf("If register's status is 0 then its valid else if 1 then invalid \n");
 
-   for(i = 0; i < REG_FILE_SIZE; i++)
+   for(i = 0; i < cpu->machine.registers; i++)
    {
-     printf("| REG[%-2d] | Value = %-4d | Status = %d |", i, cpu->regs[i], flags[i]);
+     // in diff mode only registers written during the run are printed
+     if (cpu->dump_mode == DUMP_DIFF && !(cpu->reg_dirty & (1u << i)))
+     {
+        continue;
+     }
+     printf("| REG[%-2d] | Value = %-4d | Status = %d |", i, cpu->regs[i], cpu->pending[i]);
      printf("\n");
    }
+
+   // the vector register file only shows for programs using it
+   if (!APEX_vector_used(cpu))
+   {
+      return;
+   }
+   for(i = 0; i < VREG_FILE_SIZE; i++)
+   {
+     if (cpu->dump_mode == DUMP_DIFF && !(cpu->reg_dirty & (1u << (REG_FILE_SIZE + i))))
+     {
+        continue;
+     }
+     printf("| VREG[%-2d] | Values =", i);
+     for(j = 0; j < cpu->machine.vector_length; j++)
+     {
+        printf(" %d", cpu->vregs[i][j]);
+     }
+     printf(" | Status = %d |\n", cpu->pending[REG_FILE_SIZE + i]);
+   }
+}
+
+static void print_mem_word(const APEX_CPU *cpu, int i)
+{
+    printf("|   MEM[%-2d]   |   Data Value = %d   |", i, cpu->data_memory[i]);
+    printf("\n");
 }
 
-//print 0 to 99 memory location
+//print 0 to 99 memory location, a range of them, or only the written ones
 static void print_mem(const APEX_CPU *cpu)
 {
-   int i;
+   int i, page, word;
+   unsigned int bits;
 
    printf("============== STATE OF DATA MEMORY ============= \n");
 
-   for(i = 0; i < 100; i++)
+   if (cpu->dump_mode == DUMP_DIFF)
    {
-    printf("|   MEM[%-2d]   |   Data Value = %d   |", i, cpu->data_memory[i]);
-    printf("\n");
+      // walk the page bitmap first so clean pages cost nothing
+      for (page = 0; page < DATA_MEMORY_PAGES; page++)
+      {
+         if (!(cpu->mem_dirty_pages[page / 32] & (1u << (page % 32))))
+         {
+            continue;
+         }
+         for (word = page * DATA_MEMORY_PAGE_WORDS / 32;
+              word < (page + 1) * DATA_MEMORY_PAGE_WORDS / 32; word++)
+         {
+            for (bits = cpu->mem_dirty[word]; bits; bits &= bits - 1)
+            {
+               print_mem_word(cpu, word * 32 + __builtin_ctz(bits));
+            }
+         }
+      }
+      return;
+   }
+
+   if (cpu->dump_mode == DUMP_RANGE)
+   {
+      for (i = cpu->dump_lo; i < cpu->dump_hi && i < cpu->machine.mem_size; i++)
+      {
+         print_mem_word(cpu, i);
+      }
+      return;
    }
+
+   for(i = 0; i < 100 && i < cpu->machine.mem_size; i++)
+   {
+    print_mem_word(cpu, i);
+   }
+}
+
+/*
+Prints the register file and data memory at the end of a run
+*/
+void
+APEX_print_state(const APEX_CPU *cpu)
+{
+    printf("\n");
+    print_reg_flag(cpu);
+    printf("\n");
+    print_mem(cpu);
+    printf("\n");
+}
+
+/*
+Writes a register and checks its watchpoint bit, the write is logged with
+the rest of the cycle's output
+*/
+static void
+write_reg(APEX_CPU *cpu, int reg, int value)
+{
+    cpu->regs[reg] = value;
+    cpu->reg_dirty |= 1u << reg;
+
+    if ((cpu->reg_break & (1u << reg)) && cpu->reg_break_value[reg] == value)
+    {
+        cpu->break_hit = BREAK_REG;
+        cpu->break_reg = reg;
+    }
+
+    if (cpu->reg_watch_halt & (1u << reg))
+    {
+        cpu->watch_hit = TRUE;
+    }
 }
 
+/*
+Writes the elements of a vector register, numbered after the integer ones.
+Watchpoints and register breaks only take R<n> (see APEX_watch_reg and the
+debugger's break reg), so there is none to check here
+*/
+static void
+write_vreg(APEX_CPU *cpu, int reg, const int *values)
+{
+    memcpy(cpu->vregs[reg - REG_FILE_SIZE], values, cpu->machine.vector_length * sizeof(int));
+    cpu->reg_dirty |= 1u << reg;
+}
 
+/*
+Reads a data memory word, a core sharing memory sees its own held stores
+*/
+static int
+read_mem(const APEX_CPU *cpu, int addr)
+{
+    if (cpu->stores && (cpu->stores->held[addr / 32] & (1u << (addr % 32))))
+    {
+        return cpu->stores->value[addr];
+    }
+    return cpu->data_memory[addr];
+}
 
 /*
-Fetch Stage of APEX Pipeline
+Writes a data memory word, marks it dirty and checks its watchpoint bit, the
+write is logged with the rest of the cycle's output
 */
 static void
-APEX_fetch(APEX_CPU *cpu)
+write_mem(APEX_CPU *cpu, int addr, int value)
 {
+    unsigned int bit = 1u << (addr % 32);
 
-    APEX_Instruction *current_ins;
+    if (cpu->history)
+    {
+        APEX_history_mem_write(cpu, addr, cpu->data_memory[addr]);
+    }
 
-    if (cpu->fetch.has_insn)
+    if (cpu->stores)
     {
-        /* This fetches new branch target instruction from next cycle */
-        if (cpu->fetch_from_next_cycle == TRUE)
+        /* Shared memory only changes between quanta */
+        if (!(cpu->stores->held[addr / 32] & bit))
         {
-            cpu->fetch_from_next_cycle = FALSE;
-
-            /* Skip this cycle*/
-            return;
+            cpu->stores->held[addr / 32] |= bit;
+            cpu->stores->addr[cpu->stores->count++] = addr;
         }
+        cpu->stores->value[addr] = value;
+    }
+    else
+    {
+        cpu->data_memory[addr] = value;
+    }
+    cpu->mem_dirty[addr / 32] |= bit;
+    cpu->mem_dirty_pages[addr / DATA_MEMORY_PAGE_WORDS / 32]
+        |= 1u << (addr / DATA_MEMORY_PAGE_WORDS % 32);
 
-        /* Store current PC in fetch latch */
-        cpu->fetch.pc = cpu->pc;
+    if (cpu->mem_watch_halt[addr / 32] & bit)
+    {
+        cpu->watch_hit = TRUE;
+    }
+}
 
-        // if stall caused in fetch by decode stage, then skip cycle
 
-        /* Index into code memory using this pc and copy all instruction fields
-         * into fetch latch  */
-        current_ins = &cpu->code_memory[get_code_memory_index_from_pc(cpu->pc)];
-        strcpy(cpu->fetch.opcode_str, current_ins->opcode_str);
-        cpu->fetch.opcode = current_ins->opcode;
-        cpu->fetch.rd = current_ins->rd;
-        cpu->fetch.rs1 = current_ins->rs1;
-        cpu->fetch.rs2 = current_ins->rs2;
-        cpu->fetch.rs3 = current_ins->rs3;
-        cpu->fetch.imm = current_ins->imm;
 
-        if(stall == 1){
-            if (ENABLE_DEBUG_MESSAGES && command_simulate == 0) {
-            print_stage_content("Instruction at FETCH_STAGE     --->", &cpu->fetch);
-            }
-            return;
-        }
+/*
+Marks an empty latch with the reason it is empty
+*/
+static void
+set_bubble(CPU_Stage *stage, int cause, int pc, int pc2)
+{
+    stage->has_insn = FALSE;
+    stage->bubble_cause = cause;
+    stage->bubble_pc = pc;
+    stage->bubble_pc2 = pc2;
+}
 
-        /* Update PC for next instruction */
-        cpu->pc += 4;
+/*
+Moves the bubble of an empty stage on to the next latch
+*/
+static void
+pass_bubble(CPU_Stage *to, const CPU_Stage *from)
+{
+    set_bubble(to, from->bubble_cause, from->bubble_pc, from->bubble_pc2);
+}
 
-        /* Copy data from fetch latch to decode latch*/
-        cpu->decode = cpu->fetch;
-        
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
-        {
-            print_stage_content("Instruction at FETCH_STAGE     --->", &cpu->fetch);
-        }
+/*
+Decisions of one cycle that a stage needs from the stages after it. They are
+taken from the current latches before any stage runs, so the stages only
+read latch[cur] and may be evaluated in any order
+*/
+typedef struct Cycle_Control
+{
+    int ex_done;            /* Execute latch finishes its last cycle */
+    int ex_busy;            /* Execute latch holds a multi-cycle operation */
+    int ex_taken;           /* Branch in execute is taken */
+    int ex_redirect;        /* Fetch went the other way, decode is flushed */
+    int zero_flag;          /* Flag a branch in decode sees */
+    int d_valid;            /* Decode latch holds an instruction not flushed */
+    int d_stall;            /* It stays in decode */
+    int d_taken;            /* It is a branch resolved taken in decode */
+    int d_redirect;         /* Fetch went the other way */
+    int fusible;            /* It sets the flag for the branch after it */
+    int fuse;               /* And fuses with it as that moves into decode */
+    unsigned int raw;       /* Registers it waits on */
+    int redirect;           /* Fetch is sent down the resolved path */
+    int stall;              /* Stall flag, cpu->stall next cycle */
+    int fetch_held;         /* Fetch latch held an instruction */
+    int fetching;           /* Fetch reads an instruction */
+    int held;               /* Fetch keeps it, decode stalls */
+    int pop;                /* The oldest queued instruction moves to decode */
+    int push;               /* The fetched instruction is queued */
+    int fetch_fills;        /* The front end moves an instruction into decode */
+    int mem_busy;           /* MEM keeps its instruction */
+    int mem_start;          /* It starts an access that holds MEM */
+    int mem_ready;          /* MEM passes a result on to writeback */
+    int mem_forward;        /* A load takes its value from the store buffer */
+    int forward_value;
+    int mem_cycles;         /* Cycles its access takes otherwise */
+    int pf_entry;           /* Prefetch buffer line it hits, -1 if none */
+    int pf_train;           /* Its access starts and trains the prefetcher */
+    int mem_port;           /* It starts an access on a memory port */
+    int bank_wait;          /* Every port of its bank is busy */
+    int vector_wait;        /* It is a vector access waiting for the store buffer */
+    int sb_full;            /* A store waits for a store buffer entry */
+    int sb_push;            /* It takes one */
+    int sb_issue;           /* The oldest unsent store goes to memory */
+    int drain_wait;         /* Every port of its bank is busy */
+    int drain_cycles;       /* Cycles its access takes */
+    int sb_done;            /* The oldest store writes memory */
+    APEX_Mem_Op drain;      /* Which is this one */
+    int lq_full;            /* A load waits for a load queue entry */
+    int lq_issue;           /* It takes one */
+    int lq_done;            /* The oldest queued load writes its register */
+    APEX_Mem_Op ret;        /* Which is this one */
+    unsigned int lq_pending; /* Registers queued loads still have to write */
+} Cycle_Control;
+
+/*
+Returns the PC of the youngest in-flight instruction writing any register in
+src_mask that does not retire this cycle, 0 if there is none
+*/
+static int
+find_producer_pc(const APEX_CPU *cpu, unsigned int src_mask)
+{
+    const CPU_Stage *execute = CUR_LATCH(cpu, STAGE_EXECUTE);
+    const CPU_Stage *memory = CUR_LATCH(cpu, STAGE_MEMORY);
+    const APEX_Mem_Op *load;
+    int i;
 
-        /* Stop fetching new instructions if HALT is fetched */
-        if (cpu->fetch.opcode == OPCODE_HALT)
+    if (execute->has_insn && (execute->dest_mask & src_mask))
+    {
+        return execute->pc;
+    }
+    if (memory->has_insn && (memory->dest_mask & src_mask))
+    {
+        return memory->pc;
+    }
+    for (i = cpu->lq_count; i > 0; --i)
+    {
+        load = &cpu->load_queue[(cpu->lq_head + i - 1) % cpu->machine.load_queue];
+        if (src_mask & (1u << load->rd))
         {
-            cpu->fetch.has_insn = FALSE;
+            return load->pc;
         }
     }
-    else
+    return 0;
+}
+
+/*
+Returns the registers decode may forward: with forwarding on, those whose
+youngest pending write is an ALU result leaving execute this cycle or any
+result leaving memory. A load leaving execute has not read memory yet, nor
+has one just sent to the load queue of a slower memory. Vector registers
+have no forwarding paths
+*/
+static unsigned int
+forwardable(const APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    const CPU_Stage *execute = CUR_LATCH(cpu, STAGE_EXECUTE);
+    const CPU_Stage *memory = CUR_LATCH(cpu, STAGE_MEMORY);
+    unsigned int mask = 0, younger = 0;
+
+    if (!cpu->machine.forwarding)
+    {
+        return 0;
+    }
+    if (ctl->ex_done)
     {
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
+        younger = execute->dest_mask;
+        if (opcode_info[execute->opcode].mem_access != MEM_READ)
         {
-           printf("Instruction at FETCH_STAGE     --->      EMPTY \n");
+            mask = younger;
         }
-       
     }
+    if (ctl->mem_ready)
+    {
+        mask |= memory->dest_mask & ~younger;
+    }
+    return mask & SCALAR_REG_MASK;
 }
 
 /*
-Decode Stage of APEX Pipeline
+Returns the ALU result of the instruction in latch
 */
-static void
-APEX_decode(APEX_CPU *cpu)
+static int
+alu_result(const CPU_Stage *latch)
 {
-        if (cpu->decode.has_insn)
-        {
-        /* Read operands from register file based on the instruction type */
-        switch (cpu->decode.opcode)
-        {
-            case OPCODE_ADD:
-            {
-                // condition check for anti, flow and output dependancies, if true skip cycle
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                //  set flag to stop instruction being fetch in fetch stage {do condition check in fetch stage}
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
+    const APEX_Opcode_Info *info = &opcode_info[latch->opcode];
 
-                // destination register is invalid, making flag = 1 = invalid
-                flags[cpu->decode.rd]++;
+    return APEX_alu(info->alu_op, get_stage_operand(latch, info->src_a),
+                    get_stage_operand(latch, info->src_b));
+}
 
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Returns the bank of data memory holding addr, words are interleaved across
+the banks
+*/
+static int
+bank_of(const APEX_Machine *m, int addr)
+{
+    return m->banks && addr > 0 ? addr % m->banks : 0;
+}
 
-            case OPCODE_SUB:
-            {
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Returns the cycles an access to addr takes
+*/
+static int
+access_cycles(const APEX_Machine *m, int addr)
+{
+    int bank = bank_of(m, addr);
 
-            case OPCODE_MUL:
-            {
+    return m->banks && m->bank_latency[bank] ? m->bank_latency[bank] : m->mem_latency;
+}
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Returns TRUE if an access to addr can start this cycle next to taken others
+starting on its bank. The single port of unbanked memory is pipelined and
+starts one access per cycle, a bank port is busy for all of one
+*/
+static int
+bank_free(const APEX_CPU *cpu, int addr, int taken)
+{
+    const APEX_Machine *m = &cpu->machine;
+    int bank = bank_of(m, addr);
+    int i, free = 0;
 
-            case OPCODE_DIV:
-            {
+    if (!m->banks)
+    {
+        return !taken;
+    }
+    for (i = 0; i < m->bank_ports[bank]; ++i)
+    {
+        free += cpu->bank_free_at[bank][i] <= cpu->clock;
+    }
+    return free > taken;
+}
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Starts an access to addr on a free port of its bank, returns the cycles it
+takes or 0 if every port is busy. The port of unbanked memory takes any
+*/
+int
+APEX_bank_access(APEX_CPU *cpu, int addr)
+{
+    const APEX_Machine *m = &cpu->machine;
+    int bank = bank_of(m, addr);
+    int cycles = access_cycles(m, addr);
+    int i;
 
-            case OPCODE_AND:
-            {
+    if (!m->banks)
+    {
+        return cycles;
+    }
+    for (i = 0; i < m->bank_ports[bank]; ++i)
+    {
+        if (cpu->bank_free_at[bank][i] <= cpu->clock)
+        {
+            cpu->bank_free_at[bank][i] = cpu->clock + cycles;
+            cpu->bank_accesses[bank]++;
+            cpu->bank_busy[bank] += cycles;
+            return cycles;
+        }
+    }
+    cpu->bank_conflicts[bank]++;
+    return 0;
+}
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Works out what MEM, the store buffer and the load queue do this cycle. The
+data memory port takes one access per cycle, each finishing memory_latency
+cycles later, or with banks every bank port takes one access at a time
+taking the bank's latency. MEM goes first: a load neither the store buffer
+nor the prefetch buffer can serve and, without a store buffer, a store wait
+for a port of their bank, as does a vector access once the store buffer is
+empty, moving all its words at once. The oldest unsent buffered store goes
+out if its bank has a port left. Without a load queue an access holds MEM
+until it finishes
+*/
+static void
+resolve_memory(const APEX_CPU *cpu, Cycle_Control *ctl)
+{
+    const CPU_Stage *memory = CUR_LATCH(cpu, STAGE_MEMORY);
+    const APEX_Machine *m = &cpu->machine;
+    const APEX_Mem_Op *op;
+    int access = opcode_info[memory->opcode].mem_access;
+    int i, port = FALSE, last, ready;
+
+    ctl->pf_entry = -1;
+
+    /* Queued loads return in order, one per cycle at most, a prefetched one
+     * behind a slower one waits for it */
+    for (i = 0; i < cpu->lq_count; ++i)
+    {
+        op = &cpu->load_queue[(cpu->lq_head + i) % m->load_queue];
+        if (i == 0 && op->ready <= cpu->clock)
+        {
+            ctl->lq_done = TRUE;
+            ctl->ret = *op;
+            continue;
+        }
+        ctl->lq_pending |= 1u << op->rd;
+    }
+
+    if (!memory->has_insn || memory->cycles_left)
+    {
+        /* Empty, or an access under way */
+        ctl->mem_busy = memory->has_insn && memory->cycles_left > 1;
+    }
+    else if (opcode_info[memory->opcode].vector && access != MEM_NONE)
+    {
+        port = TRUE;
+        ctl->mem_cycles = access_cycles(m, memory->memory_address);
+        ctl->vector_wait = cpu->sb_count > 0;
+        ctl->bank_wait = !ctl->vector_wait && !bank_free(cpu, memory->memory_address, 0);
+        ctl->mem_start = ctl->mem_cycles > 1 && !ctl->bank_wait && !ctl->vector_wait;
+    }
+    else if (access == MEM_READ)
+    {
+        /* The memory-ordering check, the youngest older store to the
+         * address supplies the value */
+        for (i = cpu->sb_count; i > 0 && !ctl->mem_forward; --i)
+        {
+            op = &cpu->store_buffer[(cpu->sb_head + i - 1) % m->store_buffer];
+            ctl->mem_forward = op->addr == memory->memory_address;
+            ctl->forward_value = op->value;
+        }
+
+        /* A prefetched line saves what is left of its trip */
+        ctl->mem_cycles = access_cycles(m, memory->memory_address);
+        if (!ctl->mem_forward && m->prefetch != PREFETCH_NONE)
+        {
+            ctl->pf_entry = APEX_prefetch_lookup(cpu, memory->memory_address);
+        }
+        if (ctl->pf_entry >= 0)
+        {
+            ready = cpu->prefetch_buffer[ctl->pf_entry].ready;
+            ctl->mem_cycles = ready > cpu->clock ? ready - cpu->clock : 1;
+        }
+
+        port = !ctl->mem_forward && ctl->pf_entry < 0;
+        ctl->bank_wait = port && !bank_free(cpu, memory->memory_address, 0);
+        if (!ctl->mem_forward && !m->load_queue)
+        {
+            ctl->mem_start = ctl->mem_cycles > 1 && !ctl->bank_wait;
+        }
+        else if (!ctl->mem_forward)
+        {
+            ctl->lq_full = cpu->lq_count - ctl->lq_done >= m->load_queue;
+            ctl->bank_wait = ctl->bank_wait && !ctl->lq_full;
+            ctl->lq_issue = !ctl->lq_full && !ctl->bank_wait;
+        }
+        ctl->pf_train = m->prefetch != PREFETCH_NONE && !ctl->lq_full && !ctl->bank_wait;
+    }
+    else if (access == MEM_WRITE && !m->store_buffer)
+    {
+        port = TRUE;
+        ctl->mem_cycles = access_cycles(m, memory->memory_address);
+        ctl->bank_wait = !bank_free(cpu, memory->memory_address, 0);
+        ctl->mem_start = ctl->mem_cycles > 1 && !ctl->bank_wait;
+    }
+    ctl->mem_port = port && !ctl->bank_wait && !ctl->lq_full && !ctl->vector_wait;
+
+    /* Stores reach memory in order, a faster bank's waits for the older */
+    if (cpu->sb_issued < cpu->sb_count)
+    {
+        op = &cpu->store_buffer[(cpu->sb_head + cpu->sb_issued) % m->store_buffer];
+        ctl->sb_issue = bank_free(cpu, op->addr, ctl->mem_port && bank_of(m, op->addr)
+                                  == bank_of(m, memory->memory_address));
+        ctl->drain_wait = m->banks && !ctl->sb_issue;
+        ctl->drain_cycles = access_cycles(m, op->addr);
+    }
+    if (cpu->sb_count)
+    {
+        op = &cpu->store_buffer[cpu->sb_head];
+        ctl->drain = *op;
+        ctl->sb_done = cpu->sb_issued ? op->ready <= cpu->clock
+                                      : ctl->sb_issue && ctl->drain_cycles == 1;
+    }
+
+    if (memory->has_insn && !memory->cycles_left && access == MEM_WRITE && m->store_buffer
+        && !opcode_info[memory->opcode].vector)
+    {
+        ctl->sb_push = cpu->sb_count - ctl->sb_done < m->store_buffer;
+        ctl->sb_full = !ctl->sb_push;
+    }
+
+    /* HALT retires once every store reached memory and every load returned,
+     * the last one may return as it retires */
+    if (memory->has_insn && memory->opcode == OPCODE_HALT)
+    {
+        last = cpu->lq_count - ctl->lq_done;
+        op = &cpu->load_queue[(cpu->lq_head + ctl->lq_done) % (m->load_queue ? m->load_queue : 1)];
+        ctl->mem_busy = cpu->sb_count - ctl->sb_done > 0 || last > 1
+                        || (last == 1 && op->ready > cpu->clock + 1);
+    }
+
+    ctl->mem_busy = ctl->mem_busy || ctl->mem_start || ctl->sb_full || ctl->lq_full
+                    || ctl->bank_wait || ctl->vector_wait;
+    ctl->mem_ready = memory->has_insn && !ctl->mem_busy
+                     && !(ctl->lq_issue && ctl->mem_cycles > 1);
+}
+
+/*
+Tells if the instruction decode issues sets the flag of a BZ/BNZ right
+behind it, and if that one moves into decode this cycle so the two fuse
+into one macro-op
+*/
+static void
+resolve_fusion(const APEX_CPU *cpu, Cycle_Control *ctl)
+{
+    const CPU_Stage *decode = CUR_LATCH(cpu, STAGE_DECODE);
+    int index = get_code_memory_index_from_pc(decode->pc + 4);
+    int opcode, pc;
+
+    if (!ctl->d_valid || ctl->d_stall || index >= cpu->code_memory_size
+        || (decode->opcode != OPCODE_CMP && decode->opcode != OPCODE_ADDL
+            && decode->opcode != OPCODE_SUBL)
+        || opcode_info[cpu->code_memory[index].opcode].branch == BRANCH_NONE)
+    {
+        return;
+    }
+    ctl->fusible = TRUE;
+
+    /* A branch resolved in decode waits for the flag, there is nothing to fuse */
+    if (!cpu->machine.fusion || cpu->early_branch || !ctl->fetch_fills)
+    {
+        return;
+    }
+    if (ctl->pop)
+    {
+        opcode = cpu->queue[cpu->queue_head].opcode;
+        pc = cpu->queue[cpu->queue_head].pc;
+    }
+    else
+    {
+        opcode = cpu->code_memory[get_code_memory_index_from_pc(cpu->pc)].opcode;
+        pc = cpu->pc;
+    }
+    ctl->fuse = opcode_info[opcode].branch != BRANCH_NONE && pc == decode->pc + 4;
+}
+
+/*
+Works out the hazards, stalls and redirects of the cycle from the current
+latches, as every stage would see them with the older stages already done
+*/
+static void
+resolve_hazards(const APEX_CPU *cpu, Cycle_Control *ctl)
+{
+    const CPU_Stage *fetch = CUR_LATCH(cpu, STAGE_FETCH);
+    const CPU_Stage *decode = CUR_LATCH(cpu, STAGE_DECODE);
+    const CPU_Stage *execute = CUR_LATCH(cpu, STAGE_EXECUTE);
+    const CPU_Stage *memory = CUR_LATCH(cpu, STAGE_MEMORY);
+    const CPU_Stage *writeback = CUR_LATCH(cpu, STAGE_WRITEBACK);
+    const APEX_Opcode_Info *info = &opcode_info[execute->opcode];
+    unsigned int pending = 0;
+    int branch, free;
+
+    memset(ctl, 0, sizeof(*ctl));
+    resolve_memory(cpu, ctl);
+    ctl->ex_done = execute->has_insn && execute->cycles_left <= 1 && !ctl->mem_busy;
+    ctl->ex_busy = execute->has_insn && !ctl->ex_done;
+    ctl->zero_flag = cpu->zero_flag;
+    ctl->fetch_held = cpu->fetch_held;
+
+    if (ctl->ex_done)
+    {
+        /* With --early-branch the branch already redirected fetch in decode,
+         * which sees the flag of a setter finishing execute this cycle. A
+         * fused branch sees the flag its macro-op sets */
+        if (info->branch != BRANCH_NONE && !cpu->early_branch)
+        {
+            ctl->ex_taken = cpu->zero_flag == (info->branch == BRANCH_Z ? TRUE : FALSE);
+            ctl->ex_redirect = ctl->ex_taken != execute->predicted;
+        }
+        else if (execute->fused)
+        {
+            branch = opcode_info[execute->fused].branch;
+            ctl->ex_taken = (alu_result(execute) == 0) == (branch == BRANCH_Z ? TRUE : FALSE);
+            ctl->ex_redirect = ctl->ex_taken != execute->predicted;
+        }
+        if (cpu->early_branch && info->sets_zero_flag)
+        {
+            ctl->zero_flag = (alu_result(execute) == 0) ? TRUE : FALSE;
+        }
+    }
+
+    ctl->d_valid = decode->has_insn && !ctl->ex_redirect;
+    if (ctl->d_valid)
+    {
+        /* A source register with a write still pending once writeback retires
+         * that cannot be forwarded is a RAW hazard, the masks were built at
+         * load time so this is the same test for every opcode. A multi-cycle
+         * operation still in execute also holds decode, which covers a flag
+         * setter for a branch resolved here. A queued load's register may be
+         * neither read nor written until it returns */
+        if (execute->has_insn)
+        {
+            pending |= execute->dest_mask;
+        }
+        if (memory->has_insn)
+        {
+            pending |= memory->dest_mask;
+        }
+        ctl->raw = decode->src_mask & pending & ~forwardable(cpu, ctl);
+        ctl->raw |= (decode->src_mask | decode->dest_mask) & ctl->lq_pending;
+        ctl->d_stall = ctl->raw || ctl->ex_busy;
+
+        branch = opcode_info[decode->opcode].branch;
+        if (!ctl->d_stall && cpu->early_branch && branch != BRANCH_NONE)
+        {
+            ctl->d_taken = ctl->zero_flag == (branch == BRANCH_Z ? TRUE : FALSE);
+            ctl->d_redirect = ctl->d_taken != decode->predicted;
+        }
+        ctl->stall = ctl->d_stall;
+    }
+    else
+    {
+        // retiring a result resets stalling so we can start fetching new instructions
+        ctl->stall = (writeback->has_insn && writeback->dest_mask) ? 0 : cpu->stall;
+    }
+
+    ctl->redirect = ctl->ex_redirect || ctl->d_redirect;
+    ctl->fetching = fetch->has_insn && !ctl->redirect;
+    if (!cpu->machine.queue)
+    {
+        ctl->held = ctl->fetching && ctl->stall;
+        ctl->fetch_fills = ctl->fetching && !ctl->stall;
+    }
+    else
+    {
+        /* Decoupled, fetch runs on while the queue has room and decode takes
+         * the oldest queued instruction, or the fetched one past an empty
+         * queue */
+        free = !ctl->redirect && !(ctl->d_valid && ctl->d_stall);
+        ctl->pop = free && cpu->queue_count > 0;
+        ctl->fetching = ctl->fetching && cpu->queue_count - ctl->pop < cpu->machine.queue;
+        ctl->push = ctl->fetching && !(free && cpu->queue_count == 0);
+        ctl->fetch_fills = ctl->pop || (ctl->fetching && !ctl->push);
+    }
+    resolve_fusion(cpu, ctl);
+}
+
+/*
+Returns TRUE if the loaded program has a LOOP instruction
+*/
+int
+APEX_hw_loop_used(const APEX_CPU *cpu)
+{
+    int i;
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        if (cpu->code_memory[i].opcode == OPCODE_LOOP)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+Runs an ENDLOOP on a loop stack of depth levels: another pass goes back to
+the start of the innermost body and returns TRUE, the last one leaves it
+*/
+static int
+end_hw_loop(APEX_Hw_Loop *loops, int *depth)
+{
+    APEX_Hw_Loop *top = &loops[*depth - 1];
+
+    if (top->count > 1)
+    {
+        top->count--;
+        return TRUE;
+    }
+    (*depth)--;
+    return FALSE;
+}
+
+/*
+Folds the ENDLOOPs at the fetch PC into the fetch loop registers, so the
+instruction after them is fetched this cycle. Returns the number folded
+*/
+static int
+fold_endloops(APEX_CPU *cpu)
+{
+    int index, addr, folded = 0;
+
+    while (cpu->fetch_loop_depth > 0)
+    {
+        index = get_code_memory_index_from_pc(cpu->pc);
+        if (index < 0 || index >= cpu->code_memory_size
+            || cpu->code_memory[index].opcode != OPCODE_ENDLOOP)
+        {
+            break;
+        }
+        addr = cpu->fetch_loops[cpu->fetch_loop_depth - 1].addr;
+        cpu->pc = end_hw_loop(cpu->fetch_loops, &cpu->fetch_loop_depth) ? addr : cpu->pc + 4;
+        folded++;
+    }
+    return folded;
+}
+
+/*
+Replays at issue what fetch did to its loop registers for the instruction in
+stage: the ENDLOOPs folded before it, then a LOOP opens a level
+*/
+static void
+issue_hw_loops(APEX_CPU *cpu, const CPU_Stage *stage)
+{
+    int i;
+
+    for (i = 0; i < stage->endloops; ++i)
+    {
+        cpu->hw_loop_passes++;
+        cpu->hw_loop_jumps += end_hw_loop(cpu->hw_loops, &cpu->hw_loop_depth);
+    }
+
+    if (stage->opcode == OPCODE_ENDLOOP)
+    {
+        fprintf(stderr, "APEX_Error: ENDLOOP without an open LOOP at pc(%d)\n", stage->pc);
+        exit(1);
+    }
+    if (stage->opcode != OPCODE_LOOP)
+    {
+        return;
+    }
+    if (cpu->hw_loop_depth == cpu->machine.loop_depth)
+    {
+        fprintf(stderr, "APEX_Error: LOOP nested more than %d deep at pc(%d)\n",
+                cpu->machine.loop_depth, stage->pc);
+        exit(1);
+    }
+    cpu->hw_loops[cpu->hw_loop_depth].addr = stage->pc + 4;
+    cpu->hw_loops[cpu->hw_loop_depth].count = stage->imm;
+    cpu->hw_loop_depth++;
+    cpu->hw_loops_entered++;
+}
+
+/*
+Looks the fetch PC up in the loop buffer, returns TRUE if the buffer supplies
+the instruction, predicting the closing branch taken. A loop being captured
+fills its entries as fetch reads them from code memory
+*/
+static int
+loop_buffer_fetch(APEX_CPU *cpu, CPU_Stage *fetch)
+{
+    int entries = (cpu->loop_end - cpu->loop_start) / 4 + 1;
+
+    if (!cpu->loop_end || cpu->pc < cpu->loop_start || cpu->pc > cpu->loop_end)
+    {
+        return FALSE;
+    }
+
+    if (cpu->loop_valid)
+    {
+        fetch->predicted = cpu->pc == cpu->loop_end;
+        return TRUE;
+    }
+
+    cpu->loop_filled |= 1u << ((cpu->pc - cpu->loop_start) / 4);
+    cpu->loop_valid = cpu->loop_filled == (entries == 32 ? ~0u : (1u << entries) - 1);
+    return FALSE;
+}
+
+/*
+Loads the loop closed by the taken backward branch in latch into the loop
+buffer if it fits, it fills as the next iteration is fetched
+*/
+static void
+capture_loop(APEX_CPU *cpu, const CPU_Stage *latch)
+{
+    int start = latch->pc + latch->imm;
+
+    if (latch->imm > 0 || (latch->pc - start) / 4 + 1 > cpu->machine.loop_buffer
+        || (start == cpu->loop_start && latch->pc == cpu->loop_end))
+    {
+        return;
+    }
+
+    cpu->loop_start = start;
+    cpu->loop_end = latch->pc;
+    cpu->loop_filled = 0;
+    cpu->loop_valid = FALSE;
+}
+
+/*
+Sends fetch down the resolved path of the branch in latch, which is not the
+one it took
+*/
+static void
+redirect_fetch(APEX_CPU *cpu, const CPU_Stage *latch, int taken)
+{
+    /* Nothing younger than latch issued, so the fetch loop registers go
+     * back to the issued ones */
+    memcpy(cpu->fetch_loops, cpu->hw_loops, sizeof(cpu->fetch_loops));
+    cpu->fetch_loop_depth = cpu->hw_loop_depth;
+
+    /* Calculate new PC, and send it to fetch unit */
+    if (taken)
+    {
+        cpu->pc = latch->pc + latch->imm;
+        capture_loop(cpu, latch);
+    }
+    else
+    {
+        cpu->pc = latch->pc + 4;
+        cpu->loop_exits++;
+    }
+}
+
+/*
+Fetch Stage of APEX Pipeline. With an instruction queue it also moves the
+oldest queued instruction into decode
+*/
+static void
+APEX_fetch(APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    const CPU_Stage *cur = CUR_LATCH(cpu, STAGE_FETCH);
+    CPU_Stage *fetch = NEXT_LATCH(cpu, STAGE_FETCH);
+    CPU_Stage *decode = NEXT_LATCH(cpu, STAGE_DECODE);
+    APEX_Instruction *current_ins;
+    int hit;
+
+    /* A taken branch flushed fetch, the target is fetched from next cycle */
+    if (ctl->redirect)
+    {
+        *fetch = *cur;
+        fetch->has_insn = TRUE;
+        cpu->fetch_held = FALSE;
+        return;
+    }
+
+    /* The entry may be refilled by the instruction fetched below */
+    if (ctl->pop)
+    {
+        *decode = cpu->queue[cpu->queue_head];
+    }
+
+    if (!ctl->fetching)
+    {
+        *fetch = *cur;
+        return;
+    }
+
+    /* A new fetch first folds the ENDLOOPs in its way, a held instruction
+     * already did */
+    fetch->endloops = cpu->fetch_held ? cur->endloops : fold_endloops(cpu);
+
+    /* Store current PC in fetch latch, a held instruction keeps its uid */
+    fetch->pc = cpu->pc;
+    fetch->uid = cpu->fetch_held ? cur->uid : cpu->next_uid++;
+    fetch->has_insn = TRUE;
+    fetch->predicted = FALSE;
+    hit = cpu->machine.loop_buffer && loop_buffer_fetch(cpu, fetch);
+
+    /* Index into code memory using this pc and copy all instruction fields
+     * into fetch latch  */
+    current_ins = &cpu->code_memory[get_code_memory_index_from_pc(cpu->pc)];
+    fetch->opcode = current_ins->opcode;
+    fetch->rd = current_ins->rd;
+    fetch->rs1 = current_ins->rs1;
+    fetch->rs2 = current_ins->rs2;
+    fetch->rs3 = current_ins->rs3;
+    fetch->imm = current_ins->imm;
+    fetch->src_mask = current_ins->src_mask;
+    fetch->dest_mask = current_ins->dest_mask;
+
+    // if stall caused in fetch by decode stage, then hold the instruction
+    if (ctl->held)
+    {
+        cpu->fetch_held = TRUE;
+        return;
+    }
+
+    /* Update PC for next instruction, a replayed loop goes round again */
+    cpu->pc = fetch->predicted ? cpu->loop_start : cpu->pc + 4;
+    cpu->fetch_held = FALSE;
+    cpu->loop_hits += hit;
+
+    /* Open a level of the fetch loop registers, a LOOP nested too deep fails
+     * when it issues */
+    if (fetch->opcode == OPCODE_LOOP && cpu->fetch_loop_depth < cpu->machine.loop_depth)
+    {
+        cpu->fetch_loops[cpu->fetch_loop_depth].addr = fetch->pc + 4;
+        cpu->fetch_loops[cpu->fetch_loop_depth].count = fetch->imm;
+        cpu->fetch_loop_depth++;
+    }
+
+    /* Copy data from fetch latch to decode latch, or queue it */
+    if (ctl->push)
+    {
+        cpu->queue[(cpu->queue_head + cpu->queue_count) % cpu->machine.queue] = *fetch;
+    }
+    else
+    {
+        *decode = *fetch;
+    }
+
+    /* Stop fetching new instructions if HALT is fetched */
+    if (fetch->opcode == OPCODE_HALT)
+    {
+        fetch->has_insn = FALSE;
+    }
+}
+
+/*
+Decode Stage of APEX Pipeline. Writes the execute latch unless execute holds
+on to its instruction, and the decode latch unless fetch fills it
+*/
+static void
+APEX_decode(APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    const CPU_Stage *cur = CUR_LATCH(cpu, STAGE_DECODE);
+    CPU_Stage *decode = NEXT_LATCH(cpu, STAGE_DECODE);
+    CPU_Stage *execute = NEXT_LATCH(cpu, STAGE_EXECUTE);
+
+    if (!ctl->d_valid)
+    {
+        /* Empty, or flushed by a branch resolved in execute */
+        if (CUR_LATCH(cpu, STAGE_FETCH)->has_insn)
+        {
+            cpu->fe_bubbles++;
+        }
+        if (ctl->ex_redirect)
+        {
+            set_bubble(execute, BUBBLE_FLUSH, CUR_LATCH(cpu, STAGE_EXECUTE)->pc, 0);
+        }
+        else if (!ctl->ex_busy)
+        {
+            pass_bubble(execute, cur);
+        }
+        if (!ctl->fetch_fills)
+        {
+            pass_bubble(decode, ctl->ex_redirect ? execute : cur);
+        }
+        return;
+    }
+
+    if (ctl->d_stall)
+    {
+        if (!ctl->ex_busy)
+        {
+            set_bubble(execute, BUBBLE_RAW, cur->pc, find_producer_pc(cpu, ctl->raw));
+        }
+        *decode = *cur;
+        return;
+    }
+
+    // destination register is invalid until writeback, dest_mask is 0 if there is none
+    cpu->pending[cur->rd] += (cur->dest_mask != 0);
+    cpu->pending_mask |= cur->dest_mask;
+
+    /* Count targets of a decode redirect issuing as soon as they can */
+    if (cpu->early_redirect >= 0)
+    {
+        cpu->early_saved += cpu->clock == cpu->early_redirect + 2;
+        cpu->early_redirect = -1;
+    }
+
+    /* PC and opcode breakpoints fire when the instruction issues */
+    if (cpu->code_memory[get_code_memory_index_from_pc(cur->pc)].breakpoint)
+    {
+        cpu->break_hit = BREAK_INSN;
+        cpu->break_pc = cur->pc;
+    }
+
+    /* Copy data from decode latch to execute latch, operands are read at the
+     * end of the cycle (see read_operands) */
+    *execute = *cur;
+    execute->cycles_left = cpu->machine.latency[cur->opcode];
+    execute->fused = 0;
+    cpu->fusible += ctl->fusible;
+    issue_hw_loops(cpu, cur);
+
+    /* The branch fetch just moved into decode rides along with its flag
+     * setter, leaving an empty slot behind. It may have had ENDLOOPs folded
+     * in front of it too */
+    if (ctl->fuse)
+    {
+        issue_hw_loops(cpu, decode);
+        execute->fused = decode->opcode;
+        execute->fused_imm = decode->imm;
+        execute->fused_uid = decode->uid;
+        execute->predicted = decode->predicted;
+        set_bubble(decode, BUBBLE_FRONTEND, 0, 0);
+        cpu->fused++;
+    }
+
+    if (ctl->d_redirect)
+    {
+        redirect_fetch(cpu, cur, ctl->d_taken);
+    }
+    if (ctl->d_redirect && ctl->d_taken)
+    {
+        cpu->early_taken++;
+        cpu->early_redirect = cpu->clock;
+    }
+
+    if (!ctl->fetch_fills)
+    {
+        if (ctl->d_redirect)
+        {
+            set_bubble(decode, BUBBLE_FLUSH, cur->pc, 0);
+        }
+        else
+        {
+            set_bubble(decode, BUBBLE_FRONTEND, 0, 0);
+        }
+    }
+}
+
+/*
+Single functional unit of the execute stage. Add, subtract and multiply are
+done unsigned so overflow wraps. DIV by zero gives -1 and INT_MIN / -1 gives
+INT_MIN, the two quotients C leaves undefined
+*/
+int
+APEX_alu(int alu_op, int a, int b)
+{
+    switch (alu_op)
+    {
+        case ALU_ADD:
+            return (int)((unsigned int)a + (unsigned int)b);
+        case ALU_SUB:
+            return (int)((unsigned int)a - (unsigned int)b);
+        case ALU_MUL:
+            return (int)((unsigned int)a * (unsigned int)b);
+        case ALU_DIV:
+            if (b == 0)
+            {
+                return -1;
+            }
+            if (b == -1)
+            {
+                return (int)(0u - (unsigned int)a);
+            }
+            return a / b;
+        case ALU_AND:
+            return a & b;
+        case ALU_OR:
+            return a | b;
+        case ALU_XOR:
+            return a ^ b;
+    }
+    return 0;
+}
+
+/*
+Execute Stage of APEX Pipeline
+*/
+static void
+APEX_execute(APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    const CPU_Stage *cur = CUR_LATCH(cpu, STAGE_EXECUTE);
+    CPU_Stage *memory = NEXT_LATCH(cpu, STAGE_MEMORY);
+    const APEX_Opcode_Info *info;
+    CPU_Stage *execute, branch;
+    int result;
+
+    if (!cur->has_insn)
+    {
+        pass_bubble(memory, cur);
+        return;
+    }
+
+    /* Multi-cycle operations hold the stage until their last cycle, and any
+     * operation while MEM is busy */
+    if (ctl->ex_busy)
+    {
+        execute = NEXT_LATCH(cpu, STAGE_EXECUTE);
+        *execute = *cur;
+        execute->cycles_left -= execute->cycles_left > 1;
+        set_bubble(memory, BUBBLE_LATENCY, cur->pc, 0);
+        return;
+    }
+
+    /* Copy data from execute latch to memory latch*/
+    *memory = *cur;
+    memory->cycles_left = 0;
+
+    /* Execute logic based on the opcode's descriptor. Vector operands are
+     * read from the register file here, decode issued the instruction only
+     * once their writes retired */
+    info = &opcode_info[cur->opcode];
+    if (info->vector && info->mem_access == MEM_NONE)
+    {
+        APEX_vector_alu(info->alu_op, cpu->vregs[cur->rs1 - REG_FILE_SIZE],
+                        cpu->vregs[cur->rs2 - REG_FILE_SIZE], memory->vresult,
+                        cpu->machine.vector_length);
+    }
+    else if (info->alu_op != ALU_NONE)
+    {
+        result = alu_result(cur);
+
+        /* Memory instructions use the ALU for the effective address */
+        if (info->mem_access != MEM_NONE)
+        {
+            memory->memory_address = result;
+        }
+        else
+        {
+            memory->result_buffer = result;
+        }
+
+        /* Set the zero flag based on the result */
+        if (info->sets_zero_flag)
+        {
+            cpu->zero_flag = (result == 0) ? TRUE : FALSE;
+        }
+    }
+
+    /* A fused branch redirects as if it followed its macro-op */
+    branch = *cur;
+    if (cur->fused)
+    {
+        branch.pc += 4;
+        branch.imm = cur->fused_imm;
+    }
+    if (ctl->ex_redirect)
+    {
+        redirect_fetch(cpu, &branch, ctl->ex_taken);
+    }
+
+    /* Cores sharing memory never fast-forward, so their paths are not recorded */
+    if (cpu->ff && !cpu->stores)
+    {
+        if (cur->fused)
+        {
+            APEX_ff_execute(cpu, cur->pc, FALSE);
+        }
+        APEX_ff_execute(cpu, branch.pc, ctl->ex_taken);
+    }
+}
+
+/*
+Memory Stage of APEX Pipeline, also drives the store buffer and load queue
+*/
+static void
+APEX_memory(APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    const CPU_Stage *cur = CUR_LATCH(cpu, STAGE_MEMORY);
+    CPU_Stage *writeback = NEXT_LATCH(cpu, STAGE_WRITEBACK);
+    const APEX_Machine *m = &cpu->machine;
+    const APEX_Opcode_Info *info;
+    CPU_Stage *memory;
+    APEX_Mem_Op *op;
+    int i, words;
+
+    if (ctl->mem_port)
+    {
+        APEX_bank_access(cpu, cur->memory_address);
+    }
+    else if (ctl->bank_wait)
+    {
+        cpu->bank_conflicts[bank_of(m, cur->memory_address)]++;
+    }
+    if (ctl->sb_issue)
+    {
+        op = &cpu->store_buffer[(cpu->sb_head + cpu->sb_issued) % m->store_buffer];
+        op->ready = cpu->clock + APEX_bank_access(cpu, op->addr) - 1;
+    }
+    else if (ctl->drain_wait)
+    {
+        op = &cpu->store_buffer[(cpu->sb_head + cpu->sb_issued) % m->store_buffer];
+        cpu->bank_conflicts[bank_of(m, op->addr)]++;
+    }
+    if (ctl->sb_done)
+    {
+        write_mem(cpu, ctl->drain.addr, ctl->drain.value);
+    }
+    if (ctl->pf_train)
+    {
+        APEX_prefetch_access(cpu, cur->pc, cur->memory_address, ctl->pf_entry,
+                             ctl->mem_cycles > 1, ctl->mem_forward);
+    }
+
+    if (!cur->has_insn)
+    {
+        pass_bubble(writeback, cur);
+        return;
+    }
+
+    info = &opcode_info[cur->opcode];
+    words = info->vector ? cpu->machine.vector_length : 1;
+    if (info->mem_access != MEM_NONE
+        && (cur->memory_address < 0 || cur->memory_address > cpu->machine.mem_size - words))
+    {
+        fprintf(stderr, "APEX_Error: Data memory address %d out of range at pc(%d)\n",
+                cur->memory_address, cur->pc);
+        exit(1);
+    }
+
+    /* A slow access, a busy bank or a full store buffer or load queue holds
+     * the stage */
+    if (ctl->mem_busy)
+    {
+        memory = NEXT_LATCH(cpu, STAGE_MEMORY);
+        *memory = *cur;
+        memory->cycles_left = ctl->mem_start ? ctl->mem_cycles - 1
+                                             : cur->cycles_left - (cur->cycles_left > 0);
+        set_bubble(writeback, BUBBLE_LATENCY, cur->pc, 0);
+        cpu->mem_stalls++;
+        cpu->sb_full += ctl->sb_full;
+        cpu->lq_full += ctl->lq_full;
+        return;
+    }
+
+    /* Copy data from memory latch to writeback latch*/
+    *writeback = *cur;
+
+    if (info->vector && info->mem_access == MEM_READ)
+    {
+        for (i = 0; i < words; ++i)
+        {
+            writeback->vresult[i] = read_mem(cpu, cur->memory_address + i);
+        }
+    }
+    else if (info->vector && info->mem_access == MEM_WRITE)
+    {
+        for (i = 0; i < words; ++i)
+        {
+            write_mem(cpu, cur->memory_address + i,
+                      cpu->vregs[cur->rs1 - REG_FILE_SIZE][i]);
+        }
+    }
+    else if (info->mem_access == MEM_READ)
+    {
+        /* Read from data memory */
+        writeback->result_buffer = ctl->mem_forward ? ctl->forward_value
+                                                    : read_mem(cpu, cur->memory_address);
+        cpu->loads++;
+        cpu->loads_forwarded += ctl->mem_forward;
+        if (ctl->lq_issue)
+        {
+            op = &cpu->load_queue[(cpu->lq_head + cpu->lq_count) % m->load_queue];
+            op->pc = cur->pc;
+            op->addr = cur->memory_address;
+            op->value = writeback->result_buffer;
+            op->rd = cur->rd;
+            op->ready = cpu->clock + ctl->mem_cycles;
+            writeback->queued = TRUE;
+        }
+    }
+    else if (ctl->sb_push)
+    {
+        /* Leave the store to the store buffer */
+        op = &cpu->store_buffer[(cpu->sb_head + cpu->sb_count) % m->store_buffer];
+        op->pc = cur->pc;
+        op->addr = cur->memory_address;
+        op->value = get_stage_operand(cur, info->store_src);
+    }
+    else if (info->mem_access == MEM_WRITE)
+    {
+        /* Write to data memory */
+        write_mem(cpu, cur->memory_address, get_stage_operand(cur, info->store_src));
+    }
+}
+
+/*
+Writeback Stage of APEX Pipeline, returns TRUE when HALT retires
+*/
+static int
+APEX_writeback(APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    const CPU_Stage *cur = CUR_LATCH(cpu, STAGE_WRITEBACK);
+
+    /* A load returning from the load queue */
+    if (ctl->lq_done)
+    {
+        write_reg(cpu, ctl->ret.rd, ctl->ret.value);
+        if (--cpu->pending[ctl->ret.rd] == 0)
+        {
+            cpu->pending_mask &= ~(1u << ctl->ret.rd);
+        }
+    }
 
-            case OPCODE_OR:
-            {
+    if (!cur->has_insn)
+    {
+        return FALSE;
+    }
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+    /* Write result to register file if the instruction has a destination */
+    if (cur->dest_mask && !cur->queued)
+    {
+        if (cur->rd >= REG_FILE_SIZE)
+        {
+            write_vreg(cpu, cur->rd, cur->vresult);
+        }
+        else
+        {
+            write_reg(cpu, cur->rd, cur->result_buffer);
+        }
+        // after the last pending write the register is valid again
+        if (--cpu->pending[cur->rd] == 0)
+        {
+            cpu->pending_mask &= ~cur->dest_mask;
+        }
+    }
 
-            case OPCODE_XOR:
-            {
+    cpu->insn_completed += cur->fused ? 2 : 1;
+    return cur->opcode == OPCODE_HALT;
+}
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Reads a source register for the instruction issued this cycle, once every
+stage has run: forwarded from the youngest next latch holding a pending
+write to it, otherwise from the register file as writeback left it
+*/
+static int
+read_operand(const APEX_CPU *cpu, int reg)
+{
+    const CPU_Stage *memory = NEXT_LATCH(cpu, STAGE_MEMORY);
+    const CPU_Stage *writeback = NEXT_LATCH(cpu, STAGE_WRITEBACK);
+    unsigned int bit = 1u << reg;
 
-            case OPCODE_ADDL:
-            {
-                
-                if(flags[cpu->decode.rs1] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                break;
-            }
+    /* Vector operands are read in execute */
+    if (reg >= REG_FILE_SIZE)
+    {
+        return 0;
+    }
 
-            case OPCODE_SUBL:
-            {
-                // if(flags[cpu->decode.rd] == 1)
-                // {
-                //    temp = 1;
-                // }
-                if(flags[cpu->decode.rs1] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                break;
-            }
+    if (cpu->machine.forwarding && (cpu->pending_mask & bit))
+    {
+        if (memory->has_insn && (memory->dest_mask & bit))
+        {
+            return memory->result_buffer;
+        }
+        if (writeback->has_insn && (writeback->dest_mask & bit))
+        {
+            return writeback->result_buffer;
+        }
+    }
+    return cpu->regs[reg];
+}
 
-            case OPCODE_LOAD:
-            {
+/*
+Read operands from register file, unused ones are ignored later
+*/
+static void
+read_operands(APEX_CPU *cpu)
+{
+    CPU_Stage *execute = NEXT_LATCH(cpu, STAGE_EXECUTE);
 
-                if(flags[cpu->decode.rs1] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                break;
-            }
+    execute->rs1_value = read_operand(cpu, execute->rs1);
+    execute->rs2_value = read_operand(cpu, execute->rs2);
+    execute->rs3_value = read_operand(cpu, execute->rs3);
+}
 
-            case OPCODE_LDR:
-            {
+/*
+Traces the instructions a redirect squashes, oldest first: the decode latch
+unless that is the branch, queued instructions and a held fetch
+*/
+static void
+trace_flush(APEX_CPU *cpu, const Cycle_Control *ctl)
+{
+    int i;
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 /*|| flags[cpu->decode.rd] == 1*/){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
-                flags[cpu->decode.rd]++;
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+    if (ctl->ex_redirect && CUR_LATCH(cpu, STAGE_DECODE)->has_insn)
+    {
+        APEX_konata_flush(cpu, CUR_LATCH(cpu, STAGE_DECODE));
+    }
+    for (i = 0; i < cpu->queue_count; i++)
+    {
+        APEX_konata_flush(cpu, &cpu->queue[(cpu->queue_head + i) % cpu->machine.queue]);
+    }
+    if (ctl->fetch_held)
+    {
+        APEX_konata_flush(cpu, CUR_LATCH(cpu, STAGE_FETCH));
+    }
+}
 
-            case OPCODE_STORE:
-            {
+/*
+Traces the branch fused into the macro-op in latch as retiring with it
+*/
+static void
+retire_fused(APEX_CPU *cpu, const CPU_Stage *latch)
+{
+    CPU_Stage branch = *latch;
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
+    branch.pc += 4;
+    branch.opcode = latch->fused;
+    branch.uid = latch->fused_uid;
+    APEX_konata_retire(cpu, &branch);
+}
 
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+Logs the cycle once every stage has run: watched writes, the Konata trace
+and, unless running quietly, the content of each stage. The order is that of
+a pipeline evaluated from writeback back to fetch, a cycle in which HALT
+retires shows writeback alone
+*/
+static void
+report_cycle(APEX_CPU *cpu, const Cycle_Control *ctl, int halted)
+{
+    const CPU_Stage *decode = CUR_LATCH(cpu, STAGE_DECODE);
+    const CPU_Stage *execute = CUR_LATCH(cpu, STAGE_EXECUTE);
+    const CPU_Stage *memory = CUR_LATCH(cpu, STAGE_MEMORY);
+    const CPU_Stage *writeback = CUR_LATCH(cpu, STAGE_WRITEBACK);
+    const APEX_Opcode_Info *info = &opcode_info[memory->opcode];
+    int display = ENABLE_DEBUG_MESSAGES && command_simulate == 0;
+    int addr = memory->memory_address;
+    int i, words;
+
+    if (ctl->lq_done && (cpu->reg_watch & (1u << ctl->ret.rd)))
+    {
+        printf("APEX_WATCH: cycle %d pc(%d) REG[%d] <- %d\n", cpu->clock,
+               ctl->ret.pc, ctl->ret.rd, ctl->ret.value);
+    }
 
-            case OPCODE_STR:
+    if (writeback->has_insn)
+    {
+        if (cpu->konata)
+        {
+            APEX_konata_retire(cpu, writeback);
+            if (writeback->fused)
             {
+                retire_fused(cpu, writeback);
+            }
+        }
+        if ((cpu->reg_watch & writeback->dest_mask) && !writeback->queued)
+        {
+            printf("APEX_WATCH: cycle %d pc(%d) REG[%d] <- %d\n", cpu->clock,
+                   writeback->pc, writeback->rd, cpu->regs[writeback->rd]);
+        }
+        if (display)
+        {
+            print_stage_content("Instruction at WRITEBACK_STAGE --->", writeback);
+        }
+    }
+    else if (display)
+    {
+        printf("Instruction at WRITEBACK_STAGE --->      EMPTY \n");
+    }
 
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0 || flags[cpu->decode.rs3] > 0){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
-                }
+    if (halted)
+    {
+        return;
+    }
 
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                cpu->decode.rs3_value = cpu->regs[cpu->decode.rs3];
-                break;
-            }
+    if (ctl->sb_done && (cpu->mem_watch[ctl->drain.addr / 32] & (1u << (ctl->drain.addr % 32))))
+    {
+        printf("APEX_WATCH: cycle %d pc(%d) MEM[%d] <- %d\n", cpu->clock,
+               ctl->drain.pc, ctl->drain.addr, ctl->drain.value);
+    }
 
-            case OPCODE_CMP:
+    if (memory->has_insn)
+    {
+        if (cpu->konata)
+        {
+            APEX_konata_stage(cpu, KONATA_STAGE_M, memory);
+        }
+        if (info->mem_access == MEM_WRITE && !ctl->mem_busy && !ctl->sb_push)
+        {
+            words = info->vector ? cpu->machine.vector_length : 1;
+            for (i = 0; i < words; ++i)
             {
-                if(flags[cpu->decode.rs1] > 0 || flags[cpu->decode.rs2] > 0){
-                stall = 1;
-                if (ENABLE_DEBUG_MESSAGES && command_simulate == 0){
-                print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
-                }
-                return;
+                if (cpu->mem_watch[(addr + i) / 32] & (1u << ((addr + i) % 32)))
+                {
+                    printf("APEX_WATCH: cycle %d pc(%d) MEM[%d] <- %d\n", cpu->clock,
+                           memory->pc, addr + i, info->vector
+                           ? cpu->vregs[memory->rs1 - REG_FILE_SIZE][i]
+                           : get_stage_operand(memory, info->store_src));
                 }
-
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
             }
+        }
+        if (display)
+        {
+            print_stage_content("Instruction at MEMORY_STAGE    --->", memory);
+        }
+    }
+    else if (display)
+    {
+        printf("Instruction at MEMORY STAGE    --->      EMPTY \n");
+    }
 
-            case OPCODE_NOP:
+    if (execute->has_insn)
+    {
+        if (cpu->konata)
+        {
+            APEX_konata_stage(cpu, KONATA_STAGE_X, execute);
+            if (ctl->ex_redirect)
             {
-                break;
+                trace_flush(cpu, ctl);
             }
+        }
+        if (display)
+        {
+            print_stage_content("Instruction at EX_STAGE        --->", execute);
+        }
+    }
+    else if (display)
+    {
+        printf("Instruction at EX_STAGE        --->      EMPTY \n");
+    }
 
-            case OPCODE_BZ:
+    if (ctl->d_valid)
+    {
+        if (cpu->konata && ctl->d_stall)
+        {
+            APEX_konata_stage(cpu, KONATA_STAGE_DS, decode);
+            if (ctl->ex_busy)
             {
-                break;
+                APEX_konata_note(cpu, decode, "execute busy with", execute->pc);
             }
-
-            case OPCODE_BNZ:
+            else
             {
-                break;
+                APEX_konata_note(cpu, decode, "RAW stall on",
+                                 NEXT_LATCH(cpu, STAGE_EXECUTE)->bubble_pc2);
             }
-
-            case OPCODE_HALT:
+        }
+        else if (cpu->konata)
+        {
+            APEX_konata_stage(cpu, KONATA_STAGE_D, decode);
+            if (ctl->d_redirect)
             {
-                break;
+                trace_flush(cpu, ctl);
             }
+        }
+        if (display)
+        {
+            print_stage_content("Instruction at DECODE_RF_STAGE --->", decode);
+        }
+    }
+    else if (display)
+    {
+        printf("Instruction at DECODE_RF_STAGE --->      EMPTY \n");
+    }
 
-            case OPCODE_MOVC:
-            {
-                flags[cpu->decode.rd]++;
-                break;
-            }
+    /* Fetch shows the instruction it fetched, nothing while redirected */
+    if (ctl->fetching)
+    {
+        if (cpu->konata)
+        {
+            APEX_konata_stage(cpu, ctl->held ? KONATA_STAGE_FS : KONATA_STAGE_F,
+                              NEXT_LATCH(cpu, STAGE_FETCH));
+        }
+        if (display)
+        {
+            print_stage_content("Instruction at FETCH_STAGE     --->",
+                                NEXT_LATCH(cpu, STAGE_FETCH));
+        }
+    }
+    else if (!ctl->redirect && display)
+    {
+        printf("Instruction at FETCH_STAGE     --->      EMPTY \n");
+    }
+}
+
+/*
+Runs the stages of one cycle. Each stage reads the current latches and
+writes the next ones, so they run in pipeline order; the latch buffers are
+swapped once all of them have. Returns TRUE once HALT retires, the cycle
+ends there as nothing follows HALT down the pipeline
+*/
+static int
+run_stages(APEX_CPU *cpu)
+{
+    Cycle_Control ctl;
+    int halted;
+
+    /* Cycles stepped after the run halted are not part of it */
+    if (cpu->profile && !cpu->profile->halted)
+    {
+        APEX_profile_cycle(cpu);
+    }
+
+    if (cpu->shm)
+    {
+        APEX_shm_publish(cpu);
+    }
+
+    resolve_hazards(cpu, &ctl);
+    APEX_fetch(cpu, &ctl);
+    APEX_decode(cpu, &ctl);
+    APEX_execute(cpu, &ctl);
+    APEX_memory(cpu, &ctl);
+    halted = APEX_writeback(cpu, &ctl);
+    report_cycle(cpu, &ctl, halted);
+
+    /* Also when HALT retires, the load returning with it must not return again */
+    if (cpu->machine.store_buffer)
+    {
+        cpu->sb_head = (cpu->sb_head + ctl.sb_done) % cpu->machine.store_buffer;
+        cpu->sb_count += ctl.sb_push - ctl.sb_done;
+        cpu->sb_issued += ctl.sb_issue - ctl.sb_done;
+    }
+    if (cpu->machine.load_queue)
+    {
+        cpu->lq_head = (cpu->lq_head + ctl.lq_done) % cpu->machine.load_queue;
+        cpu->lq_count += ctl.lq_issue - ctl.lq_done;
+    }
+
+    if (halted)
+    {
+        CUR_LATCH(cpu, STAGE_WRITEBACK)->has_insn = FALSE;
+        if (cpu->profile)
+        {
+            cpu->profile->halted = TRUE;
+        }
+        return TRUE;
+    }
+
+    if (ctl.d_valid && !ctl.d_stall)
+    {
+        read_operands(cpu);
+    }
+    if (ctl.redirect)
+    {
+        cpu->queue_count = 0;
+    }
+    else if (cpu->machine.queue)
+    {
+        cpu->queue_head = (cpu->queue_head + ctl.pop) % cpu->machine.queue;
+        cpu->queue_count += ctl.push - ctl.pop;
+    }
+    cpu->stall = ctl.stall;
+    cpu->cur = !cpu->cur;
+    return FALSE;
+}
+
+/*
+This function creates and initializes APEX cpu.
+*/
+APEX_CPU *
+APEX_cpu_init(const char *filename)
+{
+    int i;
+    APEX_CPU *cpu;
+
+    if (!filename)
+    {
+        return NULL;
+    }
+
+    cpu = calloc(1, sizeof(APEX_CPU));
+
+    if (!cpu)
+    {
+        return NULL;
+    }
+
+    /* Initialize PC, Registers and all pipeline stages */
+    cpu->pc = 4000;
+    cpu->clock = 1;
+    cpu->filename = filename;
+    cpu->history_size = HISTORY_DEFAULT_BYTES;
+    cpu->quantum = MULTICORE_DEFAULT_QUANTUM;
+    cpu->early_redirect = -1;
+    APEX_machine_default(&cpu->machine);
+    APEX_vector_init();
+    memset(cpu->regs, 0, sizeof(int) * REG_FILE_SIZE);
+    cpu->data_memory = cpu->own_data_memory;
+    memset(cpu->data_memory, 0, sizeof(int) * DATA_MEMORY_SIZE);
+
+    
+    /* Parse input file and create code memory */
+    cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+    if (!cpu->code_memory)
+    {
+        free(cpu);
+        return NULL;
+    }
+
+    if (ENABLE_DEBUG_MESSAGES)
+    {
+        fprintf(stderr,
+                "APEX_CPU: Initialized APEX CPU, loaded %d instructions\n",
+                cpu->code_memory_size);
+        fprintf(stderr, "APEX_CPU: PC initialized to %d\n", cpu->pc);
+        fprintf(stderr, "APEX_CPU: Printing Code Memory\n");
+        printf("%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode_str", "rd", "rs1", "rs2",
+               "rs3", "imm");
 
-           
+        for (i = 0; i < cpu->code_memory_size; ++i)
+        {
+            printf("%-9s %-9d %-9d %-9d %-9d %-9d\n", cpu->code_memory[i].opcode_str,
+                   cpu->code_memory[i].rd, cpu->code_memory[i].rs1,
+                   cpu->code_memory[i].rs2, cpu->code_memory[i].rs3, cpu->code_memory[i].imm);
         }
+    }
+
+    /* To start fetch stage */
+    CUR_LATCH(cpu, STAGE_FETCH)->has_insn = TRUE;
+    return cpu;
+}
+
+/*
+Runs one cycle without output, as the simulate loop does. Returns TRUE once
+HALT retires, the clock then stays at the cycle it retired in
+*/
+int
+APEX_cpu_step(APEX_CPU *cpu)
+{
+    if (run_stages(cpu))
+    {
+        return TRUE;
+    }
+
+    cpu->clock++;
+    return FALSE;
+}
 
-        /* Copy data from decode latch to execute latch*/
-        cpu->execute = cpu->decode;
-        cpu->decode.has_insn = FALSE;
+/*
+Prints the content of every pipeline latch
+*/
+static void
+print_pipeline(const APEX_CPU *cpu)
+{
+    const char *names[NUM_STAGES] = {
+        "Instruction at FETCH_STAGE     --->", "Instruction at DECODE_RF_STAGE --->",
+        "Instruction at EX_STAGE        --->", "Instruction at MEMORY_STAGE    --->",
+        "Instruction at WRITEBACK_STAGE --->"};
+    const CPU_Stage *stage;
+    int i;
 
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
+    printf("Pipeline latches after Clock Cycle #: %d\n", cpu->clock);
+    for (i = 0; i < NUM_STAGES; i++)
+    {
+        stage = CUR_LATCH(cpu, i);
+        if (stage->has_insn)
         {
-            print_stage_content("Instruction at DECODE_RF_STAGE --->", &cpu->decode);
+            print_stage_content(names[i], stage);
         }
-
-    }
-    else
-    {
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
+        else
         {
-           printf("Instruction at DECODE_RF_STAGE --->      EMPTY \n");
+            printf("%-40s EMPTY \n", names[i]);
         }
-        
-    }   
-    
+    }
 }
 
 /*
-Execute Stage of APEX Pipeline
+Runs one more cycle, with stage output unless quiet, returns TRUE once HALT
+retires
 */
-static void
-APEX_execute(APEX_CPU *cpu)
+static int
+run_cycle(APEX_CPU *cpu, int quiet)
 {
-    if (cpu->execute.has_insn)
-    {
-        /* Execute logic based on instruction type */
-        switch (cpu->execute.opcode)
-        {
-            case OPCODE_ADD:
-            {
-                cpu->execute.result_buffer
-                    = cpu->execute.rs1_value + cpu->execute.rs2_value;
-                //printf("register name = %d",cpu->execute.rs1);
-
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-
-                break;
-            }
-
-            case OPCODE_ADDL:
-            {
-                cpu->execute.result_buffer = cpu->execute.rs1_value + cpu->execute.imm;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
-
-            case OPCODE_SUB:
-            {
-                cpu->execute.result_buffer = cpu->execute.rs1_value - cpu->execute.rs2_value;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
-
-            case OPCODE_SUBL:
-            {
-                cpu->execute.result_buffer  = cpu->execute.rs1_value - cpu->execute.imm;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
-
-            case OPCODE_MUL:
-            {
-                cpu->execute.result_buffer = cpu->execute.rs1_value * cpu->execute.rs2_value;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
+    int saved = command_simulate;
 
-            case OPCODE_DIV:
-            {
-                cpu->execute.result_buffer = cpu->execute.rs1_value / cpu->execute.rs2_value;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
-
-            case OPCODE_AND:
-            {
-                cpu->execute.result_buffer  = cpu->execute.rs1_value & cpu->execute.rs2_value;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
+    command_simulate = quiet;
+    cpu->clock++;
 
-            case OPCODE_OR:
-            {
-                cpu->execute.result_buffer = cpu->execute.rs1_value | cpu->execute.rs2_value;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
+    if (!quiet && ENABLE_DEBUG_MESSAGES)
+    {
+        printf("--------------------------------------------\n");
+        printf("Clock Cycle #: %d\n", cpu->clock);
+        printf("--------------------------------------------\n");
+    }
 
-            case OPCODE_XOR:
-            {
-                cpu->execute.result_buffer = cpu->execute.rs1_value ^ cpu->execute.rs2_value;
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
+    if (run_stages(cpu))
+    {
+        command_simulate = saved;
+        return TRUE;
+    }
+    command_simulate = saved;
 
-            case OPCODE_LOAD:
-            {
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.imm;
-                break;
-            }
+    if (cpu->history)
+    {
+        APEX_history_commit(cpu);
+    }
+    return FALSE;
+}
 
-            case OPCODE_LDR:
-            {
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.rs2_value;
-                break;
-            }
+/*
+Reads one command line from the user, end of input reads as "q"
+*/
+static void
+read_command(char *cmd, int size)
+{
+    if (!fgets(cmd, size, stdin))
+    {
+        strcpy(cmd, "q");
+    }
+}
 
-            case OPCODE_STORE:
-            {
-                cpu->execute.memory_address = cpu->execute.rs2_value + cpu->execute.imm;
-                break;
-            }
+/*
+Prompt between single-step cycles. <enter> advances, "back N" and "goto C"
+move through the recorded history. Returns PROMPT_STEP, PROMPT_QUIT or
+PROMPT_HALTED when a goto ran into HALT
+*/
+static int
+single_step_prompt(APEX_CPU *cpu)
+{
+    char cmd[128];
+    int n, done;
 
-            case OPCODE_STR:
-            {
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.rs2_value;
-                break;
-            }
+    while (TRUE)
+    {
+        printf("Press any key to advance CPU Clock or <q> to quit:\n");
+        read_command(cmd, sizeof(cmd));
 
-            case OPCODE_BZ:
-            {
-                if (cpu->zero_flag == TRUE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
-                break;
-            }
+        if ((cmd[0] == 'Q') || (cmd[0] == 'q'))
+        {
+            return PROMPT_QUIT;
+        }
 
-            case OPCODE_BNZ:
-            {
-                if (cpu->zero_flag == FALSE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
-                break;
-            }
+        if (sscanf(cmd, "back %d", &n) == 1)
+        {
+            for (done = 0; done < n && APEX_history_undo(cpu) == 0; done++)
+                ;
+            printf("APEX_CPU: Stepped back %d cycles (%d more recorded)\n", done,
+                   APEX_history_depth(cpu));
+            print_pipeline(cpu);
+            continue;
+        }
 
-            case OPCODE_MOVC: 
+        if (sscanf(cmd, "goto %d", &n) == 1)
+        {
+            while (cpu->clock > n && APEX_history_undo(cpu) == 0)
+                ;
+            while (cpu->clock < n)
             {
-                cpu->execute.result_buffer = cpu->execute.imm;
-
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
+                if (run_cycle(cpu, TRUE))
                 {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
+                    printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+                    return PROMPT_HALTED;
                 }
-                break;
-            }
-
-            case OPCODE_CMP: 
-            {
-                if (cpu->execute.rs1_value == cpu->execute.rs2_value)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
+                if (cpu->watch_hit)
                 {
-                    cpu->zero_flag = FALSE;
+                    printf("APEX_CPU: Watchpoint hit, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+                    cpu->watch_hit = FALSE;
+                    break;
                 }
-                
-                break;
-            }
-
-            case OPCODE_NOP: 
-            {
-                break;
             }
+            print_pipeline(cpu);
+            continue;
         }
 
-        /* Copy data from execute latch to memory latch*/
-        cpu->memory = cpu->execute;
-        cpu->execute.has_insn = FALSE;
-
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
-        {
-            print_stage_content("Instruction at EX_STAGE        --->", &cpu->execute);
-        }
-    }
-    else
-    {
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
-        {
-           printf("Instruction at EX_STAGE        --->      EMPTY \n");
-        }
-        
+        return PROMPT_STEP;
     }
 }
 
 /*
-Memory Stage of APEX Pipeline
+Cycle by cycle simulation waiting for the user after every cycle
 */
 static void
-APEX_memory(APEX_CPU *cpu)
+run_single_step(APEX_CPU *cpu)
 {
-    if (cpu->memory.has_insn)
-    {
-        switch (cpu->memory.opcode)
-        {
-            case OPCODE_MOVC:
-            {
-                break;
-            }
-
-            case OPCODE_ADD:
-            {
-                /* No work for ADD */
-                break;
-            }
-
-            case OPCODE_ADDL:
-            {
-                break;
-            }
-
-            case OPCODE_SUB:
-            {
-                break;
-            }
-
-            case OPCODE_SUBL:
-            {
-                break;
-            }
+    int prompt;
 
-            case OPCODE_MUL:
-            {
-                break;
-            }
-
-            case OPCODE_DIV:
-            {
-                break;
-            }
-
-            case OPCODE_AND:
-            {
-                break;
-            }
+    /* Without history back/goto only report that nothing is recorded */
+    if (!cpu->history)
+    {
+        APEX_history_enable(cpu, cpu->history_size);
+    }
 
-            case OPCODE_OR:
-            {
-                break;
-            }
+    while (TRUE)
+    {
+        if (ENABLE_DEBUG_MESSAGES)
+        {
+                printf("--------------------------------------------\n");
+                printf("Clock Cycle #: %d\n", cpu->clock);
+                printf("--------------------------------------------\n");
 
-            case OPCODE_XOR:
-            {
-                break;
-            }
+        }
 
-            case OPCODE_LOAD:
-            {
-                /* Read from data memory */
-                cpu->memory.result_buffer = cpu->data_memory[cpu->memory.memory_address];
-                break;
-            }
+        if (run_stages(cpu))
+        {
+            /* Halt in writeback stage */
+               printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+               break;
+        }
 
-            case OPCODE_LDR:
-            {
-                /* Read from data memory */
-                cpu->memory.result_buffer = cpu->data_memory[cpu->memory.memory_address];
-                break;
-            }
+        if (cpu->history)
+        {
+            APEX_history_commit(cpu);
+        }
 
-            case OPCODE_STORE:
-            {
-                /* Write from data memory */
-                cpu->data_memory[cpu->memory.memory_address] = cpu->memory.rs1_value;
-                break;
-            }
+        if (cpu->watch_hit)
+        {
+            printf("APEX_CPU: Watchpoint hit, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+            break;
+        }
 
-            case OPCODE_STR:
+        if (cpu->single_step)
+        {
+            prompt = single_step_prompt(cpu);
+            if (prompt == PROMPT_HALTED)
             {
-                /* Write from data memory */
-                cpu->data_memory[cpu->memory.memory_address] = cpu->memory.rs3_value;
                 break;
             }
-
-            case OPCODE_CMP:
+            if (prompt == PROMPT_QUIT)
             {
+                printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
                 break;
             }
+        }
 
-            case OPCODE_NOP:
-            {
-                break;
-            }
+        cpu->clock++;
+    }
+}
 
-        }
+/*
+Reports why a debugger run stopped and clears the trigger, returns FALSE if
+nothing stopped it
+*/
+static int
+report_break(APEX_CPU *cpu)
+{
+    int hit = FALSE;
 
-        /* Copy data from memory latch to writeback latch*/
-        cpu->writeback = cpu->memory;
-        cpu->memory.has_insn = FALSE;
+    if (cpu->break_hit == BREAK_INSN)
+    {
+        printf("APEX_DEBUG: Breakpoint at cycle %d, issued pc(%d) %s\n", cpu->clock,
+               cpu->break_pc,
+               cpu->code_memory[get_code_memory_index_from_pc(cpu->break_pc)].opcode_str);
+        hit = TRUE;
+    }
+    else if (cpu->break_hit == BREAK_REG)
+    {
+        printf("APEX_DEBUG: Breakpoint at cycle %d, R%d = %d\n", cpu->clock,
+               cpu->break_reg, cpu->regs[cpu->break_reg]);
+        hit = TRUE;
+    }
 
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
-        {
-            print_stage_content("Instruction at MEMORY_STAGE    --->", &cpu->memory);
-        }
+    if (cpu->watch_hit)
+    {
+        printf("APEX_DEBUG: Watchpoint at cycle %d\n", cpu->clock);
+        hit = TRUE;
     }
-    else
+
+    if (cpu->clock == cpu->break_cycle)
     {
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
-        {
-           printf("Instruction at MEMORY STAGE    --->      EMPTY \n");
-        }
-        
+        printf("APEX_DEBUG: Breakpoint at cycle %d\n", cpu->clock);
+        hit = TRUE;
     }
+
+    cpu->break_hit = BREAK_NONE;
+    cpu->watch_hit = FALSE;
+    return hit;
 }
 
 /*
-Writeback Stage of APEX Pipeline
+Arms a "break ..." command, returns FALSE if it is not understood
 */
 static int
-APEX_writeback(APEX_CPU *cpu)
+debug_break(APEX_CPU *cpu, const char *args)
 {
-    if (cpu->writeback.has_insn)
+    char name[32];
+    int a, b, i, found = FALSE;
+
+    if (sscanf(args, "pc %d", &a) == 1)
     {
-        /* Write result to register file based on instruction type */
-        switch (cpu->writeback.opcode)
+        i = get_code_memory_index_from_pc(a);
+        if (a < 4000 || i >= cpu->code_memory_size)
         {
-            case OPCODE_ADD:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                // after writing result into register register is valid
-                flags[cpu->writeback.rd]--;
-                // resetting stalling so we can start fetching new instructions
-                stall = 0;
-                break;
-            }
+            printf("APEX_DEBUG: pc(%d) is outside code memory\n", a);
+            return TRUE;
+        }
+        cpu->code_memory[i].breakpoint = TRUE;
+        return TRUE;
+    }
 
-            case OPCODE_ADDL:
+    if (sscanf(args, "op %31s", name) == 1)
+    {
+        for (i = 0; i < cpu->code_memory_size; ++i)
+        {
+            if (strcmp(opcode_info[cpu->code_memory[i].opcode].name, name) == 0)
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
+                cpu->code_memory[i].breakpoint = TRUE;
+                found = TRUE;
             }
+        }
+        if (!found)
+        {
+            printf("APEX_DEBUG: no %s in code memory\n", name);
+        }
+        return TRUE;
+    }
 
-            case OPCODE_SUB:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                // if(temp == 0)
-                // {
-                   flags[cpu->writeback.rd]--;
-                   stall = 0;
-                //}
-                
-                break;
-            }
+    if (sscanf(args, "cycle %d", &a) == 1)
+    {
+        cpu->break_cycle = a;
+        return TRUE;
+    }
+
+    if (sscanf(args, "reg R%d %d", &a, &b) == 2 && a >= 0 && a < REG_FILE_SIZE)
+    {
+        cpu->reg_break |= 1u << a;
+        cpu->reg_break_value[a] = b;
+        return TRUE;
+    }
 
-            case OPCODE_SUBL:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
-            }
+    if (sscanf(args, "mem %d", &a) == 1)
+    {
+        APEX_watch_mem(cpu, a, a, TRUE);
+        return TRUE;
+    }
 
-            case OPCODE_MUL:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
-            }
+    return FALSE;
+}
 
-            case OPCODE_DIV:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
-            }
+/*
+Removes every breakpoint and halting watchpoint
+*/
+static void
+debug_delete(APEX_CPU *cpu)
+{
+    int i;
 
-            case OPCODE_AND:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
-            }
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        cpu->code_memory[i].breakpoint = FALSE;
+    }
+    cpu->break_cycle = -1;
+    cpu->reg_break = 0;
+    memset(cpu->mem_watch_halt, 0, sizeof(cpu->mem_watch_halt));
+}
 
-            case OPCODE_OR:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
-            }
+/*
+Command driven debugger. Between stops the CPU runs the same quiet cycle loop
+as simulate without recording history, breakpoints only cost a flag test per
+cycle
+*/
+static void
+run_debugger(APEX_CPU *cpu)
+{
+    static APEX_CPU saved;
+    APEX_History *history;
+    char cmd[128];
+    int n, i, lo, hi;
+
+    /* The debugger counts completed cycles, cycle 1 is the first step */
+    cpu->clock = 0;
+    cpu->break_cycle = -1;
+    if (!cpu->history)
+    {
+        APEX_history_enable(cpu, cpu->history_size);
+    }
+    if (cpu->history)
+    {
+        APEX_history_commit(cpu);
+    }
 
-            case OPCODE_XOR:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
-            }
+    printf("APEX_DEBUG: type help for commands\n");
 
-            case OPCODE_LOAD:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                //printf("Value at register %d = %d \n", cpu->writeback.rd, cpu->writeback.result_buffer);
-                break;
-            }
+    while (TRUE)
+    {
+        printf("apex> ");
+        fflush(stdout);
+        if (!fgets(cmd, sizeof(cmd), stdin) || strncmp(cmd, "quit", 4) == 0
+            || strcmp(cmd, "q\n") == 0)
+        {
+            printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+            return;
+        }
 
-            case OPCODE_LDR:
+        if (strncmp(cmd, "continue", 8) == 0 || strcmp(cmd, "c\n") == 0)
+        {
+            /* Quiet cycles are not recorded, back then stops where they did */
+            history = cpu->history;
+            cpu->history = NULL;
+            while (TRUE)
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                //printf("register name = %d and result = %d \n",cpu->writeback.rd, cpu->writeback.result_buffer);
-                break;
+                if (run_cycle(cpu, TRUE))
+                {
+                    cpu->history = history;
+                    printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+                    return;
+                }
+                if ((cpu->break_hit | cpu->watch_hit | (cpu->clock == cpu->break_cycle))
+                    && report_break(cpu))
+                {
+                    break;
+                }
             }
-
-            case OPCODE_STORE:
+            cpu->history = history;
+            if (cpu->history)
             {
-                //printf("result at memory address %d is = %d \n", cpu->writeback.memory_address, cpu->data_memory[cpu->writeback.memory_address]);
-                break;
+                APEX_history_restart(cpu);
             }
-
-            case OPCODE_STR:
+            print_pipeline(cpu);
+        }
+        else if (strncmp(cmd, "step", 4) == 0 || strcmp(cmd, "s\n") == 0
+                 || strncmp(cmd, "s ", 2) == 0)
+        {
+            n = 1;
+            sscanf(cmd, "%*s %d", &n);
+            for (i = 0; i < n; ++i)
             {
-                //printf("result at memory address %d is = %d \n", cpu->writeback.memory_address, cpu->data_memory[cpu->writeback.memory_address]);
-                break;
+                if (run_cycle(cpu, FALSE))
+                {
+                    printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+                    return;
+                }
+                if (report_break(cpu))
+                {
+                    break;
+                }
             }
-
-            case OPCODE_MOVC: 
+        }
+        else if (strncmp(cmd, "break ", 6) == 0)
+        {
+            if (!debug_break(cpu, cmd + 6))
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                flags[cpu->writeback.rd]--;
-                stall = 0;
-                break;
+                printf("APEX_DEBUG: break pc <pc> | op <OPCODE> | cycle <n> | reg R<n> <value> | mem <addr>\n");
             }
-            
-            case OPCODE_CMP:
+        }
+        else if (strncmp(cmd, "delete", 6) == 0)
+        {
+            debug_delete(cpu);
+        }
+        else if (strncmp(cmd, "stages", 6) == 0)
+        {
+            print_pipeline(cpu);
+        }
+        else if (strncmp(cmd, "regs", 4) == 0)
+        {
+            print_reg_flag(cpu);
+        }
+        else if (sscanf(cmd, "mem %d-%d", &lo, &hi) >= 1)
+        {
+            if (sscanf(cmd, "mem %d-%d", &lo, &hi) == 1)
             {
-                break;
+                hi = lo;
             }
-
-            case OPCODE_NOP:
+            for (i = lo < 0 ? 0 : lo; i <= hi && i < cpu->machine.mem_size; ++i)
             {
-                break;
+                print_mem_word(cpu, i);
             }
-            
-
         }
-
-        cpu->insn_completed++;
-        cpu->writeback.has_insn = FALSE;
-
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
+        else if (sscanf(cmd, "back %d", &n) == 1)
         {
-            print_stage_content("Instruction at WRITEBACK_STAGE --->", &cpu->writeback);
+            /* Breakpoints live in the CPU struct, keep them across the undo */
+            memcpy(&saved, cpu, sizeof(APEX_CPU));
+            for (i = 0; i < n && APEX_history_undo(cpu) == 0; i++)
+                ;
+            cpu->break_cycle = saved.break_cycle;
+            cpu->reg_break = saved.reg_break;
+            memcpy(cpu->reg_break_value, saved.reg_break_value, sizeof(cpu->reg_break_value));
+            memcpy(cpu->mem_watch_halt, saved.mem_watch_halt, sizeof(cpu->mem_watch_halt));
+            memcpy(cpu->mem_watch, saved.mem_watch, sizeof(cpu->mem_watch));
+            printf("APEX_CPU: Stepped back %d cycles (%d more recorded)\n", i,
+                   APEX_history_depth(cpu));
+            print_pipeline(cpu);
         }
-
-        if (cpu->writeback.opcode == OPCODE_HALT)
+        else if (strncmp(cmd, "help", 4) == 0)
         {
-            /* Stop the APEX simulator */
-            return TRUE;
+            printf("continue | c          run until a breakpoint or HALT\n");
+            printf("step [N] | s [N]      run N cycles printing every stage\n");
+            printf("break pc <pc>         stop when the instruction at pc issues\n");
+            printf("break op <OPCODE>     stop when any instruction with that opcode issues\n");
+            printf("break cycle <n>       stop after cycle n\n");
+            printf("break reg R<n> <v>    stop when R<n> is written with v\n");
+            printf("break mem <addr>      stop when data memory addr is written\n");
+            printf("delete                remove all breakpoints\n");
+            printf("stages | regs | mem <lo>[-<hi>]   inspect the CPU\n");
+            printf("back <N>              step N cycles backwards, not past a continue\n");
+            printf("quit | q              stop the simulation\n");
         }
-    }
-    else
-    {
-        if (ENABLE_DEBUG_MESSAGES && command_simulate == 0)
+        else if (cmd[0] != '\n')
         {
-           printf("Instruction at WRITEBACK_STAGE --->      EMPTY \n");
+            printf("APEX_DEBUG: unknown command, type help\n");
         }
-        
     }
-
-    /* Default */
-    return 0;
 }
 
 /*
-This function creates and initializes APEX cpu.
+Prints how a simulate/show_mem run ended
 */
-APEX_CPU *
-APEX_cpu_init(const char *filename)
+static void
+print_outcome(const APEX_CPU *cpu, int outcome)
 {
+    double ports;
+    long hits;
     int i;
-    APEX_CPU *cpu;
 
-    if (!filename)
+    if (outcome == RUN_HALTED)
     {
-        return NULL;
+        printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+    }
+    else if (outcome == RUN_WATCH)
+    {
+        printf("APEX_CPU: Watchpoint hit, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
     }
 
-    cpu = calloc(1, sizeof(APEX_CPU));
+    /* Resolving in execute, each of those targets would have issued a cycle later */
+    if (cpu->early_branch && outcome != RUN_LIMIT)
+    {
+        printf("APEX_CPU: Early branch resolution, taken branches = %ld cycles saved = %ld\n",
+               cpu->early_taken, cpu->early_saved);
+    }
 
-    if (!cpu)
+    if ((cpu->machine.queue || cpu->machine.loop_buffer) && outcome != RUN_LIMIT)
     {
-        return NULL;
+        printf("APEX_CPU: Front end, bubbles = %ld loop buffer hits = %ld of %ld fetches"
+               " loop exits = %ld\n",
+               cpu->fe_bubbles, cpu->loop_hits, cpu->next_uid, cpu->loop_exits);
     }
 
-    /* Initialize PC, Registers and all pipeline stages */
-    cpu->pc = 4000;
-    cpu->clock = 1;
-    memset(cpu->regs, 0, sizeof(int) * REG_FILE_SIZE);
-    memset(cpu->data_memory, 0, sizeof(int) * DATA_MEMORY_SIZE);
+    if (cpu->hw_loops_entered && outcome != RUN_LIMIT)
+    {
+        printf("APEX_CPU: Hardware loops, loops = %ld passes = %ld back jumps = %ld\n",
+               cpu->hw_loops_entered, cpu->hw_loop_passes, cpu->hw_loop_jumps);
+    }
 
-    
-    /* Parse input file and create code memory */
-    cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
-    if (!cpu->code_memory)
+    /* CPI counts both instructions of a fused pair */
+    if (cpu->machine.fusion && outcome != RUN_LIMIT)
     {
-        free(cpu);
-        return NULL;
+        printf("APEX_CPU: Fusion, fused pairs = %ld of %ld CPI = %.3f\n", cpu->fused,
+               cpu->fusible, cpu->insn_completed ? (double)cpu->clock / cpu->insn_completed
+                                                 : 0.0);
     }
 
-    if (ENABLE_DEBUG_MESSAGES)
+    if ((cpu->machine.mem_latency > 1 || cpu->machine.store_buffer || cpu->machine.load_queue
+         || cpu->machine.banks) && outcome != RUN_LIMIT)
     {
-        fprintf(stderr,
-                "APEX_CPU: Initialized APEX CPU, loaded %d instructions\n",
-                cpu->code_memory_size);
-        fprintf(stderr, "APEX_CPU: PC initialized to %d\n", cpu->pc);
-        fprintf(stderr, "APEX_CPU: Printing Code Memory\n");
-        printf("%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode_str", "rd", "rs1", "rs2",
-               "rs3", "imm");
+        printf("APEX_CPU: Memory, stalls = %ld store buffer full = %ld load queue full = %ld"
+               " forwarded loads = %ld of %ld\n",
+               cpu->mem_stalls, cpu->sb_full, cpu->lq_full, cpu->loads_forwarded, cpu->loads);
+    }
 
-        for (i = 0; i < cpu->code_memory_size; ++i)
-        {
-            printf("%-9s %-9d %-9d %-9d %-9d %-9d\n", cpu->code_memory[i].opcode_str,
-                   cpu->code_memory[i].rd, cpu->code_memory[i].rs1,
-                   cpu->code_memory[i].rs2, cpu->code_memory[i].rs3, cpu->code_memory[i].imm);
-        }
+    /* Utilization over the port cycles of the run, conflicts are cycles an
+     * access found every port busy (or a prefetch it dropped) */
+    for (i = 0; i < cpu->machine.banks && outcome != RUN_LIMIT; ++i)
+    {
+        ports = (double)cpu->clock * cpu->machine.bank_ports[i];
+        printf("APEX_CPU: Bank %d, accesses = %ld utilization = %.1f%% conflicts = %ld\n", i,
+               cpu->bank_accesses[i],
+               ports ? 100.0 * (cpu->bank_busy[i] < ports ? cpu->bank_busy[i] : ports) / ports
+                     : 0.0,
+               cpu->bank_conflicts[i]);
     }
 
-    /* To start fetch stage */
-    cpu->fetch.has_insn = TRUE;
-    return cpu;
+    /* Accuracy over lines fetched, coverage over loads that needed memory,
+     * timeliness over loads that hit a prefetched line */
+    if (cpu->machine.prefetch != PREFETCH_NONE && outcome != RUN_LIMIT)
+    {
+        hits = cpu->pf_hits + cpu->pf_late;
+        printf("APEX_CPU: Prefetch, lines = %ld accuracy = %.1f%% coverage = %.1f%%"
+               " timely = %.1f%% late hits = %ld\n", cpu->pf_issued,
+               cpu->pf_issued ? 100.0 * cpu->pf_useful / cpu->pf_issued : 0.0,
+               hits + cpu->pf_misses ? 100.0 * hits / (hits + cpu->pf_misses) : 0.0,
+               hits ? 100.0 * cpu->pf_hits / hits : 0.0, cpu->pf_late);
+    }
 }
 
 /*
@@ -1194,8 +2427,10 @@ APEX CPU simulation loop
 void
 APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step)
 {
-    char user_prompt_val;
+    char user_prompt_val[128];
     int val = atoi(step);
+    int outcome = RUN_LIMIT;
+    int fast_forward = strcmp(command, "simulate") == 0;
      
     
     if(strcmp(command, "simulate") == 0 || strcmp(command, "show_mem") == 0)
@@ -1203,73 +2438,85 @@ APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step)
         command_simulate = 1;
     }
 
-    if(strcmp(command,"single_step") == 0)
+    if(strcmp(command, "debug") == 0)
+    {
+      run_debugger(cpu);
+      APEX_print_state(cpu);
+    }
+    else if(strcmp(command, "multicore") == 0)
+    {
+      if (val < 1 || val > MULTICORE_MAX_CORES)
+      {
+        fprintf(stderr, "APEX_Error: multicore needs 1 to %d cores\n", MULTICORE_MAX_CORES);
+        return;
+      }
+      if (APEX_multicore_run(cpu, val, cpu->quantum) == 0)
+      {
+        APEX_print_state(cpu);
+      }
+    }
+    else if(strcmp(command, "analyze") == 0)
+    {
+      APEX_analyze(cpu);
+    }
+    else if(strcmp(command, "sweep") == 0)
+    {
+      if (strcmp(step, "-1") == 0)
+      {
+        fprintf(stderr, "APEX_Error: sweep needs a machine description\n");
+        return;
+      }
+      APEX_sweep(cpu, step);
+    }
+    else if(strcmp(command, "schedule") == 0)
+    {
+      if (strcmp(step, "-1") == 0)
+      {
+        fprintf(stderr, "APEX_Error: schedule needs an output file\n");
+        return;
+      }
+      APEX_schedule(cpu, step);
+    }
+    else if(strcmp(command,"single_step") == 0)
     {
       cpu->single_step = ENABLE_SINGLE_STEP;
-      while (TRUE)
+      run_single_step(cpu);
+      APEX_print_state(cpu);
+    }
+    else if(strcmp(command, "show_mem") == 0)
+    {
+     if (APEX_cache_lookup(cpu, command, val, &outcome))
      {
-        if (ENABLE_DEBUG_MESSAGES)
-        {
-                printf("--------------------------------------------\n");
-                printf("Clock Cycle #: %d\n", cpu->clock);
-                printf("--------------------------------------------\n");
-            
-        }
-
-        if (APEX_writeback(cpu))
+        print_outcome(cpu, outcome);
+     }
+     else
+     {
+     while (TRUE)
+    {
+        if (run_stages(cpu))
         {
             /* Halt in writeback stage */
-               printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-               break;
+            outcome = RUN_HALTED;
+            print_outcome(cpu, outcome);
+            break;
         }
 
-        APEX_memory(cpu);
-        APEX_execute(cpu);
-        APEX_decode(cpu);
-        APEX_fetch(cpu);
-
-        if (cpu->single_step)
+        if (cpu->watch_hit)
         {
-            printf("Press any key to advance CPU Clock or <q> to quit:\n");
-            scanf("%c", &user_prompt_val);
-
-            if ((user_prompt_val == 'Q') || (user_prompt_val == 'q'))
-            {
-                printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-                break;
-            }
+            outcome = RUN_WATCH;
+            print_outcome(cpu, outcome);
+            break;
         }
 
-        cpu->clock++;
-    }
-    printf("\n");
-    print_reg_flag(cpu);
-    printf("\n");
-    print_mem(cpu);
-    printf("\n");
-    }
-    else if(strcmp(command, "show_mem") == 0)
-    {
-     while (TRUE)
-    {
-        if (APEX_writeback(cpu))
+        if (cpu->ff)
         {
-            /* Halt in writeback stage */
-            // if(strcmp(command, "display") == 0)
-            // {
-               printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-               break;
-            //}
-            
+            APEX_ff_cycle_end(cpu, INT_MAX);
         }
 
-        APEX_memory(cpu);
-        APEX_execute(cpu);
-        APEX_decode(cpu);
-        APEX_fetch(cpu);
-
         cpu->clock++;
     }
+     APEX_cache_store(cpu, outcome);
+     }
     printf("\n");
     print_reg_flag(cpu);
     printf("\n");
@@ -1279,6 +2526,13 @@ APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step)
     }
     else // simulate and display
     {
+        /* display prints every stage so only simulate can come from the cache */
+        if (strcmp(command, "simulate") == 0 && APEX_cache_lookup(cpu, command, val, &outcome))
+        {
+            print_outcome(cpu, outcome);
+        }
+        else
+        {
         while (cpu->clock <= val)
     {
         if (ENABLE_DEBUG_MESSAGES)
@@ -1292,20 +2546,34 @@ APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step)
             
         }
 
-        if (APEX_writeback(cpu))
+        if (run_stages(cpu))
         {
-               printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+               outcome = RUN_HALTED;
+               print_outcome(cpu, outcome);
                break;
             
         }
 
-        APEX_memory(cpu);
-        APEX_execute(cpu);
-        APEX_decode(cpu);
-        APEX_fetch(cpu);
+        if (cpu->watch_hit)
+        {
+            outcome = RUN_WATCH;
+            print_outcome(cpu, outcome);
+            break;
+        }
+
+        /* display shows every cycle, only simulate skips them */
+        if (cpu->ff && fast_forward)
+        {
+            APEX_ff_cycle_end(cpu, val);
+        }
 
         cpu->clock++;
     }
+        if (strcmp(command, "simulate") == 0)
+        {
+            APEX_cache_store(cpu, outcome);
+        }
+        }
 
     printf("\n");
     print_reg_flag(cpu);
@@ -1314,54 +2582,20 @@ APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step)
     printf("\n");
     
     cpu->single_step = ENABLE_SINGLE_STEP;
+    cpu->watch_hit = FALSE;
 
     if (cpu->single_step)
         {
             printf("Press any key to advance CPU Clock or <q> to quit:\n");
-            scanf("%c", &user_prompt_val);
-
-            if ((user_prompt_val == 'Q') || (user_prompt_val == 'q'))
-            {
-                printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-            }
-        }
-
-           while (TRUE)
-     {
-        if (ENABLE_DEBUG_MESSAGES)
-        {
-                printf("--------------------------------------------\n");
-                printf("Clock Cycle #: %d\n", cpu->clock);
-                printf("--------------------------------------------\n");
-            
-        }
-
-        if (APEX_writeback(cpu))
-        {
-            /* Halt in writeback stage */
-               printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-               break;
-        }
-
-        APEX_memory(cpu);
-        APEX_execute(cpu);
-        APEX_decode(cpu);
-        APEX_fetch(cpu);
-
-        if (cpu->single_step)
-        {
-            printf("Press any key to advance CPU Clock or <q> to quit:\n");
-            scanf("%c", &user_prompt_val);
+            read_command(user_prompt_val, sizeof(user_prompt_val));
 
-            if ((user_prompt_val == 'Q') || (user_prompt_val == 'q'))
+            if ((user_prompt_val[0] == 'Q') || (user_prompt_val[0] == 'q'))
             {
                 printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-                break;
             }
         }
 
-        cpu->clock++;
-    }
+    run_single_step(cpu);
     printf("\n");
     print_reg_flag(cpu);
     printf("\n");
@@ -1374,12 +2608,65 @@ APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step)
     
 }
 
+/*
+Arms a watchpoint on data memory words [lo, hi], halting the run if halt is set
+*/
+void
+APEX_watch_mem(APEX_CPU *cpu, int lo, int hi, int halt)
+{
+    int i;
+
+    if (lo < 0)
+    {
+        lo = 0;
+    }
+    if (hi >= DATA_MEMORY_SIZE)
+    {
+        hi = DATA_MEMORY_SIZE - 1;
+    }
+
+    for (i = lo; i <= hi; i++)
+    {
+        cpu->mem_watch[i / 32] |= 1u << (i % 32);
+        if (halt)
+        {
+            cpu->mem_watch_halt[i / 32] |= 1u << (i % 32);
+        }
+    }
+}
+
+/*
+Arms a watchpoint on an integer register, halting the run if halt is set,
+returns 0 or -1
+*/
+int
+APEX_watch_reg(APEX_CPU *cpu, int reg, int halt)
+{
+    if (reg < 0 || reg >= REG_FILE_SIZE)
+    {
+        fprintf(stderr, "APEX_Error: Only R0 to R%d can be watched\n", REG_FILE_SIZE - 1);
+        return -1;
+    }
+
+    cpu->reg_watch |= 1u << reg;
+    if (halt)
+    {
+        cpu->reg_watch_halt |= 1u << reg;
+    }
+    return 0;
+}
+
 /*
 This function deallocates APEX CPU.
 */
 void
 APEX_cpu_stop(APEX_CPU *cpu)
 {
+    APEX_shm_close(cpu);
+    APEX_konata_close(cpu);
+    APEX_ff_free(cpu);
+    APEX_history_free(cpu);
+    APEX_profile_free(cpu);
     free(cpu->code_memory);
     free(cpu);
 }
\ No newline at end of file
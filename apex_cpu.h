@@ -6,8 +6,30 @@
 #ifndef _APEX_CPU_H_
 #define _APEX_CPU_H_
 
+#include <stddef.h>
+#include <stdio.h>
+
 #include "apex_macros.h"
 
+/* Static description of an opcode, one entry per OPCODE_* in opcode_info */
+typedef struct APEX_Opcode_Info
+{
+    const char *name;           /* Mnemonic in the input file */
+    int fields[MAX_OPERANDS];   /* FIELD_* operands in assembly order */
+    int alu_op;                 /* ALU_* operation in execute */
+    int src_a;                  /* SRC_* first ALU input */
+    int src_b;                  /* SRC_* second ALU input */
+    int mem_access;             /* MEM_* access in the memory stage */
+    int store_src;              /* SRC_* data written by MEM_WRITE */
+    int branch;                 /* BRANCH_* condition */
+    int sets_zero_flag;         /* ALU result updates zero_flag */
+    int latency;                /* Cycles spent in execute */
+    int vector;                 /* Works on vector registers, see apex_vector.c */
+} APEX_Opcode_Info;
+
+extern const APEX_Opcode_Info opcode_info[NUM_OPCODES];
+char APEX_field_prefix(int field);
+
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
 {
@@ -18,52 +40,380 @@ typedef struct APEX_Instruction
     int rs2;
     int rs3;
     int imm;
+    unsigned int src_mask;  /* Bit per register read, built at load time */
+    unsigned int dest_mask; /* Bit of the register written, 0 if none */
+    int breakpoint;         /* Debugger stops when this instruction issues */
+    int line;               /* Line of the input file it was read from */
 } APEX_Instruction;
 
+/* Header of a binary data memory image, followed by words of host-endian data */
+typedef struct APEX_Mem_Image_Header
+{
+    char magic[4];          /* MEM_IMAGE_MAGIC */
+    unsigned int version;   /* MEM_IMAGE_VERSION */
+    unsigned int base;      /* Data memory address of the first word */
+    unsigned int words;     /* Number of words that follow */
+} APEX_Mem_Image_Header;
+
+/* One pipeline latch as published to shared memory */
+typedef struct APEX_Shm_Stage
+{
+    int pc;
+    int opcode;
+    int has_insn;
+    int bubble_cause;       /* BUBBLE_* when has_insn is FALSE */
+} APEX_Shm_Stage;
+
+/*
+Live state published to shared memory. seq is odd while the simulator writes,
+a reader copies the struct and keeps the copy only if seq was even and
+unchanged across the copy
+*/
+typedef struct APEX_Shm_State
+{
+    char magic[4];          /* SHM_STATE_MAGIC */
+    unsigned int version;   /* SHM_STATE_VERSION */
+    unsigned int seq;
+    int running;            /* FALSE once the simulation has stopped */
+    int clock;              /* Cycle whose start the rest describes */
+    int pc;
+    int insn_completed;
+    int zero_flag;
+    int stall;
+    int regs[REG_FILE_SIZE];
+    int pending[REG_FILE_SIZE];
+    APEX_Shm_Stage stages[5]; /* Fetch, decode, execute, memory, writeback */
+} APEX_Shm_State;
+
 /* Model of CPU stage latch */
 typedef struct CPU_Stage
 {
     int pc;
-    char opcode_str[128];
     int opcode;
     int rs1;
     int rs2;
     int rs3;
     int rd;
     int imm;
+    unsigned int src_mask;
+    unsigned int dest_mask;
     int rs1_value;
     int rs2_value;
     int rs3_value;
     int result_buffer;
+    int vresult[VECTOR_MAX_LENGTH]; /* Vector result, or the words VLOAD read */
     int memory_address;
+    int cycles_left;    /* Execute cycles remaining for this instruction */
+    int predicted;      /* Fetch went on at the branch target, see loop_buffer */
+    int queued;         /* Load whose register the load queue writes */
+    int fused;          /* Opcode of the BZ/BNZ fused into it by decode, 0 if none */
+    int fused_imm;      /* Its offset */
+    long fused_uid;
+    int endloops;       /* ENDLOOPs fetch folded away right before it */
     int has_insn;
+    int bubble_cause;   /* BUBBLE_* reason when has_insn is FALSE */
+    int bubble_pc;      /* Instruction charged for the bubble, 0 if none */
+    int bubble_pc2;     /* Producer a BUBBLE_RAW waited on */
+    long uid;           /* Dynamic instruction number, assigned at fetch */
 } CPU_Stage;
 
+/* Cycles charged to one code memory entry by the profiler */
+typedef struct APEX_Profile_Entry
+{
+    long retire;        /* Cycles in which it retired */
+    long raw_stall;     /* Bubbles while it waited in decode on a RAW hazard */
+    long raw_caused;    /* Bubbles other instructions waited on its result */
+    long flush;         /* Bubbles from flushing after it was taken */
+    long latency;       /* Bubbles from it holding a multi-cycle execute or MEM */
+} APEX_Profile_Entry;
+
+/* Count of RAW bubbles for one consumer/producer pair */
+typedef struct APEX_Profile_Pair
+{
+    int consumer;       /* Code memory index, -1 marks a free slot */
+    int producer;
+    long count;
+} APEX_Profile_Pair;
+
+/* Per-PC profile of a run */
+typedef struct APEX_Profile
+{
+    APEX_Profile_Entry *entries;   /* One per code memory entry */
+    long frontend;                 /* Fill and fetch bubbles owned by no PC */
+    APEX_Profile_Pair *pairs;      /* Open addressed on consumer/producer */
+    int pairs_size;                /* Slots, a power of two */
+    int pairs_used;
+    int halted;                    /* HALT retired, later cycles are not charged */
+} APEX_Profile;
+
+typedef struct APEX_Konata APEX_Konata;
+typedef struct APEX_Fast_Forward APEX_Fast_Forward;
+
+/* Stores a core made to shared data memory during the current quantum. The
+ * core reads them back itself, other cores see them once the quantum ends */
+typedef struct APEX_Quantum_Stores
+{
+    int value[DATA_MEMORY_SIZE];
+    unsigned int held[BITMAP_WORDS(DATA_MEMORY_SIZE)];
+    int addr[DATA_MEMORY_SIZE];     /* Held addresses in first store order */
+    int count;
+} APEX_Quantum_Stores;
+
+/* Bounded history of per-cycle deltas used to run backwards */
+typedef struct APEX_History
+{
+    unsigned char *buf;             /* Circular record storage */
+    size_t size;                    /* Bytes in buf */
+    size_t head;                    /* Offset of the next record */
+    size_t *records;                /* Record offsets, oldest at first */
+    int max_records;
+    int first;
+    int count;
+    void *prev;                     /* APEX_CPU as of the last commit */
+    int have_prev;
+    struct History_Mem_Write *mem;  /* Data memory writes of this cycle */
+    int mem_count;
+    int mem_cap;
+    int overflow;                   /* This cycle could not be recorded */
+} APEX_History;
+
+/* Pipeline parameters read from a machine description, see --config */
+typedef struct APEX_Machine
+{
+    int registers;                 /* Registers a program may use, <= REG_FILE_SIZE */
+    int mem_size;                  /* Data memory words, <= DATA_MEMORY_SIZE */
+    int latency[NUM_OPCODES];      /* Execute cycles per opcode */
+    int forwarding;                /* Decode reads results from the MEM and WB latches */
+    int queue;                     /* Instruction queue entries, 0 couples fetch to decode */
+    int loop_buffer;               /* Loop buffer entries, 0 if none */
+    int mem_latency;               /* Cycles of a data memory access */
+    int store_buffer;              /* Store buffer entries, 0 if stores hold MEM */
+    int load_queue;                /* Load queue entries, 0 if loads hold MEM */
+    int prefetch;                  /* PREFETCH_* data prefetcher */
+    int prefetch_lines;            /* Lines of the prefetch buffer */
+    int prefetch_degree;           /* Lines or strides it fetches ahead */
+    int fusion;                    /* Decode fuses CMP/ADDL/SUBL with a next BZ/BNZ */
+    int banks;                     /* Data memory banks, 0 for one pipelined port */
+    int bank_latency[MEMORY_MAX_BANKS]; /* Cycles of an access, 0 for mem_latency */
+    int bank_ports[MEMORY_MAX_BANKS]; /* Ports of a bank, each busy for an access */
+    int vector_length;             /* Elements of a vector register */
+    int loop_depth;                /* Hardware loops that may be nested */
+} APEX_Machine;
+
+/* Loop count and loop address register of one LOOP/ENDLOOP level */
+typedef struct APEX_Hw_Loop
+{
+    int addr;                      /* PC of the first instruction of the body */
+    int count;                     /* Passes left, this one included */
+} APEX_Hw_Loop;
+
+/* A store waiting in the store buffer or a load in the load queue */
+typedef struct APEX_Mem_Op
+{
+    int pc;
+    int addr;
+    int value;                     /* Stored, or loaded at issue */
+    int rd;                        /* Register a load writes */
+    int ready;                     /* Cycle it completes, once sent to memory */
+} APEX_Mem_Op;
+
+/* A line of data memory the prefetcher fetched or is fetching */
+typedef struct APEX_Prefetch_Line
+{
+    int valid;
+    int line;                      /* Address / PREFETCH_LINE_WORDS */
+    int ready;                     /* Cycle a load finds it in the buffer */
+    int used;                      /* A load hit it */
+} APEX_Prefetch_Line;
+
+/* Stride prefetcher state of the load at one PC */
+typedef struct APEX_Stride_Entry
+{
+    int pc;                        /* 0 if unused */
+    int last_addr;
+    int stride;
+    int confidence;                /* Times in a row the stride repeated */
+} APEX_Stride_Entry;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
     int pc;                        /* Current program counter */
+    const char *filename;          /* Input file the code was loaded from */
     int clock;                     /* Clock cycles elapsed */
     int insn_completed;            /* Instructions retired */
     int regs[REG_FILE_SIZE];       /* Integer register file */
+    int vregs[VREG_FILE_SIZE][VECTOR_MAX_LENGTH]; /* Vector register file */
     int code_memory_size;          /* Number of instruction in the input file */
     APEX_Instruction *code_memory; /* Code Memory */
-    int data_memory[DATA_MEMORY_SIZE]; /* Data Memory */
+    int *data_memory;              /* Data Memory, own_data_memory unless shared */
+    int own_data_memory[DATA_MEMORY_SIZE];
     int single_step;               /* Wait for user input after every cycle */
     int zero_flag;                 /* {TRUE, FALSE} Used by BZ and BNZ to branch */
-    int fetch_from_next_cycle;
-   
-
-    /* Pipeline stages */
-    CPU_Stage fetch;
-    CPU_Stage decode;
-    CPU_Stage execute;
-    CPU_Stage memory;
-    CPU_Stage writeback;
+
+    /* Scoreboard: outstanding writes per register and the registers with any,
+     * vector registers after the integer ones */
+    int pending[SCOREBOARD_SIZE];
+    unsigned int pending_mask;
+    int stall;                     /* Decode is stalled on a RAW hazard */
+
+    /* Resolving BZ/BNZ in decode, see --early-branch */
+    int early_branch;
+    int early_redirect;            /* Cycle of the last redirect, -1 once used */
+    long early_taken;              /* Taken branches resolved in decode */
+    long early_saved;              /* Of those, targets that issued a cycle sooner */
+    long fusible;                  /* Flag setters issued right before a branch */
+    long fused;                    /* Of those, fused with it, see the fusion key */
+    APEX_Machine machine;
+
+    /* Decoupled front end, see the queue and loop_buffer machine keys */
+    CPU_Stage queue[FRONTEND_MAX_QUEUE]; /* Fetched ahead of decode */
+    int queue_head;                /* Oldest entry */
+    int queue_count;
+    int loop_start;                /* Loop held in the loop buffer, loop_end is */
+    int loop_end;                  /* the PC of its closing branch, 0 if none */
+    unsigned int loop_filled;      /* Bit per entry fetched into the buffer */
+    int loop_valid;                /* Every entry is filled, fetch replays it */
+    long fe_bubbles;               /* Cycles decode had nothing while fetch ran */
+    long loop_hits;                /* Instructions fetched from the loop buffer */
+    long loop_exits;               /* Replayed closing branches that fell through */
+
+    /* LOOP/ENDLOOP hardware loops, see the loop_depth machine key. Issue
+     * updates the registers, fetch runs ahead on its own copy and folds
+     * ENDLOOPs away, a redirect copies the issued state back */
+    APEX_Hw_Loop hw_loops[HW_LOOP_MAX_DEPTH];
+    int hw_loop_depth;
+    APEX_Hw_Loop fetch_loops[HW_LOOP_MAX_DEPTH];
+    int fetch_loop_depth;
+    long hw_loops_entered;         /* LOOPs issued */
+    long hw_loop_passes;           /* ENDLOOPs issued, one per pass */
+    long hw_loop_jumps;            /* Of those, back to the start of the body */
+
+    /* In front of the data memory port, see the store_buffer, load_queue and
+     * memory_latency machine keys */
+    APEX_Mem_Op store_buffer[STORE_BUFFER_MAX]; /* Stores that left MEM */
+    int sb_head;                   /* Oldest entry */
+    int sb_count;
+    int sb_issued;                 /* Oldest entries already sent to memory */
+    APEX_Mem_Op load_queue[LOAD_QUEUE_MAX]; /* Loads waiting on memory */
+    int lq_head;
+    int lq_count;
+    long mem_stalls;               /* Cycles MEM held an instruction */
+    long sb_full;                  /* Of those, a store waited for a buffer entry */
+    long lq_full;                  /* or a load for a queue entry */
+    long loads;                    /* Loads that left MEM */
+    long loads_forwarded;          /* Of those, served by the store buffer */
+
+    /* Data prefetcher, see the prefetch machine keys */
+    APEX_Prefetch_Line prefetch_buffer[PREFETCH_MAX_LINES];
+    int pf_next;                   /* Line the next prefetch replaces */
+    APEX_Stride_Entry stride_table[PREFETCH_TABLE_SIZE];
+    long pf_issued;                /* Lines prefetched */
+    long pf_useful;                /* Of those, hit by a load */
+    long pf_hits;                  /* Loads that found their line ready */
+    long pf_late;                  /* Loads that found it still on its way */
+    long pf_misses;                /* Loads memory served without a prefetch */
+
+    /* Banked data memory, see the banks machine keys */
+    int bank_free_at[MEMORY_MAX_BANKS][BANK_MAX_PORTS]; /* Cycle a port is free */
+    long bank_accesses[MEMORY_MAX_BANKS];
+    long bank_busy[MEMORY_MAX_BANKS];   /* Port cycles spent on accesses */
+    long bank_conflicts[MEMORY_MAX_BANKS]; /* Cycles an access found every port busy */
+
+    /* Dirty tracking and watchpoints, one bit per page/word/register */
+    unsigned int mem_dirty_pages[BITMAP_WORDS(DATA_MEMORY_PAGES)];
+    unsigned int mem_dirty[BITMAP_WORDS(DATA_MEMORY_SIZE)];
+    unsigned int mem_watch[BITMAP_WORDS(DATA_MEMORY_SIZE)];
+    unsigned int mem_watch_halt[BITMAP_WORDS(DATA_MEMORY_SIZE)];
+    unsigned int reg_dirty;
+    unsigned int reg_watch;
+    unsigned int reg_watch_halt;
+    int watch_hit;                 /* Set when a halting watchpoint fires */
+    int break_hit;                 /* BREAK_* debugger breakpoint that fired */
+    int break_pc;                  /* Instruction of a BREAK_INSN */
+    int break_reg;                 /* Register of a BREAK_REG */
+    int break_cycle;               /* Debugger stops after this cycle, -1 if none */
+    unsigned int reg_break;        /* Registers with a value breakpoint */
+    int reg_break_value[REG_FILE_SIZE];
+    int dump_mode;                 /* {DUMP_DEFAULT, DUMP_DIFF, DUMP_RANGE} */
+    int dump_lo;                   /* First word printed in DUMP_RANGE */
+    int dump_hi;                   /* One past last word in DUMP_RANGE */
+
+    APEX_Profile *profile;         /* Per-PC cycle attribution, NULL if off */
+    APEX_History *history;         /* Reverse execution deltas, NULL if off */
+    size_t history_size;           /* Bytes of history to keep when stepping */
+    int quantum;                   /* Cycles multicore cores run between syncs */
+    const char *cache_dir;         /* Result cache directory, NULL if off */
+    unsigned long long cache_key;  /* Key of the current run, 0 if not cached */
+    APEX_Shm_State *shm;           /* Published live state, NULL if off */
+    struct APEX_Konata *konata;    /* Pipeline trace writer, NULL if off */
+    struct APEX_Quantum_Stores *stores; /* Held stores of a shared memory core */
+    struct APEX_Fast_Forward *ff;  /* Steady-state loop skipping, NULL if off */
+    long next_uid;                 /* uid of the next instruction fetched */
+    int fetch_held;                /* Fetch latch holds a stalled instruction */
+
+    /* Pipeline latches, indexed by STAGE_*. Stages read latch[cur] and write
+     * latch[!cur], cur flips at the end of the cycle (see CUR_LATCH) */
+    CPU_Stage latch[2][NUM_STAGES];
+    int cur;
 } APEX_CPU;
 
+/* Set while running without stage output */
+extern int command_simulate;
+
 APEX_Instruction *create_code_memory(const char *filename, int *size);
+int get_code_memory_index_from_pc(const int pc);
 APEX_CPU *APEX_cpu_init(const char *filename/*,const char *command*/);
 void APEX_cpu_run(APEX_CPU *cpu, const char *command, const char *step);
 void APEX_cpu_stop(APEX_CPU *cpu);
+int APEX_cpu_step(APEX_CPU *cpu);
+int APEX_alu(int alu_op, int a, int b);
+void APEX_vector_init(void);
+void APEX_vector_alu(int alu_op, const int *a, const int *b, int *out, int n);
+int APEX_vector_used(const APEX_CPU *cpu);
+int APEX_hw_loop_used(const APEX_CPU *cpu);
+void APEX_print_state(const APEX_CPU *cpu);
+void APEX_fprint_instruction(FILE *fp, const CPU_Stage *stage);
+void APEX_watch_mem(APEX_CPU *cpu, int lo, int hi, int halt);
+int APEX_watch_reg(APEX_CPU *cpu, int reg, int halt);
+int APEX_load_data_image(APEX_CPU *cpu, const char *filename);
+int APEX_save_data_image(const APEX_CPU *cpu, const char *filename, int raw);
+int APEX_profile_enable(APEX_CPU *cpu);
+void APEX_profile_cycle(APEX_CPU *cpu);
+int APEX_profile_write(const APEX_CPU *cpu, const char *listing_file,
+                       const char *folded_file);
+void APEX_profile_free(APEX_CPU *cpu);
+int APEX_history_enable(APEX_CPU *cpu, size_t size);
+void APEX_history_mem_write(APEX_CPU *cpu, int addr, int old_value);
+void APEX_history_commit(APEX_CPU *cpu);
+void APEX_history_restart(APEX_CPU *cpu);
+int APEX_history_undo(APEX_CPU *cpu);
+int APEX_history_depth(const APEX_CPU *cpu);
+void APEX_history_free(APEX_CPU *cpu);
+int APEX_shm_open(APEX_CPU *cpu, const char *name);
+void APEX_shm_publish(APEX_CPU *cpu);
+void APEX_shm_close(APEX_CPU *cpu);
+int APEX_konata_open(APEX_CPU *cpu, const char *filename);
+void APEX_konata_stage(APEX_CPU *cpu, int stage, const CPU_Stage *latch);
+void APEX_konata_note(APEX_CPU *cpu, const CPU_Stage *latch, const char *note, int pc);
+void APEX_konata_retire(APEX_CPU *cpu, const CPU_Stage *latch);
+void APEX_konata_flush(APEX_CPU *cpu, const CPU_Stage *latch);
+void APEX_konata_close(APEX_CPU *cpu);
+int APEX_cache_lookup(APEX_CPU *cpu, const char *command, int step, int *outcome);
+void APEX_cache_store(const APEX_CPU *cpu, int outcome);
+int APEX_ff_enable(APEX_CPU *cpu);
+void APEX_ff_execute(APEX_CPU *cpu, int pc, int taken);
+void APEX_ff_cycle_end(APEX_CPU *cpu, int limit);
+void APEX_ff_free(APEX_CPU *cpu);
+int APEX_prefetch_lookup(const APEX_CPU *cpu, int addr);
+void APEX_prefetch_access(APEX_CPU *cpu, int pc, int addr, int entry, int cycles,
+                          int forwarded);
+int APEX_bank_access(APEX_CPU *cpu, int addr);
+int APEX_multicore_run(APEX_CPU *cpu, int count, int quantum);
+void APEX_analyze(const APEX_CPU *cpu);
+int APEX_schedule(APEX_CPU *cpu, const char *filename);
+void APEX_machine_default(APEX_Machine *machine);
+int APEX_machine_load(APEX_CPU *cpu, const char *filename);
+int APEX_result_delay(const APEX_CPU *cpu, int opcode);
+int APEX_sweep(APEX_CPU *cpu, const char *filename);
 #endif
@@ -0,0 +1,414 @@
+/*
+ * apex_fastforward.c
+ * Contains steady-state loop fast-forwarding. Timing in this pipeline only
+ * depends on the instruction sequence, never on data, so when a taken branch
+ * finds the pipeline in the same timing state (latch PCs, scoreboard, stall
+ * and fetch flags) as the last time it was taken, every further iteration
+ * that follows the same path costs the same cycles. Those iterations are run
+ * architecturally, one at a time, and their cycles added; the first one that
+ * takes another path is undone and detailed simulation resumes from the
+ * branch, so the cycle count stays exact.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Timing state of the pipeline at the end of a cycle */
+typedef struct FF_Signature
+{
+    int pc;
+    int stall;
+    int fetch_held;
+    unsigned int pending_mask;
+    int pending[SCOREBOARD_SIZE];
+    int has_insn[NUM_STAGES];
+    int stage_pc[NUM_STAGES];           /* 0 in an empty latch */
+    int cycles_left[NUM_STAGES];
+} FF_Signature;
+
+typedef struct FF_Store
+{
+    int addr;
+    int old_value;
+} FF_Store;
+
+struct APEX_Fast_Forward
+{
+    int event;                  /* A branch was taken this cycle */
+    int event_pc;
+
+    /* State at the last taken branch */
+    int valid;
+    int branch_pc;
+    FF_Signature sig;
+    int clock;
+    int insn_completed;
+    long next_uid;
+    long mem_stalls;
+    long loads;
+
+    /* PCs executed since the last taken branch, ending with it */
+    int path[FF_MAX_PATH];
+    int path_len;
+    int overflow;
+
+    FF_Store stores[FF_MAX_PATH];  /* Undo log of one iteration */
+    int store_count;
+
+    long iterations;            /* Statistics of the run */
+    long cycles;
+};
+
+static void
+fill_signature(const APEX_CPU *cpu, FF_Signature *sig)
+{
+    const CPU_Stage *stage;
+    int i;
+
+    memset(sig, 0, sizeof(*sig));
+    sig->pc = cpu->pc;
+    sig->stall = cpu->stall;
+    sig->fetch_held = cpu->fetch_held;
+    sig->pending_mask = cpu->pending_mask;
+    memcpy(sig->pending, cpu->pending, sizeof(sig->pending));
+    for (i = 0; i < NUM_STAGES; ++i)
+    {
+        stage = CUR_LATCH(cpu, i);
+        if (stage->has_insn)
+        {
+            sig->has_insn[i] = TRUE;
+            sig->stage_pc[i] = stage->pc;
+            sig->cycles_left[i] = stage->cycles_left;
+        }
+    }
+}
+
+/*
+Returns TRUE if the run may skip cycles, anything observing single cycles
+(profile, trace, live state, watchpoints, shared memory) keeps it detailed.
+Branches resolved in decode have fetched the target by the time they execute,
+and fused ones execute with their flag setter, the instruction queue and loop
+buffer keep state across iterations, which the skipped path does not model,
+and so do the store buffer, load queue, prefetcher and memory banks, whose
+timing also depends on addresses
+*/
+static int
+can_fast_forward(const APEX_CPU *cpu)
+{
+    int i;
+
+    if (cpu->profile || cpu->konata || cpu->shm || cpu->history || cpu->stores
+        || cpu->reg_watch || cpu->early_branch || cpu->machine.fusion
+        || cpu->machine.queue || cpu->machine.loop_buffer || cpu->machine.store_buffer
+        || cpu->machine.load_queue || cpu->machine.prefetch != PREFETCH_NONE
+        || cpu->machine.banks)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < BITMAP_WORDS(DATA_MEMORY_SIZE); ++i)
+    {
+        if (cpu->mem_watch[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int
+operand(const APEX_Instruction *ins, const int *regs, int src)
+{
+    switch (src)
+    {
+        case SRC_RS1:
+            return regs[ins->rs1];
+        case SRC_RS2:
+            return regs[ins->rs2];
+        case SRC_RS3:
+            return regs[ins->rs3];
+        case SRC_IMM:
+            return ins->imm;
+    }
+    return 0;
+}
+
+/*
+Runs one iteration of the recorded path architecturally from target, returns
+FALSE if it leaves the path. *fix_old and *fix_result receive the register
+write of the instruction before the branch
+*/
+static int
+run_iteration(APEX_CPU *cpu, APEX_Fast_Forward *ff, int target, int *regs,
+              int *zero_flag, int *fix_old, int *fix_result)
+{
+    const APEX_Instruction *ins;
+    const APEX_Opcode_Info *info;
+    int i, pc = target, index, result, addr;
+
+    ff->store_count = 0;
+
+    for (i = 0; i < ff->path_len; ++i)
+    {
+        index = get_code_memory_index_from_pc(pc);
+        if (pc != ff->path[i] || pc < 4000 || index >= cpu->code_memory_size)
+        {
+            return FALSE;
+        }
+
+        ins = &cpu->code_memory[index];
+        info = &opcode_info[ins->opcode];
+        /* A path through a hardware loop depends on its loop registers */
+        if (ins->opcode == OPCODE_HALT || info->vector || ins->opcode == OPCODE_LOOP
+            || ins->opcode == OPCODE_ENDLOOP)
+        {
+            return FALSE;
+        }
+
+        result = 0;
+        if (info->alu_op != ALU_NONE)
+        {
+            result = APEX_alu(info->alu_op, operand(ins, regs, info->src_a),
+                              operand(ins, regs, info->src_b));
+            if (info->sets_zero_flag)
+            {
+                *zero_flag = (result == 0) ? TRUE : FALSE;
+            }
+        }
+
+        if (info->mem_access != MEM_NONE)
+        {
+            addr = result;
+            if (addr < 0 || addr >= cpu->machine.mem_size)
+            {
+                return FALSE;
+            }
+            if (info->mem_access == MEM_READ)
+            {
+                result = cpu->data_memory[addr];
+            }
+            else
+            {
+                ff->stores[ff->store_count].addr = addr;
+                ff->stores[ff->store_count].old_value = cpu->data_memory[addr];
+                ff->store_count++;
+                cpu->data_memory[addr] = operand(ins, regs, info->store_src);
+            }
+        }
+
+        if (ins->dest_mask)
+        {
+            if (i == ff->path_len - 2)
+            {
+                *fix_old = regs[ins->rd];
+                *fix_result = result;
+            }
+            regs[ins->rd] = result;
+        }
+
+        if (info->branch != BRANCH_NONE
+            && *zero_flag == (info->branch == BRANCH_Z ? TRUE : FALSE))
+        {
+            pc += ins->imm;
+        }
+        else
+        {
+            pc += 4;
+        }
+    }
+
+    /* The path ends with the loop branch, taken back to the target */
+    return pc == target;
+}
+
+static void
+undo_stores(APEX_CPU *cpu, APEX_Fast_Forward *ff)
+{
+    int i;
+
+    for (i = ff->store_count; i > 0; --i)
+    {
+        cpu->data_memory[ff->stores[i - 1].addr] = ff->stores[i - 1].old_value;
+    }
+}
+
+/*
+Marks what an iteration wrote as dirty, for --dump=diff
+*/
+static void
+mark_dirty(APEX_CPU *cpu, APEX_Fast_Forward *ff)
+{
+    const APEX_Instruction *ins;
+    int i, addr;
+
+    for (i = 0; i < ff->store_count; ++i)
+    {
+        addr = ff->stores[i].addr;
+        cpu->mem_dirty[addr / 32] |= 1u << (addr % 32);
+        cpu->mem_dirty_pages[addr / DATA_MEMORY_PAGE_WORDS / 32]
+            |= 1u << (addr / DATA_MEMORY_PAGE_WORDS % 32);
+    }
+    for (i = 0; i < ff->path_len; ++i)
+    {
+        ins = &cpu->code_memory[get_code_memory_index_from_pc(ff->path[i])];
+        cpu->reg_dirty |= ins->dest_mask;
+    }
+}
+
+/*
+Skips whole iterations of the path just executed while the end of cycle
+limit allows, returns the number skipped
+*/
+static long
+fast_forward(APEX_CPU *cpu, APEX_Fast_Forward *ff, int limit)
+{
+    CPU_Stage *writeback = CUR_LATCH(cpu, STAGE_WRITEBACK);
+    int regs[REG_FILE_SIZE], saved[REG_FILE_SIZE];
+    int zero_flag = cpu->zero_flag, saved_zero;
+    int fix_old = 0, fix_result = 0, old = 0, result = 0, has_fix;
+    int cycles = cpu->clock - ff->clock;
+    int insns = cpu->insn_completed - ff->insn_completed;
+    long uids = cpu->next_uid - ff->next_uid;
+    long mem_stalls = cpu->mem_stalls - ff->mem_stalls;
+    long loads = cpu->loads - ff->loads;
+    long count = 0;
+
+    /* Only the instruction before the branch is still to write its register,
+     * and vector instructions are never skipped */
+    has_fix = writeback->has_insn && writeback->dest_mask;
+    if (writeback->has_insn
+        && (ff->path_len < 2 || writeback->pc != ff->path[ff->path_len - 2]
+            || opcode_info[writeback->opcode].vector))
+    {
+        return 0;
+    }
+
+    memcpy(regs, cpu->regs, sizeof(regs));
+    if (has_fix)
+    {
+        regs[writeback->rd] = writeback->result_buffer;
+    }
+
+    while (cycles > 0 && cpu->clock + (long)(count + 1) * cycles <= limit)
+    {
+        memcpy(saved, regs, sizeof(regs));
+        saved_zero = zero_flag;
+        if (!run_iteration(cpu, ff, cpu->pc, regs, &zero_flag, &old, &result))
+        {
+            undo_stores(cpu, ff);
+            memcpy(regs, saved, sizeof(regs));
+            zero_flag = saved_zero;
+            break;
+        }
+        fix_old = old;
+        fix_result = result;
+        mark_dirty(cpu, ff);
+        count++;
+    }
+
+    if (!count)
+    {
+        return 0;
+    }
+
+    memcpy(cpu->regs, regs, sizeof(regs));
+    if (has_fix)
+    {
+        cpu->regs[writeback->rd] = fix_old;
+        writeback->result_buffer = fix_result;
+    }
+    cpu->zero_flag = zero_flag;
+    cpu->clock += count * cycles;
+    cpu->insn_completed += count * insns;
+    cpu->next_uid += count * uids;
+    cpu->mem_stalls += count * mem_stalls;
+    cpu->loads += count * loads;
+    ff->cycles += count * cycles;
+    return count;
+}
+
+/*
+Turns on fast-forwarding for simulate and show_mem, returns 0 or -1
+*/
+int
+APEX_ff_enable(APEX_CPU *cpu)
+{
+    if (!cpu->ff)
+    {
+        cpu->ff = calloc(1, sizeof(APEX_Fast_Forward));
+    }
+    return cpu->ff ? 0 : -1;
+}
+
+/*
+Records an instruction leaving execute, taken tells if it redirected fetch
+*/
+void
+APEX_ff_execute(APEX_CPU *cpu, int pc, int taken)
+{
+    APEX_Fast_Forward *ff = cpu->ff;
+
+    if (ff->path_len < FF_MAX_PATH)
+    {
+        ff->path[ff->path_len++] = pc;
+    }
+    else
+    {
+        ff->overflow = TRUE;
+    }
+
+    if (taken)
+    {
+        ff->event = TRUE;
+        ff->event_pc = pc;
+    }
+}
+
+/*
+Called once the stages of a cycle ran. At a taken branch whose timing state
+repeats, skips iterations ending no later than limit
+*/
+void
+APEX_ff_cycle_end(APEX_CPU *cpu, int limit)
+{
+    APEX_Fast_Forward *ff = cpu->ff;
+    FF_Signature sig;
+
+    if (!ff->event)
+    {
+        return;
+    }
+    ff->event = FALSE;
+
+    fill_signature(cpu, &sig);
+    if (ff->valid && !ff->overflow && ff->branch_pc == ff->event_pc
+        && memcmp(&sig, &ff->sig, sizeof(sig)) == 0 && can_fast_forward(cpu))
+    {
+        ff->iterations += fast_forward(cpu, ff, limit);
+    }
+
+    ff->valid = TRUE;
+    ff->branch_pc = ff->event_pc;
+    ff->sig = sig;
+    ff->clock = cpu->clock;
+    ff->insn_completed = cpu->insn_completed;
+    ff->next_uid = cpu->next_uid;
+    ff->mem_stalls = cpu->mem_stalls;
+    ff->loads = cpu->loads;
+    ff->path_len = 0;
+    ff->overflow = FALSE;
+}
+
+void
+APEX_ff_free(APEX_CPU *cpu)
+{
+    if (cpu->ff && ENABLE_DEBUG_MESSAGES && cpu->ff->iterations)
+    {
+        fprintf(stderr, "APEX_CPU: Fast-forwarded %ld loop iterations, %ld cycles\n",
+                cpu->ff->iterations, cpu->ff->cycles);
+    }
+    free(cpu->ff);
+    cpu->ff = NULL;
+}
@@ -0,0 +1,358 @@
+/*
+ * apex_history.c
+ * Contains the bounded execution history used to step the CPU backwards.
+ * Each cycle is stored as a delta: the old bytes of every run of the APEX_CPU
+ * struct that changed (registers, latches, flags, counters) plus the old
+ * value of every data memory word written. Records live in a circular byte
+ * buffer and the oldest ones are dropped when it fills up.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Runs closer than this many words are merged into one */
+#define HISTORY_RUN_GAP 2
+
+typedef struct History_Record
+{
+    unsigned int length;        /* Bytes including this header */
+    unsigned int runs;          /* History_Run entries that follow */
+    unsigned int mem_writes;    /* History_Mem_Write entries after the runs */
+} History_Record;
+
+typedef struct History_Run
+{
+    unsigned int offset;        /* Word offset into APEX_CPU */
+    unsigned int words;         /* Old words that follow */
+} History_Run;
+
+typedef struct History_Mem_Write
+{
+    int addr;
+    int old_value;
+} History_Mem_Write;
+
+/* Words of APEX_CPU diffed each cycle, data memory is tracked by writes */
+#define CPU_WORDS (sizeof(APEX_CPU) / sizeof(unsigned int))
+#define MEM_FIRST_WORD (offsetof(APEX_CPU, own_data_memory) / sizeof(unsigned int))
+#define MEM_LAST_WORD (MEM_FIRST_WORD + DATA_MEMORY_SIZE)
+
+/*
+Finds the next run of changed words at or after *i, skipping data memory.
+Returns 0 when there are no more
+*/
+static int
+next_run(const unsigned int *cur, const unsigned int *prev, unsigned int *i,
+         unsigned int *start, unsigned int *end)
+{
+    unsigned int e;
+
+    while (*i < CPU_WORDS)
+    {
+        if (*i == MEM_FIRST_WORD)
+        {
+            *i = MEM_LAST_WORD;
+            continue;
+        }
+        if (cur[*i] != prev[*i])
+        {
+            break;
+        }
+        (*i)++;
+    }
+    if (*i >= CPU_WORDS)
+    {
+        return 0;
+    }
+
+    /* Extend the run until HISTORY_RUN_GAP unchanged words in a row */
+    for (e = *i + 1; e < CPU_WORDS && e != MEM_FIRST_WORD; ++e)
+    {
+        if (e + HISTORY_RUN_GAP <= CPU_WORDS
+            && memcmp(&cur[e], &prev[e], HISTORY_RUN_GAP * sizeof(unsigned int)) == 0)
+        {
+            break;
+        }
+    }
+
+    *start = *i;
+    *end = e;
+    *i = e;
+    return 1;
+}
+
+/*
+Allocates a history of at most size bytes, returns 0 or -1
+*/
+int
+APEX_history_enable(APEX_CPU *cpu, size_t size)
+{
+    APEX_History *h;
+
+    if (cpu->history)
+    {
+        return 0;
+    }
+
+    h = calloc(1, sizeof(APEX_History));
+    if (!h)
+    {
+        return -1;
+    }
+
+    h->size = size;
+    h->buf = malloc(size);
+    h->max_records = size / (sizeof(History_Record) + sizeof(History_Run) + sizeof(int));
+    h->records = malloc(h->max_records * sizeof(size_t));
+    h->prev = malloc(sizeof(APEX_CPU));
+    if (!h->buf || !h->records || !h->prev || !h->max_records)
+    {
+        free(h->buf);
+        free(h->records);
+        free(h->prev);
+        free(h);
+        return -1;
+    }
+
+    cpu->history = h;
+    return 0;
+}
+
+/*
+Saves the old value of a data memory word written in the current cycle
+*/
+void
+APEX_history_mem_write(APEX_CPU *cpu, int addr, int old_value)
+{
+    APEX_History *h = cpu->history;
+    History_Mem_Write *grown;
+    int cap;
+
+    if (h->mem_count == h->mem_cap)
+    {
+        cap = h->mem_cap ? h->mem_cap * 2 : 16;
+        grown = realloc(h->mem, cap * sizeof(History_Mem_Write));
+        if (!grown)
+        {
+            h->overflow = TRUE;
+            return;
+        }
+        h->mem = grown;
+        h->mem_cap = cap;
+    }
+
+    h->mem[h->mem_count].addr = addr;
+    h->mem[h->mem_count].old_value = old_value;
+    h->mem_count++;
+}
+
+static void
+drop_oldest(APEX_History *h)
+{
+    h->first = (h->first + 1) % h->max_records;
+    h->count--;
+}
+
+static void
+clear_records(APEX_History *h)
+{
+    h->first = 0;
+    h->count = 0;
+    h->head = 0;
+}
+
+/*
+Reserves length contiguous bytes for a new record, dropping old records
+that are in the way. Returns NULL if the record can never fit
+*/
+static unsigned char *
+reserve(APEX_History *h, size_t length)
+{
+    size_t oldest;
+
+    if (length > h->size)
+    {
+        return NULL;
+    }
+
+    if (h->head + length > h->size)
+    {
+        /* Wrap, records never straddle the end of the buffer */
+        while (h->count && h->records[h->first] >= h->head)
+        {
+            drop_oldest(h);
+        }
+        h->head = 0;
+    }
+
+    while (h->count)
+    {
+        oldest = h->records[h->first];
+        if (oldest >= h->head + length || oldest < h->head)
+        {
+            break;
+        }
+        drop_oldest(h);
+    }
+
+    if (h->count == h->max_records)
+    {
+        drop_oldest(h);
+    }
+
+    h->records[(h->first + h->count) % h->max_records] = h->head;
+    h->count++;
+    h->head += length;
+    return h->buf + h->head - length;
+}
+
+/*
+Ends a cycle: stores the delta from the state saved at the previous commit.
+The first commit after enabling only saves the state
+*/
+void
+APEX_history_commit(APEX_CPU *cpu)
+{
+    APEX_History *h = cpu->history;
+    const unsigned int *cur = (const unsigned int *)cpu;
+    unsigned int *prev = (unsigned int *)h->prev;
+    unsigned int runs = 0, words = 0, i, start, end;
+    History_Record *rec;
+    History_Run *run;
+    unsigned char *p;
+    size_t length;
+
+    if (!h->have_prev || h->overflow)
+    {
+        clear_records(h);
+        goto snapshot;
+    }
+
+    /* First pass sizes the record */
+    for (i = 0; next_run(cur, prev, &i, &start, &end); )
+    {
+        runs++;
+        words += end - start;
+    }
+
+    length = sizeof(History_Record) + runs * sizeof(History_Run)
+             + words * sizeof(unsigned int) + h->mem_count * sizeof(History_Mem_Write);
+    p = reserve(h, length);
+    if (!p)
+    {
+        clear_records(h);
+        goto snapshot;
+    }
+
+    rec = (History_Record *)p;
+    rec->length = length;
+    rec->runs = runs;
+    rec->mem_writes = h->mem_count;
+    p += sizeof(History_Record);
+
+    /* Second pass fills it with the same runs */
+    for (i = 0; next_run(cur, prev, &i, &start, &end); )
+    {
+        run = (History_Run *)p;
+        run->offset = start;
+        run->words = end - start;
+        p += sizeof(History_Run);
+        memcpy(p, &prev[start], (end - start) * sizeof(unsigned int));
+        p += (end - start) * sizeof(unsigned int);
+    }
+
+    memcpy(p, h->mem, h->mem_count * sizeof(History_Mem_Write));
+
+snapshot:
+    memcpy(h->prev, cpu, sizeof(APEX_CPU));
+    h->have_prev = TRUE;
+    h->overflow = FALSE;
+    h->mem_count = 0;
+}
+
+/*
+Forgets every recorded cycle and starts over from the current state, after
+the CPU ran on without recording
+*/
+void
+APEX_history_restart(APEX_CPU *cpu)
+{
+    cpu->history->have_prev = FALSE;
+    cpu->history->mem_count = 0;
+    APEX_history_commit(cpu);
+}
+
+/*
+Undoes the most recent recorded cycle, returns 0 or -1 if there is none
+*/
+int
+APEX_history_undo(APEX_CPU *cpu)
+{
+    APEX_History *h = cpu->history;
+    unsigned int *words = (unsigned int *)cpu;
+    const History_Mem_Write *mem;
+    const History_Record *rec;
+    const History_Run *run;
+    const unsigned char *p;
+    unsigned int i;
+    int last;
+
+    if (!h || !h->count)
+    {
+        return -1;
+    }
+
+    last = (h->first + h->count - 1) % h->max_records;
+    p = h->buf + h->records[last];
+    rec = (const History_Record *)p;
+    p += sizeof(History_Record);
+
+    for (i = 0; i < rec->runs; ++i)
+    {
+        run = (const History_Run *)p;
+        p += sizeof(History_Run);
+        memcpy(&words[run->offset], p, run->words * sizeof(unsigned int));
+        p += run->words * sizeof(unsigned int);
+    }
+
+    /* Later writes to the same word were saved later, so restore backwards */
+    mem = (const History_Mem_Write *)p;
+    for (i = rec->mem_writes; i > 0; --i)
+    {
+        cpu->data_memory[mem[i - 1].addr] = mem[i - 1].old_value;
+    }
+
+    h->head = h->records[last];
+    h->count--;
+    memcpy(h->prev, cpu, sizeof(APEX_CPU));
+    h->mem_count = 0;
+    return 0;
+}
+
+/*
+Returns the number of cycles that can be undone
+*/
+int
+APEX_history_depth(const APEX_CPU *cpu)
+{
+    return cpu->history ? cpu->history->count : 0;
+}
+
+void
+APEX_history_free(APEX_CPU *cpu)
+{
+    if (!cpu->history)
+    {
+        return;
+    }
+
+    free(cpu->history->buf);
+    free(cpu->history->records);
+    free(cpu->history->prev);
+    free(cpu->history->mem);
+    free(cpu->history);
+    cpu->history = NULL;
+}
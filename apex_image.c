@@ -0,0 +1,133 @@
+/*
+ * apex_image.c
+ * Contains loading and saving of binary data memory images. Both sides go
+ * through mmap so large images are copied without any text formatting
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/*
+Fills data memory from a raw image (host-endian words from address 0) or a
+headered image (APEX_Mem_Image_Header followed by the words), returns 0 or -1
+*/
+int
+APEX_load_data_image(APEX_CPU *cpu, const char *filename)
+{
+    const APEX_Mem_Image_Header *hdr;
+    const unsigned char *data;
+    const int *words;
+    struct stat st;
+    size_t base = 0, count;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to open memory image %s\n", filename);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "APEX_Error: Memory image %s is empty\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "APEX_Error: Unable to map memory image %s\n", filename);
+        return -1;
+    }
+
+    hdr = (const APEX_Mem_Image_Header *)data;
+    if ((size_t)st.st_size >= sizeof(*hdr)
+        && memcmp(hdr->magic, MEM_IMAGE_MAGIC, sizeof(hdr->magic)) == 0)
+    {
+        base = hdr->base;
+        count = hdr->words;
+        words = (const int *)(data + sizeof(*hdr));
+        if (hdr->version != MEM_IMAGE_VERSION
+            || count > (st.st_size - sizeof(*hdr)) / sizeof(int))
+        {
+            fprintf(stderr, "APEX_Error: Bad memory image header in %s\n", filename);
+            munmap((void *)data, st.st_size);
+            return -1;
+        }
+    }
+    else
+    {
+        count = st.st_size / sizeof(int);
+        words = (const int *)data;
+    }
+
+    if (base > (size_t)cpu->machine.mem_size || count > cpu->machine.mem_size - base)
+    {
+        fprintf(stderr, "APEX_Error: Memory image %s does not fit in %d words\n",
+                filename, cpu->machine.mem_size);
+        munmap((void *)data, st.st_size);
+        return -1;
+    }
+
+    memcpy(&cpu->data_memory[base], words, count * sizeof(int));
+    munmap((void *)data, st.st_size);
+    return 0;
+}
+
+/*
+Writes the machine's data memory to a file, with an APEX_Mem_Image_Header in front
+unless raw is set, returns 0 or -1
+*/
+int
+APEX_save_data_image(const APEX_CPU *cpu, const char *filename, int raw)
+{
+    APEX_Mem_Image_Header hdr;
+    size_t hdr_size = raw ? 0 : sizeof(hdr);
+    size_t size = hdr_size + cpu->machine.mem_size * sizeof(int);
+    unsigned char *data;
+    int fd;
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to create memory image %s\n", filename);
+        return -1;
+    }
+
+    if (ftruncate(fd, size) < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to size memory image %s\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "APEX_Error: Unable to map memory image %s\n", filename);
+        return -1;
+    }
+
+    if (!raw)
+    {
+        memcpy(hdr.magic, MEM_IMAGE_MAGIC, sizeof(hdr.magic));
+        hdr.version = MEM_IMAGE_VERSION;
+        hdr.base = 0;
+        hdr.words = cpu->machine.mem_size;
+        memcpy(data, &hdr, sizeof(hdr));
+    }
+
+    memcpy(data + hdr_size, cpu->data_memory, cpu->machine.mem_size * sizeof(int));
+    munmap(data, size);
+    return 0;
+}
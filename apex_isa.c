@@ -0,0 +1,72 @@
+/*
+ * apex_isa.c
+ * Contains the APEX instruction descriptor table. The parser, the pipeline
+ * stages and the printer all work from this table, so adding an instruction
+ * only needs a new OPCODE_* in apex_macros.h and one entry here
+ */
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Operand formats */
+#define FMT_RRR { FIELD_RD, FIELD_RS1, FIELD_RS2 }
+#define FMT_RRI { FIELD_RD, FIELD_RS1, FIELD_IMM }
+#define FMT_RI { FIELD_RD, FIELD_IMM }
+#define FMT_SSI { FIELD_RS1, FIELD_RS2, FIELD_IMM }
+#define FMT_SSS { FIELD_RS3, FIELD_RS1, FIELD_RS2 }
+#define FMT_SS { FIELD_RS1, FIELD_RS2 }
+#define FMT_I { FIELD_IMM }
+#define FMT_NONE { FIELD_NONE }
+#define FMT_VRI { FIELD_VD, FIELD_RS1, FIELD_IMM }
+#define FMT_VSI { FIELD_VS1, FIELD_RS2, FIELD_IMM }
+#define FMT_VVV { FIELD_VD, FIELD_VS1, FIELD_VS2 }
+
+const APEX_Opcode_Info opcode_info[NUM_OPCODES] = {
+    /* name, fields, alu, src_a, src_b, mem, store, branch, sets zero flag, latency, vector */
+    [OPCODE_ADD]   = { "ADD",   FMT_RRR,  ALU_ADD,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_SUB]   = { "SUB",   FMT_RRR,  ALU_SUB,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_MUL]   = { "MUL",   FMT_RRR,  ALU_MUL,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_DIV]   = { "DIV",   FMT_RRR,  ALU_DIV,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_AND]   = { "AND",   FMT_RRR,  ALU_AND,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_OR]    = { "OR",    FMT_RRR,  ALU_OR,   SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_XOR]   = { "EXOR",  FMT_RRR,  ALU_XOR,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_MOVC]  = { "MOVC",  FMT_RI,   ALU_ADD,  SRC_ZERO, SRC_IMM,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_LOAD]  = { "LOAD",  FMT_RRI,  ALU_ADD,  SRC_RS1,  SRC_IMM,  MEM_READ,  SRC_ZERO, BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_STORE] = { "STORE", FMT_SSI,  ALU_ADD,  SRC_RS2,  SRC_IMM,  MEM_WRITE, SRC_RS1,  BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_BZ]    = { "BZ",    FMT_I,    ALU_NONE, SRC_ZERO, SRC_ZERO, MEM_NONE,  SRC_ZERO, BRANCH_Z,    FALSE, 1, FALSE },
+    [OPCODE_BNZ]   = { "BNZ",   FMT_I,    ALU_NONE, SRC_ZERO, SRC_ZERO, MEM_NONE,  SRC_ZERO, BRANCH_NZ,   FALSE, 1, FALSE },
+    [OPCODE_HALT]  = { "HALT",  FMT_NONE, ALU_NONE, SRC_ZERO, SRC_ZERO, MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_ADDL]  = { "ADDL",  FMT_RRI,  ALU_ADD,  SRC_RS1,  SRC_IMM,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_SUBL]  = { "SUBL",  FMT_RRI,  ALU_SUB,  SRC_RS1,  SRC_IMM,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_LDR]   = { "LDR",   FMT_RRR,  ALU_ADD,  SRC_RS1,  SRC_RS2,  MEM_READ,  SRC_ZERO, BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_STR]   = { "STR",   FMT_SSS,  ALU_ADD,  SRC_RS1,  SRC_RS2,  MEM_WRITE, SRC_RS3,  BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_CMP]   = { "CMP",   FMT_SS,   ALU_SUB,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, TRUE,  1, FALSE },
+    [OPCODE_NOP]   = { "NOP",   FMT_NONE, ALU_NONE, SRC_ZERO, SRC_ZERO, MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_VLOAD] = { "VLOAD", FMT_VRI,  ALU_ADD,  SRC_RS1,  SRC_IMM,  MEM_READ,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VSTORE] = { "VSTORE", FMT_VSI,  ALU_ADD,  SRC_RS2,  SRC_IMM,  MEM_WRITE, SRC_RS1,  BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VADD]  = { "VADD",  FMT_VVV,  ALU_ADD,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VSUB]  = { "VSUB",  FMT_VVV,  ALU_SUB,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VMUL]  = { "VMUL",  FMT_VVV,  ALU_MUL,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VAND]  = { "VAND",  FMT_VVV,  ALU_AND,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VOR]   = { "VOR",   FMT_VVV,  ALU_OR,   SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_VXOR]  = { "VXOR",  FMT_VVV,  ALU_XOR,  SRC_RS1,  SRC_RS2,  MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, TRUE  },
+    [OPCODE_LOOP]  = { "LOOP",  FMT_I,    ALU_NONE, SRC_ZERO, SRC_ZERO, MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, FALSE },
+    [OPCODE_ENDLOOP] = { "ENDLOOP", FMT_NONE, ALU_NONE, SRC_ZERO, SRC_ZERO, MEM_NONE,  SRC_ZERO, BRANCH_NONE, FALSE, 1, FALSE },
+};
+
+/*
+Returns the character an operand of a FIELD_* is written with in assembly
+*/
+char
+APEX_field_prefix(int field)
+{
+    switch (field)
+    {
+        case FIELD_IMM:
+            return '#';
+        case FIELD_VD:
+        case FIELD_VS1:
+        case FIELD_VS2:
+            return 'V';
+    }
+    return 'R';
+}
@@ -0,0 +1,362 @@
+/*
+ * apex_konata.c
+ * Contains the pipeline trace exporter. Every dynamic instruction is written
+ * in the Kanata log format read by the Konata pipeline viewer: the cycles it
+ * spent in each stage, stalled fetch/decode cycles as separate stages, and
+ * whether it retired or was flushed by a taken BZ/BNZ. Events are formatted
+ * by hand into a 1 MB buffer and cycles are written as deltas only when something
+ * happens, so long runs stay fast.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+#define KONATA_BUFFER_BYTES (1 << 20)
+
+/* Upper bound of one event line, labels and notes are checked separately */
+#define KONATA_EVENT_BYTES 128
+
+/* Instructions in flight are looked up by uid modulo this */
+#define KONATA_SLOTS 64
+
+/* Lane and stage name that follow the id of S and E lines */
+static const char *stage_tails[KONATA_STAGES] = {
+    "\t0\tF", "\t0\tFs", "\t0\tD", "\t0\tDs", "\t0\tX", "\t0\tM", "\t0\tW"
+};
+
+typedef struct Konata_Slot
+{
+    long uid;                   /* -1 if free */
+    int stage;                  /* KONATA_STAGE_* currently open */
+    char id[24];                /* uid in decimal, written on every event */
+    int id_len;
+} Konata_Slot;
+
+struct APEX_Konata
+{
+    FILE *fp;
+    char *buf;                  /* Output not yet written to fp */
+    size_t used;
+    char **labels;              /* Disassembly per code memory entry */
+    int cycle;                  /* Cycle of the last event written */
+    long retired;               /* Retire ids are sequential */
+    long pending[KONATA_SLOTS]; /* Retired this cycle, ended on the next */
+    int pending_count;
+    Konata_Slot slots[KONATA_SLOTS];
+};
+
+/*
+Writes out the buffer once it may not hold another event
+*/
+static void
+flush_buffer(APEX_Konata *k, size_t room)
+{
+    if (k->used + room > KONATA_BUFFER_BYTES)
+    {
+        fwrite(k->buf, 1, k->used, k->fp);
+        k->used = 0;
+    }
+}
+
+static void
+put_str(APEX_Konata *k, const char *str, size_t len)
+{
+    memcpy(k->buf + k->used, str, len);
+    k->used += len;
+}
+
+/*
+Appends a decimal number, the log is mostly numbers so this avoids printf
+*/
+static int
+format_num(char *buf, long n)
+{
+    char digits[24];
+    int i = sizeof(digits), len = 0;
+
+    if (n < 0)
+    {
+        buf[len++] = '-';
+        n = -n;
+    }
+    do
+    {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    memcpy(buf + len, digits + i, sizeof(digits) - i);
+    return len + sizeof(digits) - i;
+}
+
+static void
+put_num(APEX_Konata *k, long n)
+{
+    k->used += format_num(k->buf + k->used, n);
+}
+
+/*
+Appends "<cmd>\t<id><tail>\n" for an instruction in flight
+*/
+static void
+put_event(APEX_Konata *k, char cmd, const Konata_Slot *slot, const char *tail)
+{
+    flush_buffer(k, KONATA_EVENT_BYTES);
+    k->buf[k->used++] = cmd;
+    k->buf[k->used++] = '\t';
+    put_str(k, slot->id, slot->id_len);
+    put_str(k, tail, strlen(tail));
+    k->buf[k->used++] = '\n';
+}
+
+/*
+Returns the disassembly of a code memory entry, made on first use
+*/
+static const char *
+get_label(APEX_CPU *cpu, const CPU_Stage *latch)
+{
+    APEX_Konata *k = cpu->konata;
+    int index = get_code_memory_index_from_pc(latch->pc);
+    char *text = NULL;
+    size_t len = 0;
+    FILE *fp;
+
+    if (latch->pc < 4000 || index >= cpu->code_memory_size)
+    {
+        return "?";
+    }
+
+    if (!k->labels[index])
+    {
+        fp = open_memstream(&text, &len);
+        if (!fp)
+        {
+            return "?";
+        }
+        fprintf(fp, "%d: ", latch->pc);
+        APEX_fprint_instruction(fp, latch);
+        fclose(fp);
+        k->labels[index] = text;
+    }
+    return k->labels[index];
+}
+
+/*
+Ends the writeback stage of instructions that retired in an earlier cycle
+*/
+static void
+end_retired(APEX_Konata *k)
+{
+    Konata_Slot *slot;
+    int i;
+
+    for (i = 0; i < k->pending_count; ++i)
+    {
+        slot = &k->slots[k->pending[i] % KONATA_SLOTS];
+        put_event(k, 'E', slot, stage_tails[slot->stage]);
+        put_str(k, "R\t", 2);
+        put_str(k, slot->id, slot->id_len);
+        put_str(k, "\t", 1);
+        put_num(k, k->retired++);
+        put_str(k, "\t0\n", 3);
+        slot->uid = -1;
+    }
+    k->pending_count = 0;
+}
+
+/*
+Moves the log to the current cycle
+*/
+static void
+sync_cycle(APEX_CPU *cpu)
+{
+    APEX_Konata *k = cpu->konata;
+
+    if (cpu->clock != k->cycle)
+    {
+        flush_buffer(k, KONATA_EVENT_BYTES);
+        put_str(k, "C\t", 2);
+        put_num(k, cpu->clock - k->cycle);
+        put_str(k, "\n", 1);
+        k->cycle = cpu->clock;
+        end_retired(k);
+    }
+}
+
+/*
+Starts writing the trace to filename, returns 0 or -1
+*/
+int
+APEX_konata_open(APEX_CPU *cpu, const char *filename)
+{
+    APEX_Konata *k;
+    int i;
+
+    if (cpu->konata)
+    {
+        return 0;
+    }
+
+    k = calloc(1, sizeof(APEX_Konata));
+    if (!k)
+    {
+        return -1;
+    }
+
+    k->fp = fopen(filename, "w");
+    if (!k->fp)
+    {
+        fprintf(stderr, "APEX_Error: Unable to create pipeline trace %s\n", filename);
+        free(k);
+        return -1;
+    }
+
+    k->buf = malloc(KONATA_BUFFER_BYTES);
+    k->labels = calloc(cpu->code_memory_size, sizeof(char *));
+    if (!k->buf || !k->labels)
+    {
+        fclose(k->fp);
+        free(k->buf);
+        free(k->labels);
+        free(k);
+        return -1;
+    }
+
+    for (i = 0; i < KONATA_SLOTS; ++i)
+    {
+        k->slots[i].uid = -1;
+    }
+
+    k->cycle = cpu->clock;
+    k->used = snprintf(k->buf, KONATA_BUFFER_BYTES, "Kanata\t0004\nC=\t%d\n", k->cycle);
+    cpu->konata = k;
+    return 0;
+}
+
+/*
+Records that the instruction in a latch occupies a stage this cycle
+*/
+void
+APEX_konata_stage(APEX_CPU *cpu, int stage, const CPU_Stage *latch)
+{
+    APEX_Konata *k = cpu->konata;
+    Konata_Slot *slot = &k->slots[latch->uid % KONATA_SLOTS];
+    const char *label;
+    size_t len;
+
+    sync_cycle(cpu);
+
+    if (slot->uid != latch->uid)
+    {
+        /* First cycle of a new dynamic instruction */
+        slot->uid = latch->uid;
+        slot->id_len = format_num(slot->id, latch->uid);
+        label = get_label(cpu, latch);
+        len = strlen(label);
+        flush_buffer(k, KONATA_EVENT_BYTES + len);
+        put_str(k, "I\t", 2);
+        put_str(k, slot->id, slot->id_len);
+        put_str(k, "\t", 1);
+        put_str(k, slot->id, slot->id_len);
+        put_str(k, "\t0\nL\t", 5);
+        put_str(k, slot->id, slot->id_len);
+        put_str(k, "\t0\t", 3);
+        put_str(k, label, len);
+        put_str(k, "\n", 1);
+    }
+    else if (slot->stage == stage)
+    {
+        return;
+    }
+    else
+    {
+        put_event(k, 'E', slot, stage_tails[slot->stage]);
+    }
+
+    slot->stage = stage;
+    put_event(k, 'S', slot, stage_tails[stage]);
+}
+
+/*
+Adds a hover note to an instruction, e.g. why it stalled
+*/
+void
+APEX_konata_note(APEX_CPU *cpu, const CPU_Stage *latch, const char *note, int pc)
+{
+    APEX_Konata *k = cpu->konata;
+
+    sync_cycle(cpu);
+    flush_buffer(k, KONATA_EVENT_BYTES);
+    k->used += snprintf(k->buf + k->used, KONATA_EVENT_BYTES, "L\t%ld\t1\tcycle %d: %.48s pc(%d)\n",
+                        latch->uid, cpu->clock, note, pc);
+}
+
+/*
+Records that the instruction in writeback retires, its stage ends next cycle
+*/
+void
+APEX_konata_retire(APEX_CPU *cpu, const CPU_Stage *latch)
+{
+    APEX_Konata *k = cpu->konata;
+
+    APEX_konata_stage(cpu, KONATA_STAGE_W, latch);
+    if (k->pending_count < KONATA_SLOTS)
+    {
+        k->pending[k->pending_count++] = latch->uid;
+    }
+}
+
+/*
+Records that the instruction in a latch was squashed by a taken branch
+*/
+void
+APEX_konata_flush(APEX_CPU *cpu, const CPU_Stage *latch)
+{
+    APEX_Konata *k = cpu->konata;
+    Konata_Slot *slot = &k->slots[latch->uid % KONATA_SLOTS];
+
+    if (slot->uid != latch->uid)
+    {
+        return;
+    }
+
+    sync_cycle(cpu);
+    put_event(k, 'E', slot, stage_tails[slot->stage]);
+    put_event(k, 'R', slot, "\t0\t1");
+    slot->uid = -1;
+}
+
+/*
+Ends the last retired instructions and closes the trace
+*/
+void
+APEX_konata_close(APEX_CPU *cpu)
+{
+    APEX_Konata *k = cpu->konata;
+    int i;
+
+    if (!k)
+    {
+        return;
+    }
+
+    if (k->pending_count)
+    {
+        flush_buffer(k, KONATA_EVENT_BYTES);
+        put_str(k, "C\t1\n", 4);
+        end_retired(k);
+    }
+
+    fwrite(k->buf, 1, k->used, k->fp);
+    fclose(k->fp);
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        free(k->labels[i]);
+    }
+    free(k->labels);
+    free(k->buf);
+    free(k);
+    cpu->konata = NULL;
+}
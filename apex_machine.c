@@ -0,0 +1,853 @@
+/*
+ * apex_machine.c
+ * Contains machine descriptions and the design-space sweep. A description is
+ * a text file of "key = value" lines ('#' starts a comment):
+ *   registers = 16          registers a program may use
+ *   memory = 4096           data memory words
+ *   latency.MUL = 3         execute cycles of an opcode
+ *   forwarding = on|off     decode reads results from the MEM and WB latches
+ *   branch = execute|decode stage that resolves BZ/BNZ
+ *   fusion = off|on         decode fuses CMP/ADDL/SUBL with a next BZ/BNZ
+ *   queue = 0               instruction queue entries between fetch and decode
+ *   loop_buffer = 0         loop buffer entries, small loops are replayed
+ *   memory_latency = 1      cycles of a data memory access
+ *   store_buffer = 0        store buffer entries, loads forward from it
+ *   load_queue = 0          load queue entries, loads waiting on memory
+ *   prefetch = none         data prefetcher, none, next_line or stride
+ *   prefetch_buffer = 8     lines the prefetcher fetches into
+ *   prefetch_degree = 1     lines or strides it runs ahead
+ *   banks = 0               interleaved data memory banks, 0 for one port
+ *   bank_latency.<k> = 0    cycles of an access to bank k, 0 for memory_latency
+ *   bank_ports.<k> = 1      ports of bank k
+ *   vector_length = 4       elements of a vector register
+ *   loop_depth = 4          LOOP/ENDLOOP hardware loops that may be nested
+ * --config applies one to the stages at startup. The sweep command reads a
+ * file where every key may list comma separated values, runs each
+ * combination in its own process, as many at once as there are host cores,
+ * and prints cycles against a relative hardware cost.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Cycles a sweep runs each configuration for before giving up on it */
+#define SWEEP_MAX_CYCLES 100000000
+
+typedef struct Machine_Param
+{
+    char key[MACHINE_MAX_KEY];
+    char values[SWEEP_MAX_VALUES][MACHINE_MAX_KEY];
+    int count;
+} Machine_Param;
+
+/* What a sweep process reports back through its pipe */
+typedef struct Sweep_Result
+{
+    int status;                 /* 0, or -1 if the configuration did not run */
+    int cycles;
+    int insns;
+    double cost;
+} Sweep_Result;
+
+typedef struct Sweep_Job
+{
+    pid_t pid;
+    int fd;
+    int index;
+} Sweep_Job;
+
+/* Values of the prefetch key, indexed by PREFETCH_* */
+static const char *const prefetch_names[] = {"none", "next_line", "stride"};
+
+void
+APEX_machine_default(APEX_Machine *machine)
+{
+    int i;
+
+    machine->registers = REG_FILE_SIZE;
+    machine->mem_size = DATA_MEMORY_SIZE;
+    machine->forwarding = FALSE;
+    machine->fusion = FALSE;
+    machine->queue = 0;
+    machine->loop_buffer = 0;
+    machine->mem_latency = 1;
+    machine->store_buffer = 0;
+    machine->load_queue = 0;
+    machine->prefetch = PREFETCH_NONE;
+    machine->prefetch_lines = 8;
+    machine->prefetch_degree = 1;
+    machine->banks = 0;
+    machine->vector_length = 4;
+    machine->loop_depth = 4;
+    for (i = 0; i < NUM_OPCODES; ++i)
+    {
+        machine->latency[i] = opcode_info[i].latency;
+    }
+    for (i = 0; i < MEMORY_MAX_BANKS; ++i)
+    {
+        machine->bank_latency[i] = 0;
+        machine->bank_ports[i] = 1;
+    }
+}
+
+/*
+Returns the cycles after an instruction issues until decode can read its
+result: writeback runs before decode, and with forwarding an ALU result is
+read from the MEM latch right after execute, a load's from the WB latch once
+memory answered. Vector results are never forwarded
+*/
+int
+APEX_result_delay(const APEX_CPU *cpu, int opcode)
+{
+    int latency = cpu->machine.latency[opcode];
+
+    if (opcode_info[opcode].mem_access == MEM_READ)
+    {
+        latency += cpu->machine.mem_latency - 1;
+    }
+
+    if (!cpu->machine.forwarding || opcode_info[opcode].vector)
+    {
+        return latency + 2;
+    }
+    return opcode_info[opcode].mem_access == MEM_READ ? latency + 1 : latency;
+}
+
+/*
+Returns the bank a per-bank key names after its prefix, -1 if it names an
+invalid one, or MEMORY_MAX_BANKS for the key without a suffix, setting
+every bank
+*/
+static int
+parse_bank(const char *key, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    char *end;
+    long bank;
+
+    if (strncmp(key, prefix, len) != 0)
+    {
+        return -1;
+    }
+    if (!key[len])
+    {
+        return MEMORY_MAX_BANKS;
+    }
+    if (key[len] != '.' || !isdigit((unsigned char)key[len + 1]))
+    {
+        return -1;
+    }
+    bank = strtol(key + len + 1, &end, 10);
+    return *end || bank >= MEMORY_MAX_BANKS ? -1 : bank;
+}
+
+static int
+parse_flag(const char *value, const char *on, const char *off, int *flag)
+{
+    if (strcmp(value, on) == 0)
+    {
+        *flag = TRUE;
+        return 0;
+    }
+    if (strcmp(value, off) == 0)
+    {
+        *flag = FALSE;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+Sets one parameter of cpu, returns 0 or -1 with a message in error
+*/
+static int
+set_param(APEX_CPU *cpu, const char *key, const char *value, char *error)
+{
+    APEX_Machine *m = &cpu->machine;
+    char *end;
+    long n = strtol(value, &end, 10);
+    int i, bank, numeric = *value && !*end;
+
+    if (strcmp(key, "registers") == 0)
+    {
+        if (!numeric || n < 1 || n > REG_FILE_SIZE)
+        {
+            snprintf(error, 128, "registers must be 1 to %d", REG_FILE_SIZE);
+            return -1;
+        }
+        m->registers = n;
+        return 0;
+    }
+
+    if (strcmp(key, "memory") == 0)
+    {
+        if (!numeric || n < 1 || n > DATA_MEMORY_SIZE)
+        {
+            snprintf(error, 128, "memory must be 1 to %d words", DATA_MEMORY_SIZE);
+            return -1;
+        }
+        m->mem_size = n;
+        return 0;
+    }
+
+    if (strncmp(key, "latency.", 8) == 0)
+    {
+        for (i = 0; i < NUM_OPCODES && strcmp(key + 8, opcode_info[i].name) != 0; ++i)
+            ;
+        if (i == NUM_OPCODES)
+        {
+            snprintf(error, 128, "unknown opcode '%.32s'", key + 8);
+            return -1;
+        }
+        if (!numeric || n < 1 || n > 1000)
+        {
+            snprintf(error, 128, "latency must be 1 to 1000 cycles");
+            return -1;
+        }
+        m->latency[i] = n;
+        return 0;
+    }
+
+    if (strcmp(key, "forwarding") == 0)
+    {
+        if (parse_flag(value, "on", "off", &m->forwarding) < 0)
+        {
+            snprintf(error, 128, "forwarding must be on or off");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(key, "branch") == 0)
+    {
+        if (parse_flag(value, "decode", "execute", &cpu->early_branch) < 0)
+        {
+            snprintf(error, 128, "branch must be execute or decode");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(key, "fusion") == 0)
+    {
+        if (parse_flag(value, "on", "off", &m->fusion) < 0)
+        {
+            snprintf(error, 128, "fusion must be on or off");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (strcmp(key, "queue") == 0)
+    {
+        if (!numeric || n < 0 || n > FRONTEND_MAX_QUEUE)
+        {
+            snprintf(error, 128, "queue must be 0 to %d entries", FRONTEND_MAX_QUEUE);
+            return -1;
+        }
+        m->queue = n;
+        return 0;
+    }
+
+    if (strcmp(key, "loop_buffer") == 0)
+    {
+        if (!numeric || n < 0 || n > LOOP_BUFFER_MAX)
+        {
+            snprintf(error, 128, "loop_buffer must be 0 to %d entries", LOOP_BUFFER_MAX);
+            return -1;
+        }
+        m->loop_buffer = n;
+        return 0;
+    }
+
+    if (strcmp(key, "memory_latency") == 0)
+    {
+        if (!numeric || n < 1 || n > 1000)
+        {
+            snprintf(error, 128, "memory_latency must be 1 to 1000 cycles");
+            return -1;
+        }
+        m->mem_latency = n;
+        return 0;
+    }
+
+    if (strcmp(key, "store_buffer") == 0)
+    {
+        if (!numeric || n < 0 || n > STORE_BUFFER_MAX)
+        {
+            snprintf(error, 128, "store_buffer must be 0 to %d entries", STORE_BUFFER_MAX);
+            return -1;
+        }
+        m->store_buffer = n;
+        return 0;
+    }
+
+    if (strcmp(key, "load_queue") == 0)
+    {
+        if (!numeric || n < 0 || n > LOAD_QUEUE_MAX)
+        {
+            snprintf(error, 128, "load_queue must be 0 to %d entries", LOAD_QUEUE_MAX);
+            return -1;
+        }
+        m->load_queue = n;
+        return 0;
+    }
+
+    if (strcmp(key, "prefetch") == 0)
+    {
+        for (i = 0; i < 3 && strcmp(value, prefetch_names[i]) != 0; ++i)
+            ;
+        if (i == 3)
+        {
+            snprintf(error, 128, "prefetch must be none, next_line or stride");
+            return -1;
+        }
+        m->prefetch = i;
+        return 0;
+    }
+
+    if (strcmp(key, "prefetch_buffer") == 0)
+    {
+        if (!numeric || n < 1 || n > PREFETCH_MAX_LINES)
+        {
+            snprintf(error, 128, "prefetch_buffer must be 1 to %d lines", PREFETCH_MAX_LINES);
+            return -1;
+        }
+        m->prefetch_lines = n;
+        return 0;
+    }
+
+    if (strcmp(key, "prefetch_degree") == 0)
+    {
+        if (!numeric || n < 1 || n > PREFETCH_MAX_DEGREE)
+        {
+            snprintf(error, 128, "prefetch_degree must be 1 to %d", PREFETCH_MAX_DEGREE);
+            return -1;
+        }
+        m->prefetch_degree = n;
+        return 0;
+    }
+
+    if (strcmp(key, "banks") == 0)
+    {
+        if (!numeric || n < 0 || n > MEMORY_MAX_BANKS)
+        {
+            snprintf(error, 128, "banks must be 0 to %d", MEMORY_MAX_BANKS);
+            return -1;
+        }
+        m->banks = n;
+        return 0;
+    }
+
+    if (strcmp(key, "vector_length") == 0)
+    {
+        if (!numeric || n < 1 || n > VECTOR_MAX_LENGTH)
+        {
+            snprintf(error, 128, "vector_length must be 1 to %d elements", VECTOR_MAX_LENGTH);
+            return -1;
+        }
+        m->vector_length = n;
+        return 0;
+    }
+
+    if (strcmp(key, "loop_depth") == 0)
+    {
+        if (!numeric || n < 1 || n > HW_LOOP_MAX_DEPTH)
+        {
+            snprintf(error, 128, "loop_depth must be 1 to %d levels", HW_LOOP_MAX_DEPTH);
+            return -1;
+        }
+        m->loop_depth = n;
+        return 0;
+    }
+
+    if (strncmp(key, "bank_latency", 12) == 0)
+    {
+        if ((bank = parse_bank(key, "bank_latency")) < 0)
+        {
+            snprintf(error, 128, "bank must be 0 to %d in '%.32s'", MEMORY_MAX_BANKS - 1, key);
+            return -1;
+        }
+        if (!numeric || n < 0 || n > 1000)
+        {
+            snprintf(error, 128, "bank_latency must be 0 to 1000 cycles");
+            return -1;
+        }
+        for (i = 0; i < MEMORY_MAX_BANKS; ++i)
+        {
+            if (bank == MEMORY_MAX_BANKS || bank == i)
+            {
+                m->bank_latency[i] = n;
+            }
+        }
+        return 0;
+    }
+
+    if (strncmp(key, "bank_ports", 10) == 0)
+    {
+        if ((bank = parse_bank(key, "bank_ports")) < 0)
+        {
+            snprintf(error, 128, "bank must be 0 to %d in '%.32s'", MEMORY_MAX_BANKS - 1, key);
+            return -1;
+        }
+        if (!numeric || n < 1 || n > BANK_MAX_PORTS)
+        {
+            snprintf(error, 128, "bank_ports must be 1 to %d", BANK_MAX_PORTS);
+            return -1;
+        }
+        for (i = 0; i < MEMORY_MAX_BANKS; ++i)
+        {
+            if (bank == MEMORY_MAX_BANKS || bank == i)
+            {
+                m->bank_ports[i] = n;
+            }
+        }
+        return 0;
+    }
+
+    snprintf(error, 128, "unknown key '%.32s'", key);
+    return -1;
+}
+
+static char *
+trim(char *str)
+{
+    char *end;
+
+    while (isspace((unsigned char)*str))
+    {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+    return str;
+}
+
+/*
+Reads the parameters of a description into params, returns their number or
+-1 after printing an error
+*/
+static int
+read_params(const char *filename, Machine_Param *params, int max)
+{
+    char line[MACHINE_MAX_LINE], *p, *eq, *key, *value;
+    Machine_Param *param;
+    int count = 0, lineno = 0;
+    FILE *fp = fopen(filename, "r");
+
+    if (!fp)
+    {
+        fprintf(stderr, "APEX_Error: Unable to open machine description %s\n", filename);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if (!*trim(line))
+        {
+            continue;
+        }
+
+        eq = strchr(line, '=');
+        if (!eq || count == max)
+        {
+            fprintf(stderr, "APEX_Error: %s:%d: %s\n", filename, lineno,
+                    eq ? "too many keys" : "expected key = value");
+            fclose(fp);
+            return -1;
+        }
+        *eq = '\0';
+        key = trim(line);
+
+        param = &params[count++];
+        snprintf(param->key, sizeof(param->key), "%s", key);
+        param->count = 0;
+        for (value = strtok(eq + 1, ","); value; value = strtok(NULL, ","))
+        {
+            if (param->count == SWEEP_MAX_VALUES)
+            {
+                fprintf(stderr, "APEX_Error: %s:%d: more than %d values\n", filename,
+                        lineno, SWEEP_MAX_VALUES);
+                fclose(fp);
+                return -1;
+            }
+            snprintf(param->values[param->count++], MACHINE_MAX_KEY, "%s", trim(value));
+        }
+        if (!param->count || !*param->values[0])
+        {
+            fprintf(stderr, "APEX_Error: %s:%d: missing value\n", filename, lineno);
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return count;
+}
+
+/*
+Checks the loaded program fits the machine, returns 0 or -1 with a message
+*/
+static int
+check_program(const APEX_CPU *cpu, char *error)
+{
+    const APEX_Instruction *ins;
+    int i;
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        ins = &cpu->code_memory[i];
+        if (((ins->src_mask | ins->dest_mask) & SCALAR_REG_MASK) >> cpu->machine.registers)
+        {
+            snprintf(error, 128, "line %d uses a register above R%d", ins->line,
+                     cpu->machine.registers - 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+Applies the machine description in filename to cpu, returns 0 or -1
+*/
+int
+APEX_machine_load(APEX_CPU *cpu, const char *filename)
+{
+    Machine_Param params[MACHINE_MAX_PARAMS];
+    char error[128];
+    int i, count = read_params(filename, params, MACHINE_MAX_PARAMS);
+
+    if (count < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < count; ++i)
+    {
+        if (params[i].count > 1)
+        {
+            fprintf(stderr, "APEX_Error: %s: %s lists values, that is for sweep\n",
+                    filename, params[i].key);
+            return -1;
+        }
+        if (set_param(cpu, params[i].key, params[i].values[0], error) < 0)
+        {
+            fprintf(stderr, "APEX_Error: %s: %s\n", filename, error);
+            return -1;
+        }
+    }
+    if (check_program(cpu, error) < 0)
+    {
+        fprintf(stderr, "APEX_Error: %s: %s\n", filename, error);
+        return -1;
+    }
+    return 0;
+}
+
+static double
+machine_cost(const APEX_CPU *cpu)
+{
+    const APEX_Machine *m = &cpu->machine;
+    double cost = m->registers * COST_REGISTER + m->mem_size / 1024.0 * COST_MEMORY_KWORD;
+    int i, vector = APEX_vector_used(cpu), loops = APEX_hw_loop_used(cpu);
+
+    cost += m->forwarding ? COST_FORWARDING : 0.0;
+    cost += cpu->early_branch ? COST_EARLY_BRANCH : 0.0;
+    cost += m->fusion ? COST_FUSION : 0.0;
+    cost += m->queue * COST_QUEUE_ENTRY + m->loop_buffer * COST_LOOP_ENTRY;
+    cost += m->store_buffer * COST_STORE_ENTRY + m->load_queue * COST_LOAD_ENTRY;
+    if (m->prefetch != PREFETCH_NONE)
+    {
+        cost += m->prefetch == PREFETCH_STRIDE ? COST_STRIDE : COST_NEXT_LINE;
+        cost += m->prefetch_lines * COST_PREFETCH_LINE;
+    }
+    for (i = 0; i < m->banks; ++i)
+    {
+        cost += COST_BANK + m->bank_ports[i] * COST_BANK_PORT;
+    }
+    if (vector)
+    {
+        cost += m->vector_length * COST_VECTOR_LANE;
+    }
+    if (loops)
+    {
+        cost += m->loop_depth * COST_LOOP_LEVEL;
+    }
+    for (i = 0; i < NUM_OPCODES; ++i)
+    {
+        if ((vector || !opcode_info[i].vector)
+            && (loops || (i != OPCODE_LOOP && i != OPCODE_ENDLOOP)))
+        {
+            cost += COST_UNIT / m->latency[i];
+        }
+    }
+    return cost;
+}
+
+/*
+Returns the value index of param p in configuration index
+*/
+static int
+value_index(const Machine_Param *params, int p, int index)
+{
+    int i;
+
+    for (i = p + 1; params[i].count; ++i)
+    {
+        index /= params[i].count;
+    }
+    return index % params[p].count;
+}
+
+/*
+Runs configuration index of the sweep in this process to HALT
+*/
+static void
+run_config(APEX_CPU *cpu, const Machine_Param *params, int count, int index,
+           Sweep_Result *result)
+{
+    char error[128];
+    int p;
+
+    result->status = -1;
+    for (p = 0; p < count; ++p)
+    {
+        if (set_param(cpu, params[p].key, params[p].values[value_index(params, p, index)],
+                      error) < 0)
+        {
+            fprintf(stderr, "APEX_Error: sweep configuration %d: %s\n", index + 1, error);
+            return;
+        }
+    }
+    if (check_program(cpu, error) < 0)
+    {
+        fprintf(stderr, "APEX_Error: sweep configuration %d: %s\n", index + 1, error);
+        return;
+    }
+
+    /* Nothing but the result leaves the process */
+    cpu->profile = NULL;
+    cpu->konata = NULL;
+    cpu->shm = NULL;
+    cpu->history = NULL;
+    cpu->reg_watch = cpu->reg_watch_halt = 0;
+    memset(cpu->mem_watch, 0, sizeof(cpu->mem_watch));
+    memset(cpu->mem_watch_halt, 0, sizeof(cpu->mem_watch_halt));
+    command_simulate = 1;
+
+    while (cpu->clock < SWEEP_MAX_CYCLES)
+    {
+        if (APEX_cpu_step(cpu))
+        {
+            result->status = 0;
+            result->cycles = cpu->clock;
+            result->insns = cpu->insn_completed;
+            result->cost = machine_cost(cpu);
+            return;
+        }
+    }
+    fprintf(stderr, "APEX_Error: sweep configuration %d did not halt within %d cycles\n",
+            index + 1, SWEEP_MAX_CYCLES);
+}
+
+/*
+Returns TRUE if result a is listed after b: failed runs last, otherwise
+cheapest first and then fastest
+*/
+static int
+later(const Sweep_Result *a, const Sweep_Result *b)
+{
+    if (a->status != b->status)
+    {
+        return a->status < b->status;
+    }
+    if (a->cost != b->cost)
+    {
+        return a->cost > b->cost;
+    }
+    return a->cycles > b->cycles;
+}
+
+static int
+start_job(APEX_CPU *cpu, const Machine_Param *params, int count, int index, Sweep_Job *job)
+{
+    Sweep_Result result;
+    int fds[2];
+
+    if (pipe(fds) < 0)
+    {
+        return -1;
+    }
+
+    job->pid = fork();
+    if (job->pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (job->pid == 0)
+    {
+        close(fds[0]);
+        memset(&result, 0, sizeof(result));
+        run_config(cpu, params, count, index, &result);
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    job->fd = fds[0];
+    job->index = index;
+    return 0;
+}
+
+/*
+Runs every combination of the values listed in filename and prints their
+cycles and cost, cheapest first, returns 0 or -1
+*/
+int
+APEX_sweep(APEX_CPU *cpu, const char *filename)
+{
+    Machine_Param params[MACHINE_MAX_PARAMS + 1];
+    Sweep_Result *results = NULL;
+    Sweep_Job *jobs = NULL;
+    int *order = NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count, total = 1, next = 0, running = 0, i, j, p, status, best, tmp;
+    pid_t pid;
+    char line[MACHINE_MAX_LINE];
+    int ret = -1;
+
+    memset(params, 0, sizeof(params));
+    count = read_params(filename, params, MACHINE_MAX_PARAMS);
+    if (count < 0)
+    {
+        return -1;
+    }
+    for (p = 0; p < count; ++p)
+    {
+        total *= params[p].count;
+        if (total > SWEEP_MAX_CONFIGS)
+        {
+            fprintf(stderr, "APEX_Error: %s expands to more than %d configurations\n",
+                    filename, SWEEP_MAX_CONFIGS);
+            return -1;
+        }
+    }
+
+    cores = cores < 1 ? 1 : cores;
+    results = calloc(total, sizeof(Sweep_Result));
+    jobs = calloc(cores, sizeof(Sweep_Job));
+    order = malloc(total * sizeof(int));
+    if (!results || !jobs || !order)
+    {
+        fprintf(stderr, "APEX_Error: Unable to allocate sweep\n");
+        goto out;
+    }
+
+    /* Children inherit unwritten output */
+    fflush(stdout);
+    fflush(stderr);
+
+    while (next < total || running)
+    {
+        if (next < total && running < cores)
+        {
+            if (start_job(cpu, params, count, next, &jobs[running]) < 0)
+            {
+                fprintf(stderr, "APEX_Error: Unable to start sweep process\n");
+                break;
+            }
+            results[next++].status = -1;
+            running++;
+            continue;
+        }
+
+        pid = wait(&status);
+        for (i = 0; i < running && jobs[i].pid != pid; ++i)
+            ;
+        if (i == running)
+        {
+            break;
+        }
+        if (read(jobs[i].fd, &results[jobs[i].index], sizeof(Sweep_Result))
+            != sizeof(Sweep_Result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            results[jobs[i].index].status = -1;
+        }
+        close(jobs[i].fd);
+        jobs[i] = jobs[--running];
+    }
+
+    for (i = 0; i < total; ++i)
+    {
+        order[i] = i;
+    }
+    for (i = 1; i < total; ++i)
+    {
+        tmp = order[i];
+        for (j = i; j > 0 && later(&results[order[j - 1]], &results[tmp]); --j)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = tmp;
+    }
+
+    printf("APEX_SWEEP: %d configurations of %s, %ld at a time\n", total, filename, cores);
+    printf("%6s %10s %10s %7s %8s %6s  %s\n", "config", "cycles", "insns", "CPI", "cost",
+           "pareto", "settings");
+    best = -1;
+    for (i = 0; i < total; ++i)
+    {
+        const Sweep_Result *r = &results[order[i]];
+        size_t len = 0;
+
+        line[0] = '\0';
+        for (p = 0; p < count && len < sizeof(line); ++p)
+        {
+            len += snprintf(line + len, sizeof(line) - len, "%s%s=%s", p ? " " : "",
+                            params[p].key,
+                            params[p].values[value_index(params, p, order[i])]);
+        }
+
+        if (r->status < 0)
+        {
+            printf("%6d %10s %10s %7s %8s %6s  %s\n", order[i] + 1, "failed", "-", "-", "-",
+                   "", line);
+            continue;
+        }
+
+        /* Faster than every cheaper configuration */
+        printf("%6d %10d %10d %7.3f %8.2f %6s  %s\n", order[i] + 1, r->cycles, r->insns,
+               r->insns ? (double)r->cycles / r->insns : 0.0, r->cost,
+               best < 0 || r->cycles < best ? "*" : "", line);
+        if (best < 0 || r->cycles < best)
+        {
+            best = r->cycles;
+        }
+    }
+    ret = 0;
+
+out:
+    free(results);
+    free(jobs);
+    free(order);
+    return ret;
+}
@@ -14,6 +14,26 @@
 /* Size of integer register file */
 #define REG_FILE_SIZE 16
 
+/* Vector register file: registers, and most elements a register may hold
+ * (see the vector_length machine key). Vector register n is numbered
+ * REG_FILE_SIZE + n in the rd/rs fields, so the scoreboard covers both files */
+#define VREG_FILE_SIZE 8
+#define VECTOR_MAX_LENGTH 16
+#define SCOREBOARD_SIZE (REG_FILE_SIZE + VREG_FILE_SIZE)
+#define SCALAR_REG_MASK ((1u << REG_FILE_SIZE) - 1)
+
+/* Data memory is tracked in pages of this many words for dirty dumps */
+#define DATA_MEMORY_PAGE_WORDS 64
+#define DATA_MEMORY_PAGES (DATA_MEMORY_SIZE / DATA_MEMORY_PAGE_WORDS)
+
+/* Number of 32-bit words needed for a bitmap of n bits */
+#define BITMAP_WORDS(n) (((n) + 31) / 32)
+
+/* Data memory dump modes used after simulation */
+#define DUMP_DEFAULT 0x0
+#define DUMP_DIFF 0x1
+#define DUMP_RANGE 0x2
+
 /* Numeric OPCODE identifiers for instructions */
 #define OPCODE_ADD 0x0
 #define OPCODE_SUB 0x1
@@ -34,6 +54,205 @@
 #define OPCODE_STR 0x10
 #define OPCODE_CMP 0x11
 #define OPCODE_NOP 0x12
+#define OPCODE_VLOAD 0x13
+#define OPCODE_VSTORE 0x14
+#define OPCODE_VADD 0x15
+#define OPCODE_VSUB 0x16
+#define OPCODE_VMUL 0x17
+#define OPCODE_VAND 0x18
+#define OPCODE_VOR 0x19
+#define OPCODE_VXOR 0x1a
+#define OPCODE_LOOP 0x1b
+#define OPCODE_ENDLOOP 0x1c
+#define NUM_OPCODES 0x1d
+
+/* Maximum number of comma separated operands of an instruction */
+#define MAX_OPERANDS 3
+
+/* Operand fields of the instruction format, in assembly order. RD and VD are
+ * written and the others read, these build the per-instruction scoreboard
+ * masks so SCOREBOARD_SIZE must stay <= 32. VD, VS1 and VS2 name vector
+ * registers and are kept in rd, rs1 and rs2 */
+#define FIELD_NONE 0x0
+#define FIELD_RD 0x1
+#define FIELD_RS1 0x2
+#define FIELD_RS2 0x3
+#define FIELD_RS3 0x4
+#define FIELD_IMM 0x5
+#define FIELD_VD 0x6
+#define FIELD_VS1 0x7
+#define FIELD_VS2 0x8
+
+/* Where an ALU input or store data comes from */
+#define SRC_ZERO 0x0
+#define SRC_RS1 0x1
+#define SRC_RS2 0x2
+#define SRC_RS3 0x3
+#define SRC_IMM 0x4
+
+/* Operation of the single functional unit in execute */
+#define ALU_NONE 0x0
+#define ALU_ADD 0x1
+#define ALU_SUB 0x2
+#define ALU_MUL 0x3
+#define ALU_DIV 0x4
+#define ALU_AND 0x5
+#define ALU_OR 0x6
+#define ALU_XOR 0x7
+
+/* Data memory access done in the memory stage, the ALU result is the address */
+#define MEM_NONE 0x0
+#define MEM_READ 0x1
+#define MEM_WRITE 0x2
+
+/* Branch condition resolved in execute against the zero flag */
+#define BRANCH_NONE 0x0
+#define BRANCH_Z 0x1
+#define BRANCH_NZ 0x2
+
+/* Why a pipeline latch is empty, carried down the pipe so the profiler can
+ * charge every cycle without a retirement to an instruction */
+#define BUBBLE_FRONTEND 0x0
+#define BUBBLE_RAW 0x1
+#define BUBBLE_FLUSH 0x2
+#define BUBBLE_LATENCY 0x3
+
+/* Pipeline stages, in program order, index the latches of APEX_CPU */
+#define STAGE_FETCH 0x0
+#define STAGE_DECODE 0x1
+#define STAGE_EXECUTE 0x2
+#define STAGE_MEMORY 0x3
+#define STAGE_WRITEBACK 0x4
+#define NUM_STAGES 0x5
+
+/* Latch a stage reads this cycle and the one it writes for the next */
+#define CUR_LATCH(cpu, stage) (&(cpu)->latch[(cpu)->cur][stage])
+#define NEXT_LATCH(cpu, stage) (&(cpu)->latch[!(cpu)->cur][stage])
+
+/* Debugger breakpoint that stopped the run */
+#define BREAK_NONE 0x0
+#define BREAK_INSN 0x1
+#define BREAK_REG 0x2
+
+/* Outcome of the prompt between single-step cycles */
+#define PROMPT_STEP 0x0
+#define PROMPT_QUIT 0x1
+#define PROMPT_HALTED 0x2
+
+/* Default bytes of per-cycle history kept for stepping backwards */
+#define HISTORY_DEFAULT_BYTES (4 << 20)
+
+/* Cycles multicore cores run between publishing their stores, and a limit
+ * on the number of cores */
+#define MULTICORE_DEFAULT_QUANTUM 100
+#define MULTICORE_MAX_CORES 256
+
+/* Longest loop iteration, in executed instructions, that can be skipped */
+#define FF_MAX_PATH 256
+
+/* Limits of the analyze command's walk over data dependent branches: paths
+ * explored and instructions issued by all of them */
+#define ANALYZE_MAX_LEAVES 1024
+#define ANALYZE_MAX_INSNS 100000000
+
+/* Cycles the schedule command simulates a program for to check it */
+#define SCHEDULE_MAX_CYCLES 100000000
+
+/* Machine description files: longest line and key, values a sweep may list
+ * per key, configurations it may expand to, and keys a file may set */
+#define MACHINE_MAX_LINE 256
+#define MACHINE_MAX_KEY 32
+#define SWEEP_MAX_VALUES 16
+#define SWEEP_MAX_CONFIGS 4096
+#define MACHINE_MAX_PARAMS (NUM_OPCODES + 2 * MEMORY_MAX_BANKS + 16)
+
+/* Largest instruction queue between fetch and decode, and loop buffer, in
+ * instructions. A loop buffer tracks its entries in one unsigned int */
+#define FRONTEND_MAX_QUEUE 16
+#define LOOP_BUFFER_MAX 32
+
+/* Deepest nest of LOOP/ENDLOOP hardware loops, each level has its own loop
+ * count and loop address register (see the loop_depth machine key) */
+#define HW_LOOP_MAX_DEPTH 8
+
+/* Largest store buffer and load queue in front of the data memory port */
+#define STORE_BUFFER_MAX 16
+#define LOAD_QUEUE_MAX 16
+
+/* Data prefetchers: the lines the prefetch buffer may hold, words per line,
+ * entries of the per-PC stride table, and how far ahead one may run */
+#define PREFETCH_NONE 0x0
+#define PREFETCH_NEXT_LINE 0x1
+#define PREFETCH_STRIDE 0x2
+#define PREFETCH_MAX_LINES 32
+#define PREFETCH_LINE_WORDS 4
+#define PREFETCH_TABLE_SIZE 16
+#define PREFETCH_MAX_DEGREE 8
+#define PREFETCH_CONFIDENT 1
+
+/* Banked data memory: most banks, words interleaved across them, and ports
+ * per bank */
+#define MEMORY_MAX_BANKS 16
+#define BANK_MAX_PORTS 4
+
+/* Relative hardware cost of a configuration in the sweep table: per register,
+ * per 1024 words of data memory, for forwarding paths, for resolving branches
+ * in decode, for macro-op fusion, per instruction queue and loop buffer entry,
+ * per store buffer entry (searched by every load) and load queue entry, for a
+ * next-line or stride prefetcher and per prefetch buffer line, per memory bank
+ * and bank port, per vector element (only for programs using the vector unit),
+ * per hardware loop level (only for programs using LOOP), and per opcode for a
+ * single-cycle unit (divided by its latency). Memory and bank latencies
+ * describe the memory behind the pipeline and cost nothing */
+#define COST_REGISTER 1.0
+#define COST_MEMORY_KWORD 1.0
+#define COST_FORWARDING 8.0
+#define COST_EARLY_BRANCH 4.0
+#define COST_FUSION 2.0
+#define COST_QUEUE_ENTRY 0.5
+#define COST_LOOP_ENTRY 0.5
+#define COST_STORE_ENTRY 1.0
+#define COST_LOAD_ENTRY 0.5
+#define COST_NEXT_LINE 1.0
+#define COST_STRIDE 4.0
+#define COST_PREFETCH_LINE 0.5
+#define COST_BANK 1.0
+#define COST_BANK_PORT 2.0
+#define COST_VECTOR_LANE 1.0
+#define COST_LOOP_LEVEL 1.0
+#define COST_UNIT 2.0
+
+/* How a simulate/show_mem run ended */
+#define RUN_LIMIT 0x0
+#define RUN_HALTED 0x1
+#define RUN_WATCH 0x2
+
+/* Result cache entry identification */
+#define CACHE_MAGIC "APXC"
+#define CACHE_VERSION 2
+
+/* Binary data memory image header identification */
+#define MEM_IMAGE_MAGIC "APXM"
+#define MEM_IMAGE_VERSION 1
+
+/* Stages of the pipeline trace, stalled fetch/decode cycles are their own */
+#define KONATA_STAGE_F 0x0
+#define KONATA_STAGE_FS 0x1
+#define KONATA_STAGE_D 0x2
+#define KONATA_STAGE_DS 0x3
+#define KONATA_STAGE_X 0x4
+#define KONATA_STAGE_M 0x5
+#define KONATA_STAGE_W 0x6
+#define KONATA_STAGES 0x7
+
+/* Shared memory live state */
+#define SHM_STATE_MAGIC "APXS"
+#define SHM_STATE_VERSION 1
+
+/* Input files at least this large are parsed in parallel chunks, one per
+ * host core up to PARSE_MAX_THREADS */
+#define PARSE_CHUNK_MIN_BYTES (1 << 20)
+#define PARSE_MAX_THREADS 64
 
 /* Set this flag to 1 to enable debug messages */
 #define ENABLE_DEBUG_MESSAGES 1
@@ -0,0 +1,126 @@
+/*
+ * apex_monitor.c
+ * Samples the live state an apex_sim run publishes with --publish=<name>
+ * and prints one line per sample until the run stops
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+static const char *stage_names[5] = {"F", "D", "EX", "MEM", "WB"};
+
+/*
+Copies a consistent snapshot of the published state
+*/
+static void
+read_state(const APEX_Shm_State *state, APEX_Shm_State *out)
+{
+    unsigned int seq;
+
+    for (;;)
+    {
+        seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            continue;
+        }
+        memcpy(out, (const void *)state, sizeof(APEX_Shm_State));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&state->seq, __ATOMIC_RELAXED) == seq)
+        {
+            return;
+        }
+    }
+}
+
+static void
+print_state(const APEX_Shm_State *s, const APEX_Shm_State *last, double seconds)
+{
+    int i;
+
+    printf("cycle %d pc %d retired %d", s->clock, s->pc, s->insn_completed);
+    if (last && seconds > 0)
+    {
+        printf(" (%.0f cycles/s)", (s->clock - last->clock) / seconds);
+    }
+    printf(" |");
+    for (i = 0; i < 5; ++i)
+    {
+        if (s->stages[i].has_insn)
+        {
+            printf(" %s:%d", stage_names[i], s->stages[i].pc);
+        }
+        else
+        {
+            printf(" %s:-", stage_names[i]);
+        }
+    }
+    printf(" | Z=%d%s\n", s->zero_flag, s->stall ? " stall" : "");
+    for (i = 0; !s->running && i < REG_FILE_SIZE; ++i)
+    {
+        printf("R%d=%d%c", i, s->regs[i], i == REG_FILE_SIZE - 1 ? '\n' : ' ');
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char const *argv[])
+{
+    const APEX_Shm_State *state;
+    APEX_Shm_State cur, last;
+    struct timespec delay;
+    char name[256];
+    int fd, interval_ms = 100, have_last = FALSE;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "APEX_Help: Usage %s <name> [interval ms]\n", argv[0]);
+        exit(1);
+    }
+    if (argc > 2 && atoi(argv[2]) > 0)
+    {
+        interval_ms = atoi(argv[2]);
+    }
+
+    snprintf(name, sizeof(name), "%s%s", argv[1][0] == '/' ? "" : "/", argv[1]);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "APEX_Error: No published state %s\n", name);
+        exit(1);
+    }
+    state = mmap(NULL, sizeof(APEX_Shm_State), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED || memcmp(state->magic, SHM_STATE_MAGIC, 4) != 0
+        || state->version != SHM_STATE_VERSION)
+    {
+        fprintf(stderr, "APEX_Error: %s is not an APEX state segment\n", name);
+        exit(1);
+    }
+
+    delay.tv_sec = interval_ms / 1000;
+    delay.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+    for (;;)
+    {
+        read_state(state, &cur);
+        print_state(&cur, have_last ? &last : NULL, interval_ms / 1000.0);
+        if (!cur.running)
+        {
+            break;
+        }
+        last = cur;
+        have_last = TRUE;
+        nanosleep(&delay, NULL);
+    }
+
+    munmap((void *)state, sizeof(APEX_Shm_State));
+    return 0;
+}
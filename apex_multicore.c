@@ -0,0 +1,249 @@
+/*
+ * apex_multicore.c
+ * Contains the multi-core driver. Every core is a full APEX_CPU with its own
+ * latches and register file, all of them point at the data memory of core 0
+ * and each runs on its own host thread. Cores run in lockstep quanta of
+ * cycles separated by a barrier. During a quantum shared memory is read-only:
+ * a core's stores are held privately (and read back by that core), and at the
+ * barrier they are published in core order, so a later core wins a
+ * conflicting store. Runs are deterministic for any quantum and host.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+typedef struct Multicore
+{
+    APEX_CPU **cores;
+    int count;
+    int quantum;
+    pthread_barrier_t barrier;
+    int *halted;                /* Per core, HALT retired */
+    int done;                   /* Every core halted or a watchpoint stopped one */
+} Multicore;
+
+typedef struct Core_Thread
+{
+    Multicore *mc;
+    int id;
+} Core_Thread;
+
+/*
+Makes the stores of the finished quantum visible, in core order
+*/
+static void
+publish_stores(Multicore *mc)
+{
+    APEX_Quantum_Stores *stores;
+    int *memory = mc->cores[0]->data_memory;
+    int c, i, addr;
+
+    for (c = 0; c < mc->count; ++c)
+    {
+        stores = mc->cores[c]->stores;
+        for (i = 0; i < stores->count; ++i)
+        {
+            addr = stores->addr[i];
+            memory[addr] = stores->value[addr];
+            stores->held[addr / 32] = 0;
+        }
+        stores->count = 0;
+    }
+}
+
+static void *
+run_core(void *arg)
+{
+    Core_Thread *t = arg;
+    Multicore *mc = t->mc;
+    APEX_CPU *cpu = mc->cores[t->id];
+    int i, all_halted;
+
+    while (TRUE)
+    {
+        for (i = 0; i < mc->quantum && !mc->halted[t->id] && !cpu->watch_hit; ++i)
+        {
+            mc->halted[t->id] = APEX_cpu_step(cpu);
+        }
+
+        /* One thread publishes while the others wait at the second barrier */
+        if (pthread_barrier_wait(&mc->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        {
+            publish_stores(mc);
+            all_halted = TRUE;
+            for (i = 0; i < mc->count; ++i)
+            {
+                all_halted &= mc->halted[i];
+                mc->done |= mc->cores[i]->watch_hit;
+            }
+            mc->done |= all_halted;
+        }
+        pthread_barrier_wait(&mc->barrier);
+
+        if (mc->done)
+        {
+            return NULL;
+        }
+    }
+}
+
+/*
+Makes a core running the same program as cpu, with its own copy of code
+memory so breakpoint flags and freeing stay per core
+*/
+static APEX_CPU *
+clone_core(const APEX_CPU *cpu)
+{
+    APEX_CPU *core = malloc(sizeof(APEX_CPU));
+
+    if (!core)
+    {
+        return NULL;
+    }
+
+    memcpy(core, cpu, sizeof(APEX_CPU));
+    core->code_memory = malloc(cpu->code_memory_size * sizeof(APEX_Instruction));
+    if (!core->code_memory)
+    {
+        free(core);
+        return NULL;
+    }
+    memcpy(core->code_memory, cpu->code_memory,
+           cpu->code_memory_size * sizeof(APEX_Instruction));
+
+    /* Profiling, history, tracing, publishing and fast-forward stay with core 0 */
+    core->profile = NULL;
+    core->history = NULL;
+    core->shm = NULL;
+    core->konata = NULL;
+    core->ff = NULL;
+    return core;
+}
+
+static void
+print_core(const Multicore *mc, int id)
+{
+    const APEX_CPU *core = mc->cores[id];
+    int i;
+
+    printf("APEX_CPU: Core %d %s, cycles = %d instructions = %d IPC = %.3f\n", id,
+           mc->halted[id] ? "Complete" : "Stopped", core->clock, core->insn_completed,
+           core->clock ? (double)core->insn_completed / core->clock : 0.0);
+    for (i = 0; i < REG_FILE_SIZE; ++i)
+    {
+        printf("R%d=%d%s", i, core->regs[i], i == REG_FILE_SIZE - 1 ? "\n" : " ");
+    }
+}
+
+/*
+Runs count copies of the program loaded in cpu, core i starting with i in R15,
+each on its own thread until all of them halt. cpu is core 0 and its data
+memory is the shared one. Prints per-core and total IPC, returns 0 or -1
+*/
+int
+APEX_multicore_run(APEX_CPU *cpu, int count, int quantum)
+{
+    Core_Thread *threads = NULL;
+    pthread_t *tids = NULL;
+    Multicore mc;
+    long insns = 0;
+    int i, w, cycles = 0, ret = -1;
+
+    memset(&mc, 0, sizeof(mc));
+    mc.count = count;
+    mc.quantum = quantum;
+    mc.cores = calloc(count, sizeof(APEX_CPU *));
+    mc.halted = calloc(count, sizeof(int));
+    threads = calloc(count, sizeof(Core_Thread));
+    tids = calloc(count, sizeof(pthread_t));
+    if (!mc.cores || !mc.halted || !threads || !tids)
+    {
+        goto out;
+    }
+
+    mc.cores[0] = cpu;
+    for (i = 1; i < count; ++i)
+    {
+        mc.cores[i] = clone_core(cpu);
+        if (!mc.cores[i])
+        {
+            goto out;
+        }
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        mc.cores[i]->stores = calloc(1, sizeof(APEX_Quantum_Stores));
+        if (!mc.cores[i]->stores)
+        {
+            goto out;
+        }
+        mc.cores[i]->data_memory = cpu->data_memory;
+        mc.cores[i]->regs[15] = i;
+    }
+
+    command_simulate = 1;
+    pthread_barrier_init(&mc.barrier, NULL, count);
+
+    for (i = 0; i < count; ++i)
+    {
+        threads[i].mc = &mc;
+        threads[i].id = i;
+        if (pthread_create(&tids[i], NULL, run_core, &threads[i]) != 0)
+        {
+            /* Cores already started would wait at the barrier forever */
+            fprintf(stderr, "APEX_Error: Unable to start thread for core %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&mc.barrier);
+
+    for (i = 0; i < count; ++i)
+    {
+        print_core(&mc, i);
+        insns += mc.cores[i]->insn_completed;
+        if (mc.cores[i]->clock > cycles)
+        {
+            cycles = mc.cores[i]->clock;
+        }
+
+        /* Diff dumps of the shared memory cover the writes of every core */
+        for (w = 0; i > 0 && w < BITMAP_WORDS(DATA_MEMORY_SIZE); ++w)
+        {
+            cpu->mem_dirty[w] |= mc.cores[i]->mem_dirty[w];
+        }
+        for (w = 0; i > 0 && w < BITMAP_WORDS(DATA_MEMORY_PAGES); ++w)
+        {
+            cpu->mem_dirty_pages[w] |= mc.cores[i]->mem_dirty_pages[w];
+        }
+    }
+    printf("APEX_CPU: %d cores, cycles = %d instructions = %ld IPC = %.3f\n", count,
+           cycles, insns, cycles ? (double)insns / cycles : 0.0);
+    ret = 0;
+
+out:
+    for (i = 0; mc.cores && i < count && mc.cores[i]; ++i)
+    {
+        free(mc.cores[i]->stores);
+        mc.cores[i]->stores = NULL;
+        if (i > 0)
+        {
+            free(mc.cores[i]->code_memory);
+            free(mc.cores[i]);
+        }
+    }
+    free(mc.cores);
+    free(mc.halted);
+    free(threads);
+    free(tids);
+    return ret;
+}
@@ -0,0 +1,142 @@
+/*
+ * apex_prefetch.c
+ * Contains the data prefetchers of the memory stage. Every load starting its
+ * access in MEM trains the configured prefetcher with its address: next_line
+ * requests the lines after the load's, stride runs ahead along the stride
+ * the load at the same PC repeated. Requested lines land in a small FIFO
+ * prefetch buffer memory_latency cycles later, over a path of their own
+ * beside the data memory port, though with banks they compete for the bank
+ * ports. The buffer only models timing, loads still read their value from
+ * data memory, so stores never have to update it.
+ */
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/*
+Returns the prefetch buffer entry holding the line of addr, -1 if none
+*/
+int
+APEX_prefetch_lookup(const APEX_CPU *cpu, int addr)
+{
+    int line = addr / PREFETCH_LINE_WORDS;
+    int i;
+
+    for (i = 0; i < cpu->machine.prefetch_lines; ++i)
+    {
+        if (cpu->prefetch_buffer[i].valid && cpu->prefetch_buffer[i].line == line)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Requests the line of addr, unless it is outside data memory or already in
+the buffer, in place of the oldest line. With banks the line is read from
+the bank of its first word and dropped if none of its ports is free
+*/
+static void
+prefetch_line(APEX_CPU *cpu, int addr)
+{
+    APEX_Prefetch_Line *line;
+    int cycles;
+
+    if (addr < 0 || addr >= cpu->machine.mem_size || APEX_prefetch_lookup(cpu, addr) >= 0)
+    {
+        return;
+    }
+    cycles = APEX_bank_access(cpu, addr - addr % PREFETCH_LINE_WORDS);
+    if (!cycles)
+    {
+        return;
+    }
+
+    line = &cpu->prefetch_buffer[cpu->pf_next];
+    cpu->pf_next = (cpu->pf_next + 1) % cpu->machine.prefetch_lines;
+    line->valid = TRUE;
+    line->line = addr / PREFETCH_LINE_WORDS;
+    line->ready = cpu->clock + cycles;
+    line->used = FALSE;
+    cpu->pf_issued++;
+}
+
+/*
+Trains the stride table entry of pc with a load address, returns the stride
+once it repeated PREFETCH_CONFIDENT times in a row, 0 until then
+*/
+static int
+train_stride(APEX_CPU *cpu, int pc, int addr)
+{
+    APEX_Stride_Entry *e = &cpu->stride_table[(pc / 4) % PREFETCH_TABLE_SIZE];
+    int stride = addr - e->last_addr;
+
+    if (e->pc != pc)
+    {
+        e->pc = pc;
+        e->stride = 0;
+        e->confidence = 0;
+    }
+    else if (stride == e->stride)
+    {
+        e->confidence += e->confidence < PREFETCH_CONFIDENT;
+    }
+    else
+    {
+        e->stride = stride;
+        e->confidence = 0;
+    }
+    e->last_addr = addr;
+
+    return e->confidence >= PREFETCH_CONFIDENT ? e->stride : 0;
+}
+
+/*
+Accounts a load starting its access and trains the prefetcher with it. entry is the
+prefetch buffer line it hit, -1 if none, late tells if that line was still
+on its way, forwarded if the store buffer served the load
+*/
+void
+APEX_prefetch_access(APEX_CPU *cpu, int pc, int addr, int entry, int late,
+                     int forwarded)
+{
+    const APEX_Machine *m = &cpu->machine;
+    APEX_Prefetch_Line *line;
+    int i, step;
+
+    if (entry >= 0)
+    {
+        line = &cpu->prefetch_buffer[entry];
+        cpu->pf_useful += !line->used;
+        line->used = TRUE;
+        cpu->pf_late += late;
+        cpu->pf_hits += !late;
+    }
+    else if (!forwarded)
+    {
+        cpu->pf_misses++;
+    }
+
+    if (m->prefetch == PREFETCH_NEXT_LINE)
+    {
+        step = PREFETCH_LINE_WORDS;
+    }
+    else
+    {
+        /* Strides within a line still move on a line at a time */
+        step = train_stride(cpu, pc, addr);
+        if (step > 0 && step < PREFETCH_LINE_WORDS)
+        {
+            step = PREFETCH_LINE_WORDS;
+        }
+        else if (step < 0 && step > -PREFETCH_LINE_WORDS)
+        {
+            step = -PREFETCH_LINE_WORDS;
+        }
+    }
+
+    for (i = 1; step && i <= m->prefetch_degree; ++i)
+    {
+        prefetch_line(cpu, addr + i * step);
+    }
+}
@@ -0,0 +1,395 @@
+/*
+ * apex_profile.c
+ * Contains the per-PC cycle profiler. Every cycle is charged to the
+ * instruction that retires in writeback, or for an empty writeback to the
+ * instruction recorded in the bubble's latch (RAW consumer, taken branch,
+ * multi-cycle execute or held MEM). RAW bubbles also remember their producer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+#define PROFILE_PAIRS_INITIAL 256
+
+/*
+Returns the profile entry of a PC, NULL if it is outside code memory
+*/
+static APEX_Profile_Entry *
+get_entry(const APEX_CPU *cpu, int pc)
+{
+    int index = get_code_memory_index_from_pc(pc);
+
+    if (pc < 4000 || index >= cpu->code_memory_size)
+    {
+        return NULL;
+    }
+    return &cpu->profile->entries[index];
+}
+
+static unsigned int
+pair_hash(int consumer, int producer, int size)
+{
+    return ((unsigned int)consumer * 2654435761u ^ (unsigned int)producer) & (size - 1);
+}
+
+/*
+Finds or creates the slot of a consumer/producer pair, NULL if out of memory
+*/
+static APEX_Profile_Pair *
+get_pair(APEX_Profile *profile, int consumer, int producer)
+{
+    APEX_Profile_Pair *old = profile->pairs, *slot;
+    int i, old_size = profile->pairs_size;
+    unsigned int h;
+
+    if ((profile->pairs_used + 1) * 10 > profile->pairs_size * 7)
+    {
+        profile->pairs_size *= 2;
+        profile->pairs = malloc(profile->pairs_size * sizeof(APEX_Profile_Pair));
+        if (!profile->pairs)
+        {
+            profile->pairs = old;
+            profile->pairs_size = old_size;
+            return NULL;
+        }
+        for (i = 0; i < profile->pairs_size; ++i)
+        {
+            profile->pairs[i].consumer = -1;
+        }
+        for (i = 0; i < old_size; ++i)
+        {
+            if (old[i].consumer < 0)
+            {
+                continue;
+            }
+            h = pair_hash(old[i].consumer, old[i].producer, profile->pairs_size);
+            while (profile->pairs[h].consumer >= 0)
+            {
+                h = (h + 1) & (profile->pairs_size - 1);
+            }
+            profile->pairs[h] = old[i];
+        }
+        free(old);
+    }
+
+    h = pair_hash(consumer, producer, profile->pairs_size);
+    for (;;)
+    {
+        slot = &profile->pairs[h];
+        if (slot->consumer < 0)
+        {
+            slot->consumer = consumer;
+            slot->producer = producer;
+            slot->count = 0;
+            profile->pairs_used++;
+            return slot;
+        }
+        if (slot->consumer == consumer && slot->producer == producer)
+        {
+            return slot;
+        }
+        h = (h + 1) & (profile->pairs_size - 1);
+    }
+}
+
+/*
+Allocates the profile of a loaded CPU, returns 0 or -1
+*/
+int
+APEX_profile_enable(APEX_CPU *cpu)
+{
+    APEX_Profile *profile;
+    int i;
+
+    if (cpu->profile)
+    {
+        return 0;
+    }
+
+    profile = calloc(1, sizeof(APEX_Profile));
+    if (!profile)
+    {
+        return -1;
+    }
+
+    profile->entries = calloc(cpu->code_memory_size, sizeof(APEX_Profile_Entry));
+    profile->pairs_size = PROFILE_PAIRS_INITIAL;
+    profile->pairs = malloc(profile->pairs_size * sizeof(APEX_Profile_Pair));
+    if (!profile->entries || !profile->pairs)
+    {
+        free(profile->entries);
+        free(profile->pairs);
+        free(profile);
+        return -1;
+    }
+
+    for (i = 0; i < profile->pairs_size; ++i)
+    {
+        profile->pairs[i].consumer = -1;
+    }
+
+    cpu->profile = profile;
+    return 0;
+}
+
+/*
+Charges the current cycle, called before its stages run
+*/
+void
+APEX_profile_cycle(APEX_CPU *cpu)
+{
+    const CPU_Stage *wb = CUR_LATCH(cpu, STAGE_WRITEBACK);
+    APEX_Profile_Entry *entry, *producer;
+    APEX_Profile_Pair *pair;
+
+    if (wb->has_insn)
+    {
+        entry = get_entry(cpu, wb->pc);
+        if (entry)
+        {
+            entry->retire++;
+            return;
+        }
+    }
+    else if (wb->bubble_cause != BUBBLE_FRONTEND
+             && (entry = get_entry(cpu, wb->bubble_pc)) != NULL)
+    {
+        switch (wb->bubble_cause)
+        {
+            case BUBBLE_RAW:
+                entry->raw_stall++;
+                producer = get_entry(cpu, wb->bubble_pc2);
+                if (producer)
+                {
+                    producer->raw_caused++;
+                }
+                pair = get_pair(cpu->profile, entry - cpu->profile->entries,
+                                producer ? producer - cpu->profile->entries : -1);
+                if (pair)
+                {
+                    pair->count++;
+                }
+                break;
+            case BUBBLE_FLUSH:
+                entry->flush++;
+                break;
+            case BUBBLE_LATENCY:
+                entry->latency++;
+                break;
+        }
+        return;
+    }
+
+    cpu->profile->frontend++;
+}
+
+/*
+Reads the source lines of the input file, one per code memory entry, the
+parser skips blank lines and so does this
+*/
+static char **
+read_source_lines(const APEX_CPU *cpu)
+{
+    char **lines = calloc(cpu->code_memory_size, sizeof(char *));
+    char *line = NULL;
+    size_t len = 0, n;
+    FILE *fp;
+    int i = 0;
+
+    if (!lines)
+    {
+        return NULL;
+    }
+
+    fp = fopen(cpu->filename, "r");
+    while (fp && i < cpu->code_memory_size && getline(&line, &len, fp) != -1)
+    {
+        n = strlen(line);
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'
+                         || line[n - 1] == ' ' || line[n - 1] == '\t'))
+        {
+            line[--n] = '\0';
+        }
+        if (n > 0)
+        {
+            lines[i++] = strdup(line);
+        }
+    }
+
+    free(line);
+    if (fp)
+    {
+        fclose(fp);
+    }
+    return lines;
+}
+
+static const char *
+source_line(char **lines, int index)
+{
+    return (lines && lines[index]) ? lines[index] : "?";
+}
+
+static void
+write_listing(const APEX_CPU *cpu, FILE *fp, char **lines)
+{
+    const APEX_Profile_Entry *e;
+    long owned, total = cpu->profile->frontend;
+    int i;
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        e = &cpu->profile->entries[i];
+        total += e->retire + e->raw_stall + e->flush + e->latency;
+    }
+
+    fprintf(fp, "APEX profile of %s: %ld cycles, %ld front end (fill/fetch) cycles\n",
+            cpu->filename, total, cpu->profile->frontend);
+    fprintf(fp, "cycles = retire + raw_stall + flush + latency; raw_caused counts "
+                "bubbles later instructions spent waiting on this one\n\n");
+    fprintf(fp, "%8s %6s %8s %9s %10s %8s %8s  %5s %5s  %s\n", "cycles", "%",
+            "retire", "raw_stall", "raw_caused", "flush", "latency", "line",
+            "pc", "source");
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        e = &cpu->profile->entries[i];
+        owned = e->retire + e->raw_stall + e->flush + e->latency;
+        fprintf(fp, "%8ld %6.2f %8ld %9ld %10ld %8ld %8ld  %5d %5d  %s\n", owned,
+                total ? 100.0 * owned / total : 0.0, e->retire, e->raw_stall,
+                e->raw_caused, e->flush, e->latency, cpu->code_memory[i].line,
+                4000 + 4 * i, source_line(lines, i));
+    }
+}
+
+static void
+write_folded(const APEX_CPU *cpu, FILE *fp, char **lines)
+{
+    const APEX_Profile *profile = cpu->profile;
+    const APEX_Profile_Entry *e;
+    const APEX_Profile_Pair *pair;
+    const char *root = strrchr(cpu->filename, '/');
+    int i;
+
+    root = root ? root + 1 : cpu->filename;
+
+    if (profile->frontend)
+    {
+        fprintf(fp, "%s;front_end %ld\n", root, profile->frontend);
+    }
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        e = &profile->entries[i];
+        if (e->retire)
+        {
+            fprintf(fp, "%s;L%d %s;retire %ld\n", root, cpu->code_memory[i].line,
+                    source_line(lines, i), e->retire);
+        }
+        if (e->flush)
+        {
+            fprintf(fp, "%s;L%d %s;branch_flush %ld\n", root, cpu->code_memory[i].line,
+                    source_line(lines, i), e->flush);
+        }
+        if (e->latency)
+        {
+            fprintf(fp, "%s;L%d %s;execute_latency %ld\n", root, cpu->code_memory[i].line,
+                    source_line(lines, i), e->latency);
+        }
+    }
+
+    /* RAW stalls stack the producer on top of the waiting consumer */
+    for (i = 0; i < profile->pairs_size; ++i)
+    {
+        pair = &profile->pairs[i];
+        if (pair->consumer < 0)
+        {
+            continue;
+        }
+        if (pair->producer < 0)
+        {
+            fprintf(fp, "%s;L%d %s;raw_stall %ld\n", root,
+                    cpu->code_memory[pair->consumer].line, source_line(lines, pair->consumer),
+                    pair->count);
+            continue;
+        }
+        fprintf(fp, "%s;L%d %s;raw_stall;L%d %s %ld\n", root,
+                cpu->code_memory[pair->consumer].line, source_line(lines, pair->consumer),
+                cpu->code_memory[pair->producer].line, source_line(lines, pair->producer),
+                pair->count);
+    }
+}
+
+/*
+Writes the annotated source listing and/or the folded stacks for flamegraph
+tools, either file name may be NULL. Returns 0 or -1
+*/
+int
+APEX_profile_write(const APEX_CPU *cpu, const char *listing_file,
+                   const char *folded_file)
+{
+    char **lines;
+    FILE *fp;
+    int i, ret = 0;
+
+    if (!cpu->profile)
+    {
+        return 0;
+    }
+
+    lines = read_source_lines(cpu);
+
+    if (listing_file)
+    {
+        fp = fopen(listing_file, "w");
+        if (fp)
+        {
+            write_listing(cpu, fp, lines);
+            fclose(fp);
+        }
+        else
+        {
+            fprintf(stderr, "APEX_Error: Unable to create profile %s\n", listing_file);
+            ret = -1;
+        }
+    }
+
+    if (folded_file)
+    {
+        fp = fopen(folded_file, "w");
+        if (fp)
+        {
+            write_folded(cpu, fp, lines);
+            fclose(fp);
+        }
+        else
+        {
+            fprintf(stderr, "APEX_Error: Unable to create profile %s\n", folded_file);
+            ret = -1;
+        }
+    }
+
+    for (i = 0; lines && i < cpu->code_memory_size; ++i)
+    {
+        free(lines[i]);
+    }
+    free(lines);
+    return ret;
+}
+
+void
+APEX_profile_free(APEX_CPU *cpu)
+{
+    if (!cpu->profile)
+    {
+        return;
+    }
+
+    free(cpu->profile->entries);
+    free(cpu->profile->pairs);
+    free(cpu->profile);
+    cpu->profile = NULL;
+}
@@ -0,0 +1,448 @@
+/*
+ * apex_schedule.c
+ * Contains the instruction scheduler behind the schedule command. Each basic
+ * block is list scheduled against the decode scoreboard: of the instructions
+ * whose dependencies are met, the one that can issue first goes next, ties
+ * going to the longest chain of results after it. Blocks keep their place
+ * and size and a BZ/BNZ/HALT/LOOP/ENDLOOP stays last, so branch offsets and
+ * hardware loop bodies are unchanged.
+ * Register RAW/WAR/WAW order, store order against other memory accesses and
+ * the zero flag a later branch reads are kept. The rewritten program is
+ * written as assembly and both versions are simulated to report the cycles
+ * saved and check that they end in the same state.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Issue timing at a point of the program, as in the analyze command */
+typedef struct Sched_State
+{
+    long next_issue;
+    long ready[SCOREBOARD_SIZE];
+} Sched_State;
+
+static int
+is_setter(const APEX_Instruction *ins)
+{
+    return opcode_info[ins->opcode].sets_zero_flag;
+}
+
+static int
+is_store(const APEX_Instruction *ins)
+{
+    return opcode_info[ins->opcode].mem_access == MEM_WRITE;
+}
+
+static int
+ends_block(const APEX_Instruction *ins)
+{
+    return opcode_info[ins->opcode].branch != BRANCH_NONE || ins->opcode == OPCODE_HALT
+           || ins->opcode == OPCODE_LOOP || ins->opcode == OPCODE_ENDLOOP;
+}
+
+/*
+Marks the first instruction of every basic block
+*/
+static void
+find_leaders(const APEX_CPU *cpu, char *leader)
+{
+    const APEX_Instruction *ins;
+    int i, target;
+
+    leader[0] = TRUE;
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        ins = &cpu->code_memory[i];
+        if (!ends_block(ins))
+        {
+            continue;
+        }
+        if (i + 1 < cpu->code_memory_size)
+        {
+            leader[i + 1] = TRUE;
+        }
+        target = i + ins->imm / 4;
+        if (opcode_info[ins->opcode].branch != BRANCH_NONE && target >= 0
+            && target < cpu->code_memory_size)
+        {
+            leader[target] = TRUE;
+        }
+    }
+}
+
+/*
+Sets flag_out[i] for the last instruction i of every block after which the
+zero flag may be read. A block ending in BZ/BNZ reads it, HALT counts as a
+reader as the flag is part of the final state, a block ending in LOOP or
+ENDLOOP keeps it too, and a block falling through to the next one passes on
+what that block needs
+*/
+static void
+flag_liveness(const APEX_CPU *cpu, const char *leader, char *flag_out)
+{
+    const APEX_Instruction *code = cpu->code_memory;
+    int i, start, end, live_in = FALSE;
+
+    for (end = cpu->code_memory_size - 1; end >= 0; end = start - 1)
+    {
+        for (start = end; !leader[start]; --start)
+            ;
+
+        flag_out[end] = ends_block(&code[end]) ? TRUE : live_in;
+        live_in = flag_out[end];
+        for (i = start; i <= end; ++i)
+        {
+            live_in &= !is_setter(&code[i]);
+        }
+    }
+}
+
+/*
+Returns TRUE if instruction b may not move above instruction a, a earlier in
+the block. flag_def is the block's last setter when its flag is read later
+*/
+static int
+depends(const APEX_Instruction *code, int a, int b, int flag_def)
+{
+    const APEX_Instruction *x = &code[a], *y = &code[b];
+
+    if ((x->dest_mask & (y->src_mask | y->dest_mask)) || (x->src_mask & y->dest_mask))
+    {
+        return TRUE;
+    }
+    if (opcode_info[x->opcode].mem_access != MEM_NONE
+        && opcode_info[y->opcode].mem_access != MEM_NONE && (is_store(x) || is_store(y)))
+    {
+        return TRUE;
+    }
+    return b == flag_def && is_setter(x);
+}
+
+/*
+Issues one instruction on s and returns its issue cycle
+*/
+static long
+issue(const APEX_CPU *cpu, Sched_State *s, const APEX_Instruction *ins)
+{
+    long t = s->next_issue;
+    unsigned int bits;
+
+    for (bits = ins->src_mask; bits; bits &= bits - 1)
+    {
+        if (s->ready[__builtin_ctz(bits)] > t)
+        {
+            t = s->ready[__builtin_ctz(bits)];
+        }
+    }
+    if (ins->dest_mask)
+    {
+        s->ready[ins->rd] = t + APEX_result_delay(cpu, ins->opcode);
+    }
+    s->next_issue = t + cpu->machine.latency[ins->opcode];
+    return t;
+}
+
+/* TRUE if state a is no later than b everywhere and earlier somewhere */
+static int
+earlier(const Sched_State *a, const Sched_State *b)
+{
+    int i, less = a->next_issue < b->next_issue;
+
+    if (a->next_issue > b->next_issue)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < SCOREBOARD_SIZE; ++i)
+    {
+        if (a->ready[i] > b->ready[i])
+        {
+            return FALSE;
+        }
+        less |= a->ready[i] < b->ready[i];
+    }
+    return less;
+}
+
+/*
+List schedules code[start, end) into order, returns FALSE if out of memory
+*/
+static int
+schedule_block(const APEX_CPU *cpu, int start, int end, int flag_def,
+               const Sched_State *entry, int *order)
+{
+    const APEX_Instruction *code = cpu->code_memory;
+    int n = end - start, i, j, k, best, *preds, *height;
+    char *done;
+    long t, best_t;
+    Sched_State s = *entry, probe;
+
+    preds = calloc(n, sizeof(int));
+    height = calloc(n, sizeof(int));
+    done = calloc(n, 1);
+    if (!preds || !height || !done)
+    {
+        free(preds);
+        free(height);
+        free(done);
+        return FALSE;
+    }
+
+    /* Longest chain of dependent latencies from each instruction to the end */
+    for (i = n - 1; i >= 0; --i)
+    {
+        height[i] = cpu->machine.latency[code[start + i].opcode];
+        for (j = i + 1; j < n; ++j)
+        {
+            if (depends(code, start + i, start + j, flag_def))
+            {
+                preds[j]++;
+                k = APEX_result_delay(cpu, code[start + i].opcode) + height[j];
+                height[i] = k > height[i] ? k : height[i];
+            }
+        }
+    }
+
+    for (k = 0; k < n; ++k)
+    {
+        best = -1;
+        best_t = 0;
+        for (i = 0; i < n; ++i)
+        {
+            if (done[i] || preds[i])
+            {
+                continue;
+            }
+            probe = s;
+            t = issue(cpu, &probe, &code[start + i]);
+            if (best < 0 || t < best_t || (t == best_t && height[i] > height[best]))
+            {
+                best = i;
+                best_t = t;
+            }
+        }
+
+        issue(cpu, &s, &code[start + best]);
+        done[best] = TRUE;
+        order[k] = start + best;
+        for (j = best + 1; j < n; ++j)
+        {
+            if (depends(code, start + best, start + j, flag_def))
+            {
+                preds[j]--;
+            }
+        }
+    }
+
+    free(preds);
+    free(height);
+    free(done);
+    return TRUE;
+}
+
+static void
+write_instruction(FILE *fp, const APEX_Instruction *ins)
+{
+    const int *fields = opcode_info[ins->opcode].fields;
+    int i, v;
+
+    fprintf(fp, "%s", opcode_info[ins->opcode].name);
+    for (i = 0; i < MAX_OPERANDS && fields[i] != FIELD_NONE; ++i)
+    {
+        switch (fields[i])
+        {
+            case FIELD_RD: v = ins->rd; break;
+            case FIELD_RS1: v = ins->rs1; break;
+            case FIELD_RS2: v = ins->rs2; break;
+            case FIELD_RS3: v = ins->rs3; break;
+            case FIELD_VD: v = ins->rd - REG_FILE_SIZE; break;
+            case FIELD_VS1: v = ins->rs1 - REG_FILE_SIZE; break;
+            case FIELD_VS2: v = ins->rs2 - REG_FILE_SIZE; break;
+            default: v = ins->imm; break;
+        }
+        fprintf(fp, "%s%c%d", i ? "," : " ", APEX_field_prefix(fields[i]), v);
+    }
+    fprintf(fp, "\n");
+}
+
+/*
+Runs a copy of cpu with the given code memory to HALT, returns the copy or
+NULL if it did not halt within SCHEDULE_MAX_CYCLES
+*/
+static APEX_CPU *
+run_copy(const APEX_CPU *cpu, APEX_Instruction *code)
+{
+    APEX_CPU *copy = malloc(sizeof(APEX_CPU));
+
+    if (!copy)
+    {
+        return NULL;
+    }
+
+    memcpy(copy, cpu, sizeof(APEX_CPU));
+    memcpy(copy->own_data_memory, cpu->data_memory, sizeof(copy->own_data_memory));
+    copy->data_memory = copy->own_data_memory;
+    copy->code_memory = code;
+    copy->profile = NULL;
+    copy->history = NULL;
+    copy->shm = NULL;
+    copy->konata = NULL;
+    copy->ff = NULL;
+    copy->stores = NULL;
+    copy->reg_watch = copy->reg_watch_halt = 0;
+    memset(copy->mem_watch, 0, sizeof(copy->mem_watch));
+    memset(copy->mem_watch_halt, 0, sizeof(copy->mem_watch_halt));
+
+    command_simulate = 1;
+    while (copy->clock < SCHEDULE_MAX_CYCLES)
+    {
+        if (APEX_cpu_step(copy))
+        {
+            return copy;
+        }
+    }
+    free(copy);
+    return NULL;
+}
+
+/*
+Reorders instructions within the basic blocks of the loaded program, writes
+the result to filename and reports the cycles saved, returns 0 or -1
+*/
+int
+APEX_schedule(APEX_CPU *cpu, const char *filename)
+{
+    const APEX_Instruction *code = cpu->code_memory;
+    int n = cpu->code_memory_size, i, start, end, tail, flag_def, moved = 0, blocks = 0;
+    int *order = malloc(n * sizeof(int));
+    char *leader = calloc(n, 1), *flag_out = calloc(n, 1);
+    APEX_Instruction *out = malloc(n * sizeof(APEX_Instruction));
+    APEX_CPU *before = NULL, *after = NULL;
+    Sched_State s, kept, tried;
+    FILE *fp;
+    int ret = -1;
+
+    if (!order || !leader || !flag_out || !out)
+    {
+        fprintf(stderr, "APEX_Error: Unable to allocate scheduler\n");
+        goto out;
+    }
+
+    find_leaders(cpu, leader);
+    flag_liveness(cpu, leader, flag_out);
+
+    /* Entry timing of a block is taken from the block before it */
+    memset(&s, 0, sizeof(s));
+    s.next_issue = 2;
+    for (start = 0; start < n; start = end)
+    {
+        for (end = start + 1; end < n && !leader[end]; ++end)
+            ;
+        tail = ends_block(&code[end - 1]) ? end - 1 : end;
+
+        flag_def = -1;
+        for (i = tail - 1; flag_out[end - 1] && i >= start; --i)
+        {
+            if (is_setter(&code[i]))
+            {
+                flag_def = i;
+                break;
+            }
+        }
+
+        for (i = start; i < tail; ++i)
+        {
+            order[i] = i;
+        }
+        if (tail - start > 1)
+        {
+            if (!schedule_block(cpu, start, tail, flag_def, &s, order + start))
+            {
+                fprintf(stderr, "APEX_Error: Unable to allocate scheduler\n");
+                goto out;
+            }
+        }
+
+        /* Keep the new order only if it finishes the block earlier */
+        kept = tried = s;
+        for (i = start; i < tail; ++i)
+        {
+            issue(cpu, &kept, &code[i]);
+            issue(cpu, &tried, &code[order[i]]);
+        }
+        if (!earlier(&tried, &kept))
+        {
+            for (i = start; i < tail; ++i)
+            {
+                order[i] = i;
+            }
+        }
+        else
+        {
+            blocks++;
+        }
+
+        for (i = start; i < end; ++i)
+        {
+            if (i < tail)
+            {
+                out[i] = code[order[i]];
+                moved += order[i] != i;
+            }
+            else
+            {
+                out[i] = code[i];
+            }
+            issue(cpu, &s, &out[i]);
+        }
+    }
+
+    fp = fopen(filename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "APEX_Error: Unable to create %s\n", filename);
+        goto out;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        write_instruction(fp, &out[i]);
+    }
+    fclose(fp);
+    printf("APEX_SCHEDULE: moved %d instructions in %d basic blocks, wrote %s\n", moved,
+           blocks, filename);
+
+    before = run_copy(cpu, cpu->code_memory);
+    after = run_copy(cpu, out);
+    if (!before || !after)
+    {
+        printf("APEX_SCHEDULE: not verified, the program did not halt within %d cycles\n",
+               SCHEDULE_MAX_CYCLES);
+    }
+    else if (memcmp(before->regs, after->regs, sizeof(before->regs)) != 0
+             || memcmp(before->vregs, after->vregs, sizeof(before->vregs)) != 0
+             || memcmp(before->data_memory, after->data_memory,
+                       DATA_MEMORY_SIZE * sizeof(int)) != 0
+             || before->zero_flag != after->zero_flag)
+    {
+        fprintf(stderr, "APEX_Error: Scheduled program ends in a different state\n");
+        goto out;
+    }
+    else
+    {
+        printf("APEX_SCHEDULE: cycles = %d before, %d after, %d saved, same final state\n",
+               before->clock, after->clock, before->clock - after->clock);
+    }
+    ret = 0;
+
+out:
+    free(before);
+    free(after);
+    free(order);
+    free(leader);
+    free(flag_out);
+    free(out);
+    return ret;
+}
@@ -0,0 +1,122 @@
+/*
+ * apex_shm.c
+ * Contains the live state publication for external monitors. The state is
+ * written once per cycle into a POSIX shared memory segment under a seqlock,
+ * so the simulator never blocks and makes no system calls after opening it
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Name of the published segment, removed again on close */
+static char shm_name[256];
+
+/*
+Creates the shared memory segment name (e.g. "/apex") and starts publishing
+into it, returns 0 or -1
+*/
+int
+APEX_shm_open(APEX_CPU *cpu, const char *name)
+{
+    APEX_Shm_State *state;
+    int fd;
+
+    if (cpu->shm)
+    {
+        return 0;
+    }
+
+    snprintf(shm_name, sizeof(shm_name), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to create shared memory %s\n", shm_name);
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(APEX_Shm_State)) < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to size shared memory %s\n", shm_name);
+        close(fd);
+        shm_unlink(shm_name);
+        return -1;
+    }
+
+    state = mmap(NULL, sizeof(APEX_Shm_State), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED)
+    {
+        fprintf(stderr, "APEX_Error: Unable to map shared memory %s\n", shm_name);
+        shm_unlink(shm_name);
+        return -1;
+    }
+
+    memcpy(state->magic, SHM_STATE_MAGIC, sizeof(state->magic));
+    state->version = SHM_STATE_VERSION;
+    state->running = TRUE;
+    cpu->shm = state;
+    APEX_shm_publish(cpu);
+    return 0;
+}
+
+static void
+publish_stage(APEX_Shm_Stage *out, const CPU_Stage *stage)
+{
+    out->pc = stage->pc;
+    out->opcode = stage->opcode;
+    out->has_insn = stage->has_insn;
+    out->bubble_cause = stage->bubble_cause;
+}
+
+/*
+Writes the current state, called at the start of every cycle
+*/
+void
+APEX_shm_publish(APEX_CPU *cpu)
+{
+    APEX_Shm_State *state = cpu->shm;
+    unsigned int seq = state->seq;
+    int i;
+
+    /* Odd seq tells readers a write is in progress */
+    __atomic_store_n(&state->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    state->clock = cpu->clock;
+    state->pc = cpu->pc;
+    state->insn_completed = cpu->insn_completed;
+    state->zero_flag = cpu->zero_flag;
+    state->stall = cpu->stall;
+    memcpy(state->regs, cpu->regs, sizeof(state->regs));
+    memcpy(state->pending, cpu->pending, sizeof(state->pending));
+    for (i = 0; i < NUM_STAGES; i++)
+    {
+        publish_stage(&state->stages[i], CUR_LATCH(cpu, i));
+    }
+
+    __atomic_store_n(&state->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+Publishes the final state, marks the run stopped and removes the segment.
+Monitors that already mapped it keep their view
+*/
+void
+APEX_shm_close(APEX_CPU *cpu)
+{
+    if (!cpu->shm)
+    {
+        return;
+    }
+
+    APEX_shm_publish(cpu);
+    __atomic_store_n(&cpu->shm->running, FALSE, __ATOMIC_RELEASE);
+    munmap(cpu->shm, sizeof(APEX_Shm_State));
+    shm_unlink(shm_name);
+    cpu->shm = NULL;
+}
@@ -0,0 +1,136 @@
+/*
+ * apex_vector.c
+ * Contains the vector unit of the execute stage. VADD..VXOR apply one ALU
+ * operation to vector_length elements of two vector registers. The host runs
+ * them eight elements at a time with AVX2 and four at a time with SSE4.1
+ * when its CPU has them, checked once by APEX_vector_init, and the rest one
+ * at a time with APEX_alu, so every path gives the same wrapping 32-bit
+ * results.
+ */
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+typedef int (*Vector_Kernel)(int alu_op, const int *a, const int *b, int *out, int n);
+
+/*
+Kernel without SIMD, leaves every element to the scalar loop
+*/
+static int
+vector_alu_none(int alu_op, const int *a, const int *b, int *out, int n)
+{
+    return 0;
+}
+
+/* Kernels for groups of 8 and of 4 elements, chosen by APEX_vector_init */
+static Vector_Kernel wide_kernel = vector_alu_none;
+static Vector_Kernel narrow_kernel = vector_alu_none;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+Runs alu_op over the whole groups of 8 elements, returns the elements done
+*/
+__attribute__((target("avx2"))) static int
+vector_alu_avx2(int alu_op, const int *a, const int *b, int *out, int n)
+{
+    __m256i x, y;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        x = _mm256_loadu_si256((const __m256i *)(a + i));
+        y = _mm256_loadu_si256((const __m256i *)(b + i));
+        switch (alu_op)
+        {
+            case ALU_ADD: x = _mm256_add_epi32(x, y); break;
+            case ALU_SUB: x = _mm256_sub_epi32(x, y); break;
+            case ALU_MUL: x = _mm256_mullo_epi32(x, y); break;
+            case ALU_AND: x = _mm256_and_si256(x, y); break;
+            case ALU_OR: x = _mm256_or_si256(x, y); break;
+            default: x = _mm256_xor_si256(x, y); break;
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), x);
+    }
+    return i;
+}
+
+/*
+Runs alu_op over the whole groups of 4 elements, returns the elements done
+*/
+__attribute__((target("sse4.1"))) static int
+vector_alu_sse(int alu_op, const int *a, const int *b, int *out, int n)
+{
+    __m128i x, y;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        x = _mm_loadu_si128((const __m128i *)(a + i));
+        y = _mm_loadu_si128((const __m128i *)(b + i));
+        switch (alu_op)
+        {
+            case ALU_ADD: x = _mm_add_epi32(x, y); break;
+            case ALU_SUB: x = _mm_sub_epi32(x, y); break;
+            case ALU_MUL: x = _mm_mullo_epi32(x, y); break;
+            case ALU_AND: x = _mm_and_si128(x, y); break;
+            case ALU_OR: x = _mm_or_si128(x, y); break;
+            default: x = _mm_xor_si128(x, y); break;
+        }
+        _mm_storeu_si128((__m128i *)(out + i), x);
+    }
+    return i;
+}
+#endif
+
+/*
+Picks the kernels the host CPU supports, called before any core thread runs
+*/
+void
+APEX_vector_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        wide_kernel = vector_alu_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        narrow_kernel = vector_alu_sse;
+    }
+#endif
+}
+
+/*
+Writes alu_op of the first n elements of a and b to out
+*/
+void
+APEX_vector_alu(int alu_op, const int *a, const int *b, int *out, int n)
+{
+    int i;
+
+    i = wide_kernel(alu_op, a, b, out, n);
+    i += narrow_kernel(alu_op, a + i, b + i, out + i, n - i);
+    for (; i < n; ++i)
+    {
+        out[i] = APEX_alu(alu_op, a[i], b[i]);
+    }
+}
+
+/*
+Returns TRUE if the loaded program has a vector instruction
+*/
+int
+APEX_vector_used(const APEX_CPU *cpu)
+{
+    int i;
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        if (opcode_info[cpu->code_memory[i].opcode].vector)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
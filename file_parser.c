@@ -4,26 +4,46 @@
  * this file to add new instructions
 */
 
-#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "apex_cpu.h"
 #include "apex_macros.h"
 
+/* One slice of the input file, parsed by its own thread */
+typedef struct Parse_Chunk
+{
+    const char *begin;             /* First byte, always at a line start */
+    const char *end;               /* One past the last byte */
+    int first_line;                /* Index of the chunk's first line */
+    int num_lines;                 /* Lines in this chunk */
+    int first_insn;                /* Code memory index of its first instruction */
+    int num_insns;                 /* Lines that are not blank */
+    APEX_Instruction *code_memory; /* Whole code memory, chunk writes its slice */
+    int error_line;                /* Index of first bad line, -1 if none */
+    char error[128];               /* Description of that error */
+    pthread_t thread;
+} Parse_Chunk;
+
 /*
-This function is related to parsing input file
+This function is related to parsing input file, it converts an operand such as
+"R12", "V3" or "#-8" to its number
 */
 static int
-get_num_from_string(const char *buffer)
+get_num_from_string(const char *begin, const char *end)
 {
     char str[16];
-    int i, j = 0;
+    int j = 0;
 
-    for (i = 1; buffer[i] != '\0'; ++i)
+    for (++begin; begin < end && j < (int)sizeof(str) - 1; ++begin)
     {
-        str[j] = buffer[i];
+        str[j] = *begin;
         j++;
     }
     str[j] = '\0';
@@ -37,289 +57,539 @@ This function sets the numeric opcode to an instruction based on string value
 static int
 set_opcode_str(const char *opcode_str)
 {
-    if (strcmp(opcode_str, "ADD") == 0)
-    {
-        return OPCODE_ADD;
-    }
+    int i;
 
-    if(strcmp(opcode_str, "ADDL") == 0)
+    for (i = 0; i < NUM_OPCODES; ++i)
     {
-        return OPCODE_ADDL;
+        if (strcmp(opcode_str, opcode_info[i].name) == 0)
+        {
+            return i;
+        }
     }
 
-    if(strcmp(opcode_str, "SUBL") == 0)
-    {
-        return OPCODE_SUBL;
-    }
+    return -1;
+}
 
-    if (strcmp(opcode_str, "SUB") == 0)
-    {
-        return OPCODE_SUB;
-    }
+/*
+Builds the scoreboard masks of an instruction from its operand fields
+*/
+static void
+set_register_masks(APEX_Instruction *ins)
+{
+    const int *fields = opcode_info[ins->opcode].fields;
+    int i;
 
-    if (strcmp(opcode_str, "MUL") == 0)
-    {
-        return OPCODE_MUL;
-    }
+    ins->src_mask = 0;
+    ins->dest_mask = 0;
 
-    if (strcmp(opcode_str, "DIV") == 0)
+    for (i = 0; i < MAX_OPERANDS; ++i)
     {
-        return OPCODE_DIV;
+        switch (fields[i])
+        {
+            case FIELD_RD:
+            case FIELD_VD:
+                ins->dest_mask = 1u << ins->rd;
+                break;
+            case FIELD_RS1:
+            case FIELD_VS1:
+                ins->src_mask |= 1u << ins->rs1;
+                break;
+            case FIELD_RS2:
+            case FIELD_VS2:
+                ins->src_mask |= 1u << ins->rs2;
+                break;
+            case FIELD_RS3:
+                ins->src_mask |= 1u << ins->rs3;
+                break;
+        }
     }
+}
 
-    if (strcmp(opcode_str, "AND") == 0)
+static int
+is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+Returns TRUE if the line [begin, end) holds nothing but blanks
+*/
+static int
+is_blank_line(const char *begin, const char *end)
+{
+    while (begin < end && is_blank(*begin))
     {
-        return OPCODE_AND;
+        begin++;
     }
+    return begin == end;
+}
 
-    if (strcmp(opcode_str, "OR") == 0)
+/*
+Returns TRUE if the operand [begin, end) is prefix followed by a decimal
+number, negative only for an immediate
+*/
+static int
+is_operand(const char *begin, const char *end, char prefix)
+{
+    if (begin == end || *begin++ != prefix)
     {
-        return OPCODE_OR;
+        return FALSE;
     }
-
-    if (strcmp(opcode_str, "EXOR") == 0)
+    if (prefix == '#' && begin < end && *begin == '-')
     {
-        return OPCODE_XOR;
+        begin++;
     }
-
-    if (strcmp(opcode_str, "MOVC") == 0)
+    if (begin == end)
     {
-        return OPCODE_MOVC;
+        return FALSE;
     }
-
-    if (strcmp(opcode_str, "LOAD") == 0)
+    for (; begin < end; ++begin)
     {
-        return OPCODE_LOAD;
+        if (*begin < '0' || *begin > '9')
+        {
+            return FALSE;
+        }
     }
+    return TRUE;
+}
+
+/*
+This function is related to parsing input file, it fills one instruction from
+the line [begin, end) and returns 0, or -1 with a message in error
+*/
+static int
+create_APEX_instruction(APEX_Instruction *ins, const char *begin,
+                        const char *end, char *error)
+{
+    const char *p, *tok, *tok_end;
+    int i, len, num, field, vector, comma = FALSE;
 
-    if (strcmp(opcode_str, "LDR") == 0)
+    while (begin < end && is_blank(*begin))
     {
-        return OPCODE_LDR;
+        begin++;
     }
-
-    if (strcmp(opcode_str, "STORE") == 0)
+    while (end > begin && is_blank(end[-1]))
     {
-        return OPCODE_STORE;
+        end--;
     }
 
-    if (strcmp(opcode_str, "STR") == 0)
+    /* Opcode is everything up to the first blank */
+    for (p = begin; p < end && !is_blank(*p); ++p)
+        ;
+    len = p - begin;
+    if (len == 0 || len >= (int)sizeof(ins->opcode_str))
     {
-        return OPCODE_STR;
+        strcpy(error, "missing instruction");
+        return -1;
     }
+    memcpy(ins->opcode_str, begin, len);
+    ins->opcode_str[len] = '\0';
 
-    if (strcmp(opcode_str, "BZ") == 0)
+    ins->opcode = set_opcode_str(ins->opcode_str);
+    if (ins->opcode < 0)
     {
-        return OPCODE_BZ;
+        snprintf(error, 128, "invalid opcode '%.64s'", ins->opcode_str);
+        return -1;
     }
 
-    if (strcmp(opcode_str, "BNZ") == 0)
+    /* Operands are comma separated and read in the order given by the
+     * opcode's format */
+    for (i = 0; i < MAX_OPERANDS && opcode_info[ins->opcode].fields[i] != FIELD_NONE; ++i)
     {
-        return OPCODE_BNZ;
+        while (p < end && is_blank(*p))
+        {
+            p++;
+        }
+        tok = p;
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+        tok_end = p;
+        while (tok_end > tok && is_blank(tok_end[-1]))
+        {
+            tok_end--;
+        }
+        comma = p < end;
+        if (comma)
+        {
+            p++;
+        }
+
+        if (tok == tok_end)
+        {
+            snprintf(error, 128, "%.64s expects more operands", ins->opcode_str);
+            return -1;
+        }
+
+        field = opcode_info[ins->opcode].fields[i];
+        if (!is_operand(tok, tok_end, APEX_field_prefix(field)))
+        {
+            len = tok_end - tok > 32 ? 32 : tok_end - tok;
+            snprintf(error, 128, "%.64s operand %d is '%.*s', expected %c<n>", ins->opcode_str,
+                     i + 1, len, tok, APEX_field_prefix(field));
+            return -1;
+        }
+        num = get_num_from_string(tok, tok_end);
+        switch (field)
+        {
+            case FIELD_RD:
+                ins->rd = num;
+                break;
+            case FIELD_RS1:
+                ins->rs1 = num;
+                break;
+            case FIELD_RS2:
+                ins->rs2 = num;
+                break;
+            case FIELD_RS3:
+                ins->rs3 = num;
+                break;
+            case FIELD_IMM:
+                ins->imm = num;
+                break;
+            case FIELD_VD:
+                ins->rd = REG_FILE_SIZE + num;
+                break;
+            case FIELD_VS1:
+                ins->rs1 = REG_FILE_SIZE + num;
+                break;
+            case FIELD_VS2:
+                ins->rs2 = REG_FILE_SIZE + num;
+                break;
+        }
+
+        vector = field == FIELD_VD || field == FIELD_VS1 || field == FIELD_VS2;
+        if (field != FIELD_IMM
+            && (num < 0 || num >= (vector ? VREG_FILE_SIZE : REG_FILE_SIZE)))
+        {
+            snprintf(error, 128, "register %c%d out of range", vector ? 'V' : 'R', num);
+            return -1;
+        }
     }
 
-    if (strcmp(opcode_str, "CMP") == 0)
+    /* Anything after the last operand is a mistake, not a comment */
+    while (p < end && is_blank(*p))
     {
-        return OPCODE_CMP;
+        p++;
     }
-
-    if (strcmp(opcode_str, "NOP") == 0)
+    if (p < end || comma)
     {
-        return OPCODE_NOP;
+        snprintf(error, 128, "%.64s takes %d operand%s", ins->opcode_str, i, i == 1 ? "" : "s");
+        return -1;
     }
 
-    if (strcmp(opcode_str, "HALT") == 0)
+    if (ins->opcode == OPCODE_LOOP && ins->imm < 1)
     {
-        return OPCODE_HALT;
+        snprintf(error, 128, "LOOP count #%d must be at least 1", ins->imm);
+        return -1;
     }
 
-    assert(0 && "Invalid opcode");
+    set_register_masks(ins);
     return 0;
 }
 
-static void
-split_opcode_from_insn_string(char *buffer, char tokens[2][128])
+/*
+Checks that LOOP and ENDLOOP pair up like brackets around a non-empty body,
+nested at most HW_LOOP_MAX_DEPTH deep. Returns -1 with the index of the bad
+instruction in *line and a message in error, 0 if they do
+*/
+static int
+match_hw_loops(const APEX_Instruction *code_memory, int size, int *line, char *error)
 {
-    int token_num = 0;
+    int open[HW_LOOP_MAX_DEPTH];
+    int i, depth = 0;
 
-    char *token = strtok(buffer, " ");
+    for (i = 0; i < size; ++i)
+    {
+        *line = i;
+        if (code_memory[i].opcode == OPCODE_LOOP)
+        {
+            if (depth == HW_LOOP_MAX_DEPTH)
+            {
+                snprintf(error, 128, "LOOP nested more than %d deep", HW_LOOP_MAX_DEPTH);
+                return -1;
+            }
+            open[depth++] = i;
+        }
+        else if (code_memory[i].opcode == OPCODE_ENDLOOP)
+        {
+            if (depth == 0)
+            {
+                strcpy(error, "ENDLOOP without an open LOOP");
+                return -1;
+            }
+            if (open[--depth] == i - 1)
+            {
+                strcpy(error, "ENDLOOP closes an empty LOOP");
+                return -1;
+            }
+        }
+    }
 
-    while (token != NULL)
+    if (depth > 0)
     {
-        strcpy(tokens[token_num], token);
-        token_num++;
-        token = strtok(NULL, " ");
+        *line = open[depth - 1];
+        strcpy(error, "LOOP without an ENDLOOP");
+        return -1;
     }
+    return 0;
 }
 
 /*
-This function is related to parsing input file
+Counts the lines in [begin, end), a last line without a newline counts too
 */
-static void
-create_APEX_instruction(APEX_Instruction *ins, char *buffer)
+static int
+count_lines(const char *begin, const char *end)
 {
-    int i, token_num = 0;
-    char tokens[6][128];
-    char top_level_tokens[2][128];
+    const char *p = begin;
+    int lines = 0;
 
-    for (i = 0; i < 2; ++i)
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
     {
-        strcpy(top_level_tokens[i], "");
+        lines++;
+        p++;
     }
 
-    split_opcode_from_insn_string(buffer, top_level_tokens);
-
-    char *token = strtok(top_level_tokens[1], ",");
-
-    while (token != NULL)
+    if (end > begin && end[-1] != '\n')
     {
-        strcpy(tokens[token_num], token);
-        token_num++;
-        token = strtok(NULL, ",");
+        lines++;
     }
+    return lines;
+}
 
-    strcpy(ins->opcode_str, top_level_tokens[0]);
-    ins->opcode = set_opcode_str(ins->opcode_str);
+/*
+Counts the lines of a chunk and, of those, the ones holding an instruction
+*/
+static void *
+count_chunk_lines(void *arg)
+{
+    Parse_Chunk *chunk = arg;
+    const char *line = chunk->begin, *line_end;
+    int i;
 
-    switch (ins->opcode)
+    chunk->num_lines = count_lines(chunk->begin, chunk->end);
+    chunk->num_insns = 0;
+    for (i = 0; i < chunk->num_lines; ++i)
     {
-        case OPCODE_ADD:
-        case OPCODE_SUB:
-        case OPCODE_MUL:
-        case OPCODE_DIV:
-        case OPCODE_AND:
-        case OPCODE_OR:
-        case OPCODE_XOR:
+        line_end = memchr(line, '\n', chunk->end - line);
+        if (!line_end)
         {
-            ins->rd = get_num_from_string(tokens[0]);
-            ins->rs1 = get_num_from_string(tokens[1]);
-            ins->rs2 = get_num_from_string(tokens[2]);
-            break;
+            line_end = chunk->end;
         }
+        chunk->num_insns += !is_blank_line(line, line_end);
+        line = line_end + 1;
+    }
+    return NULL;
+}
 
-        case OPCODE_ADDL:
-        {
-            ins->rd = get_num_from_string(tokens[0]);
-            ins->rs1 = get_num_from_string(tokens[1]);
-            ins->imm = get_num_from_string(tokens[2]);
-            break;
-        }
+/*
+Parses every line of a chunk into its slice of code memory, skipping blank
+lines and stopping at the first bad line
+*/
+static void *
+parse_chunk(void *arg)
+{
+    Parse_Chunk *chunk = arg;
+    APEX_Instruction *ins = &chunk->code_memory[chunk->first_insn];
+    const char *line = chunk->begin, *line_end;
+    int i;
 
-        case OPCODE_SUBL:
-        {
-            ins->rd = get_num_from_string(tokens[0]);
-            ins->rs1 = get_num_from_string(tokens[1]);
-            ins->imm = get_num_from_string(tokens[2]);
-            break;
-        }
+    chunk->error_line = -1;
 
-        case OPCODE_MOVC:
+    for (i = 0; i < chunk->num_lines; ++i, line = line_end + 1)
+    {
+        line_end = memchr(line, '\n', chunk->end - line);
+        if (!line_end)
         {
-            ins->rd = get_num_from_string(tokens[0]);
-            ins->imm = get_num_from_string(tokens[1]);
-            break;
+            line_end = chunk->end;
         }
-
-        case OPCODE_LOAD:
+        if (is_blank_line(line, line_end))
         {
-            ins->rd = get_num_from_string(tokens[0]);
-            ins->rs1 = get_num_from_string(tokens[1]);
-            ins->imm = get_num_from_string(tokens[2]);
-            break;
+            continue;
         }
 
-        case OPCODE_LDR:
+        if (create_APEX_instruction(ins, line, line_end, chunk->error) < 0)
         {
-            ins->rd = get_num_from_string(tokens[0]);
-            ins->rs1 = get_num_from_string(tokens[1]);
-            ins->rs2 = get_num_from_string(tokens[2]);
+            chunk->error_line = chunk->first_line + i;
             break;
         }
+        ins->line = chunk->first_line + i + 1;
+        ins++;
+    }
+    return NULL;
+}
 
-        case OPCODE_STORE:
-        {
-            ins->rs1 = get_num_from_string(tokens[0]);
-            ins->rs2 = get_num_from_string(tokens[1]);
-            ins->imm = get_num_from_string(tokens[2]);
-            break;
-        }
+/*
+Runs fn over every chunk, on worker threads when there is more than one
+*/
+static void
+run_chunks(Parse_Chunk *chunks, int num_chunks, void *(*fn)(void *))
+{
+    int i, started;
 
-        case OPCODE_STR:
+    for (started = 1; started < num_chunks; ++started)
+    {
+        if (pthread_create(&chunks[started].thread, NULL, fn, &chunks[started]) != 0)
         {
-            ins->rs3 = get_num_from_string(tokens[0]);
-            ins->rs1 = get_num_from_string(tokens[1]);
-            ins->rs2 = get_num_from_string(tokens[2]);
             break;
         }
+    }
+
+    /* Chunks that did not get a thread run here, in order */
+    fn(&chunks[0]);
+    for (i = started; i < num_chunks; ++i)
+    {
+        fn(&chunks[i]);
+    }
+
+    for (i = 1; i < started; ++i)
+    {
+        pthread_join(chunks[i].thread, NULL);
+    }
+}
 
-        case OPCODE_BZ:
-        case OPCODE_BNZ:
+/*
+Splits the mapped file into at most max_chunks pieces that start on line
+boundaries, returns the number of chunks
+*/
+static int
+split_into_chunks(Parse_Chunk *chunks, int max_chunks, const char *data,
+                  size_t size)
+{
+    const char *begin = data, *end = data + size, *cut;
+    int n = 0;
+
+    while (begin < end && n < max_chunks)
+    {
+        cut = begin + (end - begin) / (max_chunks - n);
+        if (n == max_chunks - 1 || cut >= end)
         {
-            ins->imm = get_num_from_string(tokens[0]);
-            break;
+            cut = end;
         }
-
-        case OPCODE_CMP:
+        else
         {
-            ins->rs1 = get_num_from_string(tokens[0]);
-            ins->rs2 = get_num_from_string(tokens[1]);
-            break;
+            cut = memchr(cut, '\n', end - cut);
+            cut = cut ? cut + 1 : end;
         }
 
+        memset(&chunks[n], 0, sizeof(Parse_Chunk));
+        chunks[n].begin = begin;
+        chunks[n].end = cut;
+        n++;
+        begin = cut;
     }
-    /* Fill in rest of the instructions accordingly */
+    return n;
 }
 
 /*
-This function is related to parsing input file
+This function is related to parsing input file. The file is mapped and, when
+large, split at line boundaries into one chunk per host core. Chunks count
+their lines, take consecutive slices of code memory and are parsed in
+parallel, so the result does not depend on thread timing.
 */
 APEX_Instruction *
 create_code_memory(const char *filename, int *size)
 {
-    FILE *fp;
-    ssize_t nread;
-    size_t len = 0;
-    char *line = NULL;
-    int code_memory_size = 0;
-    int current_instruction = 0;
-    APEX_Instruction *code_memory;
-
+    Parse_Chunk chunks[PARSE_MAX_THREADS];
+    APEX_Instruction *code_memory = NULL;
+    struct stat st;
+    const char *data;
+    char error[128];
+    int fd, i, line = 0, num_chunks, max_chunks, code_memory_size = 0;
+    long cores;
+
+    *size = 0;
     if (!filename)
     {
         return NULL;
     }
 
-    fp = fopen(filename, "r");
-    if (!fp)
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
         return NULL;
     }
 
-    while ((nread = getline(&line, &len, fp)) != -1)
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
     {
-        code_memory_size++;
+        close(fd);
+        return NULL;
     }
-    *size = code_memory_size;
-    if (!code_memory_size)
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
     {
-        fclose(fp);
+        return NULL;
+    }
+
+    max_chunks = 1;
+    if (st.st_size >= PARSE_CHUNK_MIN_BYTES)
+    {
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        max_chunks = st.st_size / PARSE_CHUNK_MIN_BYTES;
+        if (cores > 0 && max_chunks > cores)
+        {
+            max_chunks = cores;
+        }
+        if (max_chunks > PARSE_MAX_THREADS)
+        {
+            max_chunks = PARSE_MAX_THREADS;
+        }
+    }
+
+    num_chunks = split_into_chunks(chunks, max_chunks, data, st.st_size);
+
+    run_chunks(chunks, num_chunks, count_chunk_lines);
+    for (i = 0; i < num_chunks; ++i)
+    {
+        chunks[i].first_line = line;
+        chunks[i].first_insn = code_memory_size;
+        line += chunks[i].num_lines;
+        code_memory_size += chunks[i].num_insns;
+    }
+
+    if (code_memory_size == 0)
+    {
+        fprintf(stderr, "APEX_Error: %s: no instructions\n", filename);
+        munmap((void *)data, st.st_size);
         return NULL;
     }
 
     code_memory = calloc(code_memory_size, sizeof(APEX_Instruction));
     if (!code_memory)
     {
-        fclose(fp);
+        munmap((void *)data, st.st_size);
         return NULL;
     }
 
-    rewind(fp);
-    while ((nread = getline(&line, &len, fp)) != -1)
+    for (i = 0; i < num_chunks; ++i)
     {
-        create_APEX_instruction(&code_memory[current_instruction], line);
-        current_instruction++;
+        chunks[i].code_memory = code_memory;
     }
+    run_chunks(chunks, num_chunks, parse_chunk);
+    munmap((void *)data, st.st_size);
 
-    free(line);
-    fclose(fp);
+    /* Chunks are in file order, so the first error found is the earliest */
+    for (i = 0; i < num_chunks; ++i)
+    {
+        if (chunks[i].error_line >= 0)
+        {
+            fprintf(stderr, "APEX_Error: %s:%d: %s\n", filename,
+                    chunks[i].error_line + 1, chunks[i].error);
+            free(code_memory);
+            return NULL;
+        }
+    }
+
+    if (match_hw_loops(code_memory, code_memory_size, &line, error) < 0)
+    {
+        fprintf(stderr, "APEX_Error: %s:%d: %s\n", filename, code_memory[line].line, error);
+        free(code_memory);
+        return NULL;
+    }
+
+    *size = code_memory_size;
     return code_memory;
-}
\ No newline at end of file
+}
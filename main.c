@@ -1,40 +1,229 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "apex_cpu.h"
 
+/* Data memory image written after the run, if any */
+static const char *mem_out_file;
+static int mem_out_raw;
+
+/* Profile listing and flamegraph folded stacks written after the run */
+static const char *profile_file;
+static const char *folded_file;
+
+/*
+Parses "<lo>" or "<lo>-<hi>" into an inclusive range
+*/
+static int
+parse_range(const char *str, int *lo, int *hi)
+{
+    int n = sscanf(str, "%d-%d", lo, hi);
+
+    if (n == 1)
+    {
+        *hi = *lo;
+    }
+    return n >= 1;
+}
+
+/*
+Parses "R<n>" or "<n>" into a register number
+*/
+static int
+parse_reg(const char *str, int *reg)
+{
+    char *end;
+
+    if (*str == 'R')
+    {
+        ++str;
+    }
+    *reg = strtol(str, &end, 10);
+    return end != str && *end == '\0';
+}
+
+/*
+Applies a "--name=value" option to the cpu, returns 0 if it is not recognised
+and -1 if it failed
+*/
+static int
+parse_option(APEX_CPU *cpu, const char *opt)
+{
+    int lo, hi, reg;
+
+    if (strncmp(opt, "--watch-mem=", 12) == 0 && parse_range(opt + 12, &lo, &hi))
+    {
+        APEX_watch_mem(cpu, lo, hi, FALSE);
+        return 1;
+    }
+
+    if (strncmp(opt, "--halt-mem=", 11) == 0 && parse_range(opt + 11, &lo, &hi))
+    {
+        APEX_watch_mem(cpu, lo, hi, TRUE);
+        return 1;
+    }
+
+    if (strncmp(opt, "--watch-reg=", 12) == 0 && parse_reg(opt + 12, &reg))
+    {
+        return APEX_watch_reg(cpu, reg, FALSE) < 0 ? -1 : 1;
+    }
+
+    if (strncmp(opt, "--halt-reg=", 11) == 0 && parse_reg(opt + 11, &reg))
+    {
+        return APEX_watch_reg(cpu, reg, TRUE) < 0 ? -1 : 1;
+    }
+
+    if (strcmp(opt, "--dump=diff") == 0)
+    {
+        cpu->dump_mode = DUMP_DIFF;
+        return 1;
+    }
+
+    if (strncmp(opt, "--dump=", 7) == 0 && parse_range(opt + 7, &lo, &hi))
+    {
+        cpu->dump_mode = DUMP_RANGE;
+        cpu->dump_lo = lo < 0 ? 0 : lo;
+        cpu->dump_hi = hi >= DATA_MEMORY_SIZE ? DATA_MEMORY_SIZE : hi + 1;
+        return 1;
+    }
+
+    if (strncmp(opt, "--mem-in=", 9) == 0)
+    {
+        return APEX_load_data_image(cpu, opt + 9) < 0 ? -1 : 1;
+    }
+
+    if (strncmp(opt, "--mem-out=", 10) == 0)
+    {
+        mem_out_file = opt + 10;
+        mem_out_raw = FALSE;
+        return 1;
+    }
+
+    if (strncmp(opt, "--mem-out-raw=", 14) == 0)
+    {
+        mem_out_file = opt + 14;
+        mem_out_raw = TRUE;
+        return 1;
+    }
+
+    if (strncmp(opt, "--history=", 10) == 0 && atol(opt + 10) > 0)
+    {
+        cpu->history_size = atol(opt + 10);
+        return 1;
+    }
+
+    if (strncmp(opt, "--quantum=", 10) == 0 && atoi(opt + 10) > 0)
+    {
+        cpu->quantum = atoi(opt + 10);
+        return 1;
+    }
+
+    if (strncmp(opt, "--cache=", 8) == 0 && opt[8])
+    {
+        cpu->cache_dir = opt + 8;
+        return 1;
+    }
+
+    if (strncmp(opt, "--config=", 9) == 0)
+    {
+        return APEX_machine_load(cpu, opt + 9) < 0 ? -1 : 1;
+    }
+
+    if (strcmp(opt, "--early-branch") == 0)
+    {
+        cpu->early_branch = TRUE;
+        return 1;
+    }
+
+    if (strcmp(opt, "--fast-forward") == 0)
+    {
+        return APEX_ff_enable(cpu) < 0 ? -1 : 1;
+    }
+
+    if (strncmp(opt, "--profile=", 10) == 0)
+    {
+        profile_file = opt + 10;
+        return APEX_profile_enable(cpu) < 0 ? -1 : 1;
+    }
+
+    if (strncmp(opt, "--flamegraph=", 13) == 0)
+    {
+        folded_file = opt + 13;
+        return APEX_profile_enable(cpu) < 0 ? -1 : 1;
+    }
+
+    if (strncmp(opt, "--pipeview=", 11) == 0)
+    {
+        return APEX_konata_open(cpu, opt + 11) < 0 ? -1 : 1;
+    }
+
+    if (strncmp(opt, "--publish=", 10) == 0 && opt[10])
+    {
+        return APEX_shm_open(cpu, opt + 10) < 0 ? -1 : 1;
+    }
+
+    return 0;
+}
+
 int
 main(int argc, char const *argv[])
 {
     APEX_CPU *cpu;
+    int i, ret, have_step = 0;
 
     fprintf(stderr, "APEX CPU Pipeline Simulator v%0.1lf\n", VERSION);
 
-    if (argc < 3) //argc != 2 
+    if (argc < 3) //argc != 2
     {
         fprintf(stderr, "APEX_Help: Usage %s <input_file>\n", argv[0]);
         exit(1);
     }
 
-    
+
        cpu = APEX_cpu_init(argv[1]);
        if (!cpu)
        {
         fprintf(stderr, "APEX_Error: Unable to initialize CPU\n");
         exit(1);
-       }  
-    
-    const char *str_1;
-    if(argv[3])
+       }
+
+    /* First plain argument after the command is its step/location value,
+     * anything starting with "--" is an option */
+    const char *str_1 = "-1";
+    for (i = 3; i < argc; i++)
     {
-       str_1 = argv[3];
+       if (strncmp(argv[i], "--", 2) != 0)
+       {
+          if (!have_step)
+          {
+             str_1 = argv[i];
+             have_step = 1;
+          }
+          continue;
+       }
+
+       ret = parse_option(cpu, argv[i]);
+       if (ret <= 0)
+       {
+          if (ret == 0)
+          {
+             fprintf(stderr, "APEX_Error: Unknown option %s\n", argv[i]);
+          }
+          APEX_cpu_stop(cpu);
+          exit(1);
+       }
     }
-    else
+
+    APEX_cpu_run(cpu, argv[2], str_1);
+
+    if ((mem_out_file && APEX_save_data_image(cpu, mem_out_file, mem_out_raw) < 0)
+        || APEX_profile_write(cpu, profile_file, folded_file) < 0)
     {
-       str_1 = "-1";
+       APEX_cpu_stop(cpu);
+       exit(1);
     }
 
-    APEX_cpu_run(cpu, argv[2], str_1);
     APEX_cpu_stop(cpu);
     return 0;
-}
\ No newline at end of file
+}
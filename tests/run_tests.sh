@@ -0,0 +1,203 @@
+#!/bin/sh
+#
+# tests/run_tests.sh
+# Regression tests of apex_sim, run by "make test". Every test writes its
+# programs to a scratch directory, prints PASS or FAIL, and the script
+# exits with the number of failures
+#
+
+SIM=$(cd "$(dirname "$0")/.." && pwd)/apex_sim
+WORK=$(mktemp -d)
+FAILED=0
+
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+pass()
+{
+    echo "PASS $1"
+}
+
+fail()
+{
+    echo "FAIL $1: $2"
+    FAILED=$((FAILED + 1))
+}
+
+# expect_error <test> <file> <message>: loading file fails with message
+expect_error()
+{
+    out=$("$SIM" "$2" simulate 100 </dev/null 2>&1)
+    status=$?
+    if [ $status -eq 0 ]; then
+        fail "$1" "loaded without an error"
+    elif ! echo "$out" | grep -qF "APEX_Error: $3"; then
+        fail "$1" "expected '$3', got '$(echo "$out" | grep APEX_Error | head -1)'"
+    else
+        pass "$1"
+    fi
+}
+
+# expect_reg <test> <output> <register> <value>: the final state has it
+expect_reg()
+{
+    if echo "$2" | grep -q "^| REG\[$3 *\] | Value = $4 "; then
+        pass "$1"
+    else
+        fail "$1" "R$3 is not $4"
+    fi
+}
+
+# Parser
+
+printf 'MOVC R1,#4\n\n   \nADDL R2,R1,#1\nHALT\n\n' > blank.asm
+out=$("$SIM" blank.asm simulate 100 </dev/null 2>&1)
+if echo "$out" | grep -q "loaded 3 instructions"; then
+    expect_reg parser_blank_lines "$out" 2 5
+else
+    fail parser_blank_lines "blank lines were not skipped"
+fi
+
+printf '\n\n' > empty.asm
+expect_error parser_no_instructions empty.asm "empty.asm: no instructions"
+
+printf 'MOVC R1,#1\n\nADD R1,R2,R3,R4\nHALT\n' > surplus.asm
+expect_error parser_surplus_operand surplus.asm "surplus.asm:3: ADD takes 3 operands"
+
+printf 'MOVC R1,#1\nADD R1,R2,R3,\nHALT\n' > comma.asm
+expect_error parser_trailing_comma comma.asm "comma.asm:2: ADD takes 3 operands"
+
+printf 'HALT R1\n' > halt.asm
+expect_error parser_operand_on_halt halt.asm "halt.asm:1: HALT takes 0 operands"
+
+printf 'ADD R1,#2,R3\nHALT\n' > literal.asm
+expect_error parser_literal_for_register literal.asm \
+    "literal.asm:1: ADD operand 2 is '#2', expected R<n>"
+
+printf 'MOVC R1,R4\nHALT\n' > register.asm
+expect_error parser_register_for_literal register.asm \
+    "register.asm:1: MOVC operand 2 is 'R4', expected #<n>"
+
+printf 'VADD V1,R2,V3\nHALT\n' > vector.asm
+expect_error parser_scalar_for_vector vector.asm \
+    "vector.asm:1: VADD operand 2 is 'R2', expected V<n>"
+
+printf 'MOVC R1,#\nHALT\n' > nonumber.asm
+expect_error parser_missing_number nonumber.asm \
+    "nonumber.asm:1: MOVC operand 2 is '#', expected #<n>"
+
+# Execute
+
+printf 'MOVC R1,#7\nMOVC R2,#0\nDIV R3,R1,R2\nMOVC R4,#-2147483648\nMOVC R5,#-1\n' > div.asm
+printf 'DIV R6,R4,R5\nMOVC R7,#20\nDIV R8,R7,R2\nSUBL R7,R7,#1\nBNZ #-8\nHALT\n' >> div.asm
+for options in "" "--fast-forward"; do
+    out=$("$SIM" div.asm simulate 1000 $options </dev/null 2>&1)
+    status=$?
+    name=div_defined_results${options:+_fast_forward}
+    if [ $status -ne 0 ]; then
+        fail "$name" "exit status $status"
+    else
+        expect_reg "$name" "$out" 3 -1
+        expect_reg "$name" "$out" 6 -2147483648
+        expect_reg "$name" "$out" 8 -1
+    fi
+done
+
+# Profiler
+
+printf 'MOVC R1,#0\nMOVC R2,#50\nLOAD R3,R1,#4\nADD R4,R4,R3\nADDL R1,R1,#1\n' > loop.asm
+printf 'SUBL R2,R2,#1\nBNZ #-16\nSTORE R4,R1,#0\nHALT\n' >> loop.asm
+out=$("$SIM" loop.asm simulate 100000 --profile=loop.prof </dev/null 2>&1)
+cycles=$(echo "$out" | sed -n 's/.*Simulation Complete, cycles = \([0-9]*\) .*/\1/p')
+sum=$(awk 'NR == 1 { frontend = $(NF - 4) } NR > 4 { owned += $1 }
+           END { print owned + frontend }' loop.prof)
+if [ -n "$cycles" ] && [ "$sum" = "$cycles" ] && head -1 loop.prof | grep -q ": $cycles cycles"; then
+    pass profile_sums_to_cycles
+else
+    fail profile_sums_to_cycles "profile charges $sum cycles, the run took $cycles"
+fi
+
+# Debugger
+
+printf 'step 3\nbreak cycle 100\ncontinue\nstep 2\nback 5\nq\n' \
+    | "$SIM" loop.asm debug > debug.out 2>&1
+if grep -q "Stepped back 2 cycles (0 more recorded)" debug.out \
+    && grep -q "Pipeline latches after Clock Cycle #: 100" debug.out; then
+    pass debug_back_stops_at_continue
+else
+    fail debug_back_stops_at_continue "back went past the cycles stepped after continue"
+fi
+
+# Watchpoints
+
+for reg in V1 R16; do
+    out=$("$SIM" loop.asm simulate 100 --watch-reg=$reg </dev/null 2>&1)
+    if [ $? -ne 0 ] && echo "$out" | grep -q "APEX_Error"; then
+        pass watch_rejects_$reg
+    else
+        fail watch_rejects_$reg "--watch-reg=$reg was accepted"
+    fi
+done
+
+# Result cache
+
+mkdir cache
+for command in "simulate 100" "show_mem 30"; do
+    first=$("$SIM" loop.asm $command --fast-forward --cache=cache </dev/null 2>/dev/null)
+    status1=$?
+    second=$("$SIM" loop.asm $command --fast-forward --cache=cache </dev/null 2>/dev/null)
+    status2=$?
+    name=cache_fast_forward_$(echo "$command" | cut -d' ' -f1)
+    if [ $status1 -ne 0 ] || [ $status2 -ne 0 ]; then
+        fail "$name" "exit status $status1 then $status2"
+    elif [ "$first" != "$second" ]; then
+        fail "$name" "the cached run printed something else"
+    else
+        pass "$name"
+    fi
+done
+
+# Scheduler
+
+printf 'MOVC R1,#3\nSTORE R1,R0,#1\nVLOAD V1,R0,#0\nVADD V2,V1,V1\nMOVC R2,#5\n' > vsched.asm
+printf 'MOVC R3,#6\nVSTORE V2,R0,#16\nVMUL V3,V2,V2\nHALT\n' >> vsched.asm
+out=$("$SIM" vsched.asm schedule vsched.out.asm </dev/null 2>&1)
+if echo "$out" | grep -q "same final state" && ! echo "$out" | grep -q "moved 0 "; then
+    pass schedule_vector_program
+else
+    fail schedule_vector_program "$(echo "$out" | grep "APEX_SCHEDULE\|APEX_Error" | tail -1)"
+fi
+
+# Fast-forward
+
+printf 'memory_latency = 2\n' > latency.cfg
+plain=$("$SIM" loop.asm simulate 100000 --config=latency.cfg </dev/null 2>&1 | grep "^APEX_CPU: Memory")
+skipped=$("$SIM" loop.asm simulate 100000 --config=latency.cfg --fast-forward </dev/null 2>&1 \
+    | grep "^APEX_CPU: Memory")
+if [ -n "$plain" ] && [ "$plain" = "$skipped" ]; then
+    pass fast_forward_memory_stats
+else
+    fail fast_forward_memory_stats "'$skipped' instead of '$plain'"
+fi
+
+# Memory images
+
+printf 'memory = 64\n' > small.cfg
+"$SIM" loop.asm simulate 100000 --config=small.cfg --mem-out-raw=small.img </dev/null >/dev/null 2>&1
+size=$(wc -c < small.img)
+if [ "$size" -eq 256 ]; then
+    pass image_saves_configured_memory
+else
+    fail image_saves_configured_memory "image of $size bytes for 64 words"
+fi
+
+head -c 260 /dev/zero > big.img
+out=$("$SIM" loop.asm simulate 100 --config=small.cfg --mem-in=big.img </dev/null 2>&1)
+if [ $? -ne 0 ] && echo "$out" | grep -qF "APEX_Error: Memory image big.img does not fit in 64 words"; then
+    pass image_load_checks_configured_memory
+else
+    fail image_load_checks_configured_memory "a 65 word image loaded into 64 words"
+fi
+
+echo "$FAILED failed"
+exit $FAILED